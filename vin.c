@@ -5,14 +5,31 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -22,6 +39,53 @@
 #define VERSION "0.0.1"
 #define TAB_STOP 2
 #define QUIT_TIMES 2
+#define HASH_BLOCK_ROWS 64
+#define MAX_COUNT 100000000
+#define NUM_REGS 27
+#define JOURNAL_SYNC_MS 1000
+#define JOURNAL_SYNC_BYTES 4096
+#define JOURNAL_PENDING_MAX (64 << 20)
+#define JOURNAL_MAGIC "VINJRNL1"
+#define SUBST_MAX_THREADS 16
+#define SUBST_MIN_ROWS 16384
+#define SORT_MAX_THREADS 16
+#define SORT_MIN_ROWS 65536
+#define GREP_MAX_THREADS 8
+#define GREP_BINARY_PROBE 8000
+#define GREP_TEXT_MAX 120
+#define FINDER_ROWS 10
+#define FINDER_MIN_SLICE 32768
+#define FINDER_MAX_THREADS 8
+#define COMPLETE_MAX 256
+#define SYM_NAME_MAX 128
+#define SYM_CACHE_MAGIC "VINSYM1"
+#define FRAME_RATE 60
+#define FRAME_STALL_MS 100
+#define MACRO_DEPTH 100
+#define MACRO_POLL_KEYS 4096
+#define HEX_COLS 16
+#define DIFF_MIN_COST 1024
+#define DIFF_MIN_SLICE 65536
+#define DIFF_MAX_THREADS 8
+#define BRACKET_NONE (INT_MAX / 2)
+#define BRACKET_WIDE SCHAR_MIN
+#define BRACKET_KINDS 3
+#define HL_SPAN_LONG 15
+#define SYN_DELIM_MAX 16
+#define COLD_BLOCK (1 << 20)
+#define COLD_MIN_MB 4
+#define COLD_MARGIN 1000
+#define COLD_PACK_MS 20
+#define COLD_TRIM_ROWS 4096
+#define COLD_TEXT(n) ((sizeof(rowtext) + (n) + 4) & ~(size_t) 3)
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define FOLLOW_CHUNK (1 << 24)
+#define STREAM_CHUNK (1 << 20)
+#define FILTER_ROWS 512
+#define FILTER_ERR_MAX 80
+#define TYPEAHEAD_MAX 256
+#define JOB_READ 65536
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define LDR 0x20
@@ -35,6 +99,14 @@ enum editorKey {
   FULL_LEFT, START_LINE, END_LINE,
   DEL_CHAR,
   GOTO_TOP, GOTO_BOT,
+  WORD_FWD, WORD_END, WORD_BWD,
+  VISUAL_CHARS, VISUAL_LINES, DELETE_SEL,
+  YANK, YANK_LINES, PASTE_AFTER, PASTE_BEFORE,
+  OP_DELETE, DELETE_LINES, PARA_FWD, PARA_BWD,
+  EX_CMD, QF_NEXT, QF_PREV, FIND_FILE, GOTO_DEF,
+  RECORD_MACRO, PLAY_MACRO,
+  MATCH_PAIR, BLOCK_START, BLOCK_END,
+  COMPLETE_NEXT, COMPLETE_PREV,
   MV_UP, MV_DOWN,
   PG_UP, PG_DOWN,
   WRITE,
@@ -52,6 +124,34 @@ enum modes {
   REPLACE
 };
 
+enum journalOp {
+  J_INSERT_CHAR = 1,
+  J_DEL_CHAR,
+  J_INSERT_ROW,
+  J_DEL_ROWS,
+  J_APPEND,
+  J_REPLACE,
+  J_TRUNCATE
+};
+
+enum regType {
+  REG_EMPTY = 0,
+  REG_CHARS,
+  REG_LINES
+};
+
+enum coldState {
+  COLD_FROZEN = 0,
+  COLD_THAWING,
+  COLD_HOT
+};
+
+enum charClass {
+  CC_BLANK = 0,
+  CC_WORD,
+  CC_PUNCT
+};
+
 enum editorHighlight {
   HL_NORMAL = 0,
   HL_COMMENT,
@@ -60,19 +160,42 @@ enum editorHighlight {
   HL_KEYWORD2,
   HL_STRING,
   HL_NUMBER,
-  HL_MATCH
+  HL_MATCH,
+  HL_DIFF_ADD,
+  HL_DIFF_DEL,
+  HL_DIFF_CHG
 };
 
 #define CURR_ROW \
   (E.cy >= E.numrows) ? NULL : &E.row[E.cy]
 #define VALID_NON_EMPTY_ROW \
   E.cy < E.numrows && E.row[E.cy].size > 0
+#define MOTION_MODE \
+  (E.mode == NORMAL || E.mode == VISUAL)
 
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+#define LEX_UNSET 0xffffffffu
+#define LEX_ENTRY(next, emit, flush) \
+  ((uint32_t)(next) | (uint32_t)(flush) << 16 | (uint32_t)(emit) << 24)
+#define LEX_NEXT(t) ((t) & 0xffff)
+#define LEX_FLUSH(t) (((t) >> 16) & 0xff)
+#define LEX_EMIT(t) ((t) >> 24)
+
 /*** data ***/
 
+typedef struct lexer {
+  int nstates;
+  uint32_t (*table)[256];
+  unsigned char *depth;
+  unsigned char *eol;
+  unsigned char *in_ml;
+  unsigned char *lastc;
+  int start;
+  int ml_start;
+} lexer;
+
 struct editorSyntax {
   char *filetype;
   char **filematch;
@@ -81,14 +204,32 @@ struct editorSyntax {
   char *multiline_comment_start;
   char *multiline_comment_end;
   int flags;
+  char *quotes;
+  lexer *lexer;
 };
 
+typedef struct rowtext {
+  int refs;
+  char chars[];
+} rowtext;
+
+#define TEXT_HDR(p) ((rowtext *)((p) - offsetof(rowtext, chars)))
+
+typedef union hlspans {
+  unsigned char *p;
+  unsigned char in[sizeof(unsigned char *)];
+} hlspans;
+
 typedef struct erow {
-  int idx;
-  int size;
   char *chars;
-  unsigned char *hl;
-  int hl_open_comment;
+  hlspans spans;
+  int size;
+  unsigned int vlines : 30;
+  unsigned int hl_open_comment : 1;
+  unsigned int hl_inline : 1;
+  signed char bsum[BRACKET_KINDS];
+  signed char bmina[BRACKET_KINDS];
+  unsigned char bdip;
 } erow;
 
 typedef struct match {
@@ -97,11 +238,466 @@ typedef struct match {
   int rowoff;
 } match;
 
+typedef struct reg {
+  int type;
+  int live;
+  int start;
+  int count;
+  int sx;
+  int ex;
+  char **text;
+  int *size;
+} reg;
+
 typedef struct saved_hl {
   int line_num;
+  int size;
   unsigned char *saved_line;
 } saved_hl;
 
+typedef struct subst {
+  char *pat;
+  char *lit;
+  int litlen;
+  char *rep;
+  int cflags;
+  int nmatch;
+  int global;
+} subst;
+
+typedef struct substjob {
+  subst *s;
+  int from;
+  int to;
+  int *rows;
+  char **texts;
+  int *sizes;
+  int nchanged;
+  long nsubs;
+  int err;
+  pthread_t thread;
+} substjob;
+
+typedef struct sortitem {
+  uint64_t key;
+  char *s;
+  int len;
+  int idx;
+} sortitem;
+
+typedef struct sortjob {
+  sortitem *items;
+  sortitem *tmp;
+  int lo, mid, hi;
+  int numeric;
+  int icase;
+  pthread_t thread;
+} sortjob;
+
+typedef struct qfitem {
+  char *path;
+  int line;
+  int col;
+  char *text;
+} qfitem;
+
+typedef struct quickfix {
+  qfitem *items;
+  int len;
+  int cap;
+  int index;
+  int seen;
+  pthread_mutex_t lock;
+} quickfix;
+
+typedef struct ignpat {
+  char *glob;
+  int neg;
+  int dironly;
+  int anchored;
+} ignpat;
+
+typedef struct ignorelist {
+  struct ignorelist *parent;
+  struct ignorelist *next;
+  int baselen;
+  ignpat *pats;
+  int npats;
+} ignorelist;
+
+typedef struct grepitem {
+  char *path;
+  int isdir;
+  ignorelist *ign;
+} grepitem;
+
+typedef struct grepjob {
+  char *pat;
+  int patlen;
+  void (*visit)(struct grepjob *, char *);
+  struct dirwatch *watch;
+  int keep_ignores;
+  grepitem *queue;
+  int qlen;
+  int qcap;
+  int busy;
+  int running;
+  int stop;
+  int done;
+  int files;
+  int nthreads;
+  ignorelist *ignores;
+  pthread_t threads[GREP_MAX_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+} grepjob;
+
+typedef struct fentry {
+  char *path;
+  uint64_t mask;
+  int len;
+  int base;
+  int next;
+} fentry;
+
+typedef struct finddir {
+  char *path;
+  ignorelist *ign;
+} finddir;
+
+typedef struct dirwatch {
+  int fd;
+  uint32_t mask;
+  finddir *dirs;
+  int ndirs;
+  pthread_mutex_t lock;
+} dirwatch;
+
+typedef struct finder {
+  fentry *files;
+  int nfiles;
+  int cap;
+  int *buckets;
+  dirwatch watch;
+  grepjob *walk;
+  int gen;
+  int active;
+  char *query;
+  int qgen;
+  int *hits;
+  int nhits;
+  int top[FINDER_ROWS];
+  int ntop;
+  int sel;
+  pthread_mutex_t lock;
+} finder;
+
+typedef struct findjob {
+  const char *q;
+  int qlen;
+  uint64_t qmask;
+  int *cand;
+  int from;
+  int to;
+  int *hits;
+  int nhits;
+  int top[FINDER_ROWS];
+  int score[FINDER_ROWS];
+  int ntop;
+  pthread_t thread;
+} findjob;
+
+typedef struct wnode {
+  int child;
+  int next;
+  int count;
+  int sub;
+  unsigned char c;
+} wnode;
+
+typedef struct wordindex {
+  wnode *nodes;
+  int len;
+  int cap;
+} wordindex;
+
+typedef struct completion {
+  int active;
+  char *prefix;
+  char **words;
+  int n;
+  int idx;
+  int start;
+  int len;
+} completion;
+
+typedef struct symdef {
+  char *name;
+  int line;
+  int col;
+  char kind;
+  struct symdef *next;
+  struct symfile *file;
+} symdef;
+
+typedef struct symfile {
+  char *path;
+  time_t mtime;
+  long nsec;
+  off_t size;
+  symdef *defs;
+  int ndefs;
+  int seen;
+  struct symfile *next;
+} symfile;
+
+typedef struct symtok {
+  char name[SYM_NAME_MAX];
+  int line;
+  int col;
+} symtok;
+
+typedef struct symparse {
+  symdef *defs;
+  int ndefs;
+  int cap;
+  int depth;
+  int paren;
+  int cpp;
+  int tdef;
+  int agg;
+  int params;
+  int ident;
+  int star;
+  char kind;
+  symtok last;
+  symtok func;
+  symtok aggname;
+  symtok fptr;
+} symparse;
+
+typedef struct symtab {
+  symfile **files;
+  int nfiles;
+  int fbuckets;
+  symdef **names;
+  int ndefs;
+  int nbuckets;
+  struct editorSyntax *syntax;
+  grepjob *walk;
+  dirwatch watch;
+  int scanning;
+  int dirty;
+  char *pending;
+  symdef *bufdefs;
+  int nbufdefs;
+  int bufvalid;
+  unsigned long bufgen;
+  pthread_mutex_t lock;
+} symtab;
+
+typedef struct wrapmap {
+  int on;
+  int cols;
+  int *tree;
+  int n;
+  int stale;
+  int top;
+} wrapmap;
+
+typedef struct bracketindex {
+  int *sum[BRACKET_KINDS];
+  int *mina[BRACKET_KINDS];
+  int *minb[BRACKET_KINDS];
+  int size;
+  int n;
+  int stale;
+} bracketindex;
+
+typedef struct macroframe {
+  char *keys;
+  int len;
+  int pos;
+  int times;
+} macroframe;
+
+typedef struct macrostate {
+  int rec;
+  char *buf;
+  int len;
+  int cap;
+  int typed;
+  int last;
+  macroframe stack[MACRO_DEPTH];
+  int depth;
+  int steps;
+  int held;
+  char hold;
+  int batch;
+  int hl_lo;
+  int hl_hi;
+} macrostate;
+
+typedef struct hexpatch {
+  size_t off;
+  unsigned char byte;
+} hexpatch;
+
+typedef struct hexview {
+  int on;
+  int fd;
+  int writable;
+  unsigned char *map;
+  size_t size;
+  size_t cur;
+  size_t top;
+  int nibble;
+  hexpatch *patches;
+  int npatches;
+  int cap;
+} hexview;
+
+typedef struct diffhunk {
+  int a, na;
+  int b, nb;
+} diffhunk;
+
+typedef struct diffjob {
+  erow *rows;
+  uint64_t *out;
+  int from, to;
+  pthread_t thread;
+} diffjob;
+
+typedef struct diffctx {
+  uint64_t *a, *b;
+  char *ca, *cb;
+  int *fd, *bd;
+  int cap;
+} diffctx;
+
+typedef struct diffview {
+  int on;
+  char *filename;
+  erow *rows;
+  uint64_t *hash;
+  int nrows;
+  diffhunk *hunks;
+  int nhunks;
+  int cap;
+  int *pad;
+  int dirty;
+  int lo, hi;
+  int top;
+} diffview;
+
+typedef struct coldblock {
+  char *base;
+  size_t len;
+  size_t maplen;
+  unsigned char *comp;
+  int clen;
+  int refs;
+  volatile int state;
+  unsigned long tick;
+} coldblock;
+
+typedef struct coldstore {
+  coldblock **blocks;
+  int n;
+  int cap;
+  size_t target;
+  unsigned long clock;
+  int *rows;
+  int rowcap;
+  int scan;
+  int clean;
+  int dirty, numrows, rowoff;
+} coldstore;
+
+typedef struct followstate {
+  int on;
+  off_t offset;
+  dev_t dev;
+  ino_t ino;
+  char *buf;
+  size_t cap;
+} followstate;
+
+typedef struct streamchunk {
+  struct streamchunk *next;
+  size_t len;
+  char data[];
+} streamchunk;
+
+typedef struct streamstate {
+  int fd;
+  int done;
+  streamchunk *head, *tail;
+  size_t bytes;
+  pthread_t thread;
+  pthread_mutex_t lock;
+} streamstate;
+
+typedef struct filterjob {
+  pid_t pid;
+  int in;
+  int err;
+  int next;
+  int to;
+  struct iovec iov[FILTER_ROWS * 2];
+  int niov;
+  int iovpos;
+  char errmsg[FILTER_ERR_MAX];
+  int errlen;
+  int errdone;
+  int nout;
+  streamstate out;
+} filterjob;
+
+typedef struct job {
+  char *cmd;
+  pid_t pid;
+  int fd;
+  int status;
+  char *out;
+  size_t len;
+  size_t cap;
+  size_t scan;
+  char *dir;
+  int errors;
+} job;
+
+typedef struct jobset {
+  job *jobs;
+  int n;
+  int cap;
+  int shown;
+} jobset;
+
+typedef struct rowhashes {
+  uint64_t *hash;
+  unsigned char *valid;
+  int cap;
+} rowhashes;
+
+typedef struct journal {
+  int fd;
+  char *path;
+  char *pending;
+  size_t len;
+  size_t cap;
+  int replaying;
+  int stop;
+  int sync_ms;
+  size_t sync_bytes;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_mutex_t io;
+  pthread_cond_t wake;
+  pthread_cond_t drained;
+} journal;
+
 struct editorConfig {
   int cx, cy;
   int rowoff;
@@ -109,18 +705,56 @@ struct editorConfig {
   int screenrows;
   int screencols;
   int numrows;
+  int rowcap;
   erow *row;
   int dirty;
   char *filename;
   char statusmsg[80];
   time_t statusmsg_time;
   int mode;
+  int count;
+  int op;
+  int vmode;
+  int vx, vy;
+  reg regs[NUM_REGS];
+  int regname;
   int dirsearch;
   match *match_cache;
   int num_matches;
   int match_index;
+  int match_last;
   saved_hl *hl_cache;
+  char *search;
   struct editorSyntax *syntax;
+  struct editorSyntax *syntaxdb;
+  int num_syntaxes;
+  int watch_fd;
+  int watch_wd;
+  struct stat disk_st;
+  rowhashes hashes;
+  unsigned long gen;
+  journal jnl;
+  quickfix qf;
+  grepjob *grep;
+  finder finder;
+  wordindex words;
+  completion compl;
+  symtab syms;
+  wrapmap wrap;
+  bracketindex brackets;
+  macrostate macro;
+  hexview hex;
+  diffview diff;
+  coldstore cold;
+  followstate follow;
+  streamstate stream;
+  jobset jobs;
+  char typeahead[TYPEAHEAD_MAX];
+  int typeahead_len;
+  int frame_ms;
+  long long last_frame;
+  int server;
+  int server_fd;
   struct termios orig_termios;
 };
 
@@ -143,7 +777,9 @@ struct editorSyntax HLDB[] = {
     C_HL_extensions,
     C_HL_keywords,
     "//", "/*", "*/",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    "\"'",
+    NULL
   },
 };
 
@@ -152,9 +788,57 @@ struct editorSyntax HLDB[] = {
 /*** prototypes ***/
 
 void editorSetStatusMessage(const char* fmt, ...);
+void editorWatchFile(void);
+int editorDiskChanged(void);
+void editorJournalOpen(int recover);
+void editorJournalReset(void);
+void editorJournalClose(void);
 void editorRefreshScreen(void);
+int editorFrameDue(void);
+int editorServerAccept(void);
+void editorServerAttach(void);
+void editorServerDetach(void);
+void editorServerControl(void);
+void editorServerStop(int force);
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
 void editorProcessKeypress(int action);
+void editorGoToFirstChar(void);
+void editorGoToLine(int line);
+void editorDeleteRange(int linewise, int sy, int sx, int ey, int ex);
+void editorSave(void);
+void editorClearMatches(void);
+int editorPollEvents(void);
+int editorQuickfixPoll(void);
+int editorFinderPoll(void);
+int editorSymbolsPoll(void);
+int editorStreamPoll(void);
+void editorFilter(int from, int to, char *cmd);
+void editorJobStart(char *cmd);
+void editorJobsList(void);
+void editorJobLog(char *arg);
+void editorJobStop(char *arg);
+int editorJobsPoll(void);
+int editorJobsRunning(void);
+void editorSymbolsIndex(char *filename);
+void editorGoToDefinition(char *name);
+void dirWatchAdd(dirwatch *w, char *path, ignorelist *ign);
+void editorJournalRecord(int op, int at, int col, const char *s, size_t len);
+void editorRegistersTouch(int op, int at, int n);
+void editorShiftMatches(int at, int removed, int added);
+void editorBracketsTouch(erow *row, const unsigned char *hl);
+int editorMacroNext(char *c);
+void editorMacroRecord(char c);
+void editorMacroDefer(int at, int n);
+void editorMacroFinish(void);
+void editorHexSave(void);
+void editorHexClose(void);
+void editorDiffTouch(int op, int at, int n);
+void editorHashTouch(int op, int at, int n);
+char *textChars(char *p);
+char *rowChars(erow *row);
+void editorDiffClose(void);
+long long monotonicMs(void);
+void textRelease(char *p);
 
 /*** terminal ***/
 
@@ -188,14 +872,54 @@ void enableRawMode(void) {
     die("tcsetattr");
 }
  
+int editorReadByte(char *c) {
+  if (E.macro.depth)
+    return editorMacroNext(c);
+  if (E.macro.batch) {
+    editorMacroFinish();
+    editorRefreshScreen();
+  }
+
+  if (E.macro.held) {
+    E.macro.held = 0;
+    *c = E.macro.hold;
+  } else if (E.typeahead_len) {
+    *c = E.typeahead[0];
+    memmove(E.typeahead, E.typeahead+1, --E.typeahead_len);
+  } else if (!E.server) {
+    int nread = read(STDIN_FILENO, c, 1);
+    if (nread == -1 && errno != EAGAIN)
+      die ("read");
+    if (nread != 1)
+      return 0;
+  } else {
+    struct pollfd p[2] = { { STDIN_FILENO, POLLIN, 0 }, { E.server_fd, POLLIN, 0 } };
+    if (poll(p, 2, 100) <= 0)
+      return 0;
+    if (p[1].revents & POLLIN) {
+      editorServerAccept();
+      return 0;
+    }
+    if (read(STDIN_FILENO, c, 1) != 1) {
+      editorServerAttach();
+      return 0;
+    }
+    if (*c == '\0') {
+      editorServerControl();
+      return 0;
+    }
+  }
+  editorMacroRecord(*c);
+  return 1;
+}
+
 int editorReadKey(void) {
   static int prev_key = -1;
-  int nread;
   char c;
 
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1)
-      die ("read");
+  while (!editorReadByte(&c)) {
+    if (editorPollEvents())
+      editorRefreshScreen();
   }
 
   if (c == '\x1b') {
@@ -212,16 +936,40 @@ int editorReadKey(void) {
       return CANCEL_CLI;
     }
 
+    if (E.mode == VISUAL)
+      E.mode = NORMAL;
+    E.op = 0;
+    prev_key = c;
+    return BREAK;
+  } else if (MOTION_MODE && prev_key == '"' && c >= 'a' && c <= 'z') {
+    E.regname = c;
+    prev_key = -1;
+    return BREAK;
+  } else if (E.mode == NORMAL && prev_key == 'q' && c >= 'a' && c <= 'z') {
+    E.regname = c;
+    prev_key = -1;
+    return RECORD_MACRO;
+  } else if (E.mode == NORMAL && prev_key == '@' && ((c >= 'a' && c <= 'z') || c == '@')) {
+    E.regname = c;
+    prev_key = -1;
+    return PLAY_MACRO;
+  } else if (MOTION_MODE && prev_key != LDR && isdigit(c) &&
+      (c != '0' || E.count)) {
+    if (E.count < MAX_COUNT)
+      E.count = E.count*10 + (c - '0');
     prev_key = c;
     return BREAK;
   } else if (E.mode == NORMAL && prev_key == LDR) {
     switch (c) {
       case 'q':
-        prev_key = c;
+        prev_key = -1;
         return QUIT;
       case 'w':
         prev_key = c;
         return WRITE;
+      case 'f':
+        prev_key = c;
+        return FIND_FILE;
       case 'n':
         prev_key = LDR1;
         return BREAK;
@@ -263,7 +1011,7 @@ int editorReadKey(void) {
           return BS_CLI;
         }
       case 'h':
-        if (E.mode == NORMAL) {
+        if (MOTION_MODE) {
           if (prev_key == LDR1) {
             prev_key = c;
             return CLR_MATCHES;
@@ -273,19 +1021,19 @@ int editorReadKey(void) {
         }
         break;
       case 'j':
-        if (E.mode == NORMAL) {
+        if (MOTION_MODE) {
           prev_key = c;
           return DOWN;
         }
         break;
       case 'k':
-        if (E.mode == NORMAL) {
+        if (MOTION_MODE) {
           prev_key = c;
           return UP;
         }
         break;
       case 'l':
-        if (E.mode == NORMAL) {
+        if (MOTION_MODE) {
           prev_key = c;
           return RIGHT;
         }
@@ -296,6 +1044,130 @@ int editorReadKey(void) {
           prev_key = c;
           return DEL_CHAR;
         }
+        if (E.mode == VISUAL) {
+          prev_key = c;
+          return DELETE_SEL;
+        }
+        break;
+      case 'd':
+        if (E.mode == VISUAL) {
+          prev_key = c;
+          return DELETE_SEL;
+        }
+        if (c == 'd' && E.mode == NORMAL) {
+          prev_key = c;
+          return E.op == 'd' ? DELETE_LINES : OP_DELETE;
+        }
+        break;
+
+      case '}':
+        if (MOTION_MODE && prev_key == ']') {
+          prev_key = -1;
+          return BLOCK_END;
+        }
+        if (MOTION_MODE) {
+          prev_key = c;
+          return PARA_FWD;
+        }
+        break;
+      case '{':
+        if (MOTION_MODE && prev_key == '[') {
+          prev_key = -1;
+          return BLOCK_START;
+        }
+        if (MOTION_MODE) {
+          prev_key = c;
+          return PARA_BWD;
+        }
+        break;
+      case '%':
+        if (MOTION_MODE) {
+          prev_key = c;
+          return MATCH_PAIR;
+        }
+        break;
+
+      case ':':
+        if (E.mode == NORMAL) {
+          E.mode = CLI;
+          prev_key = c;
+          return EX_CMD;
+        }
+        break;
+
+      case 'q':
+        if (E.mode == NORMAL && (prev_key == ']' || prev_key == '[')) {
+          int key = prev_key == ']' ? QF_NEXT : QF_PREV;
+          prev_key = -1;
+          return key;
+        }
+        if (E.mode == NORMAL && E.macro.rec) {
+          prev_key = -1;
+          return RECORD_MACRO;
+        }
+        if (E.mode == NORMAL) {
+          prev_key = c;
+          return BREAK;
+        }
+        break;
+
+      case '@':
+        if (E.mode == NORMAL) {
+          prev_key = c;
+          return BREAK;
+        }
+        break;
+
+      case 'v':
+        if (MOTION_MODE) {
+          prev_key = c;
+          return VISUAL_CHARS;
+        }
+        break;
+      case 'V':
+        if (MOTION_MODE) {
+          prev_key = c;
+          return VISUAL_LINES;
+        }
+        break;
+
+      case 'y':
+        if (E.mode == VISUAL) {
+          prev_key = c;
+          return YANK;
+        }
+        if (E.mode == NORMAL && prev_key == 'y') {
+          prev_key = -1;
+          return YANK_LINES;
+        }
+        if (E.mode == NORMAL) {
+          prev_key = c;
+          return BREAK;
+        }
+        break;
+      case 'p':
+        if (E.mode == NORMAL) {
+          prev_key = c;
+          return PASTE_AFTER;
+        }
+        break;
+      case 'P':
+        if (E.mode == NORMAL) {
+          prev_key = c;
+          return PASTE_BEFORE;
+        }
+        break;
+      case '"':
+        if (MOTION_MODE) {
+          prev_key = c;
+          return BREAK;
+        }
+        break;
+      case '[': case ']':
+        if (MOTION_MODE) {
+          prev_key = c;
+          return BREAK;
+        }
         break;
 
       case '\r':
@@ -310,57 +1182,102 @@ int editorReadKey(void) {
         }
         E.cy++;
       case '^':
-        prev_key = c;
-        return START_LINE;
+        if (MOTION_MODE) {
+          prev_key = c;
+          return START_LINE;
+        }
+        break;
       case '0':
-        if (E.mode == NORMAL) {
+        if (MOTION_MODE) {
           prev_key = c;
           return FULL_LEFT;
         }
         break;
       case '$':
-        if (E.mode == NORMAL) {
+        if (MOTION_MODE) {
           prev_key = c;
           return END_LINE;
         }
         break;
 
       case 'g':
-        if (E.mode == NORMAL && prev_key == 'g') {
+        if (MOTION_MODE && prev_key == 'g') {
           prev_key = -1;
           return GOTO_TOP;
-          break;
+        }
+        if (MOTION_MODE) {
+          prev_key = c;
+          return BREAK;
         }
         break;
       case 'G':
-        if (E.mode == NORMAL) {
+        if (MOTION_MODE) {
           prev_key = c;
           return GOTO_BOT;
           break;
         }
         break;
 
-      case CTRL_KEY('U'):
+      case 'w':
+        if (MOTION_MODE) {
+          prev_key = c;
+          return WORD_FWD;
+        }
+        break;
+      case 'e':
+        if (MOTION_MODE) {
+          prev_key = c;
+          return WORD_END;
+        }
+        break;
+      case 'b':
+        if (MOTION_MODE) {
+          prev_key = c;
+          return WORD_BWD;
+        }
+        break;
+
+      case CTRL_KEY('N'):
+        if (E.mode == INSERT) {
+          prev_key = c;
+          return COMPLETE_NEXT;
+        }
+        break;
+      case CTRL_KEY('P'):
+        if (E.mode == INSERT) {
+          prev_key = c;
+          return COMPLETE_PREV;
+        }
+        break;
+
+      case CTRL_KEY(']'):
         if (E.mode == NORMAL) {
+          prev_key = c;
+          return GOTO_DEF;
+        }
+        break;
+
+      case CTRL_KEY('U'):
+        if (MOTION_MODE) {
           prev_key = c;
           return MV_UP;
         }
         break;
       case CTRL_KEY('D'):
-        if (E.mode == NORMAL) {
+        if (MOTION_MODE) {
           prev_key = c;
           return MV_DOWN;
         }
         break;
 
       case CTRL_KEY('B'):
-        if (E.mode == NORMAL) {
+        if (MOTION_MODE) {
           prev_key = c;
           return PG_UP;
         }
         break;
       case CTRL_KEY('F'):
-        if (E.mode == NORMAL)
+        if (MOTION_MODE)
           return PG_DOWN;
         break;
 
@@ -378,13 +1295,13 @@ int editorReadKey(void) {
         }
         break;
       case 'n':
-        if (E.mode == NORMAL && E.match_cache) {
+        if (MOTION_MODE && E.match_cache) {
           prev_key = c;
           return NXT_SEARCH;
         }
         break;
       case 'N':
-        if (E.mode == NORMAL && E.match_cache) {
+        if (MOTION_MODE && E.match_cache) {
           prev_key = c;
           return PRV_SEARCH;
         }
@@ -440,201 +1357,633 @@ int is_separator(int c) {
   return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-void editorUpdateSyntax(erow *row) {
-  row->hl = realloc(row->hl, row->size);
-  memset(row->hl, HL_NORMAL, row->size);
-
-  if (E.syntax == NULL)
-    return;
+int lexNewState(lexer *lx, int depth, int lastc) {
+  int s = lx->nstates++;
 
-  char **keywords = E.syntax->keywords;
+  lx->table = realloc(lx->table, sizeof(*lx->table) * lx->nstates);
+  lx->depth = realloc(lx->depth, lx->nstates);
+  lx->eol = realloc(lx->eol, lx->nstates);
+  lx->in_ml = realloc(lx->in_ml, lx->nstates);
+  lx->lastc = realloc(lx->lastc, lx->nstates);
 
-  char *scs = E.syntax->singleline_comment_start;
-  char *mcs = E.syntax->multiline_comment_start;
-  char *mce = E.syntax->multiline_comment_end;
+  for (int c=0; c<256; c++)
+    lx->table[s][c] = LEX_UNSET;
+  lx->depth[s] = depth;
+  lx->eol[s] = HL_NORMAL;
+  lx->in_ml[s] = 0;
+  lx->lastc[s] = lastc;
 
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
+  return s;
+}
 
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = (row->idx > 0 && E.row[row->idx-1].hl_open_comment);
+typedef struct lexdelim {
+  char *s;
+  int len;
+  int state;
+} lexdelim;
+
+int lexFindDelim(lexdelim *d, int n, char *s, int len) {
+  for (int i=0; i<n; i++)
+    if (d[i].len == len && !strncmp(d[i].s, s, len))
+      return d[i].state;
+  return -1;
+}
 
-  int i = 0;
-  while (i<row->size) {
-    char c = row->chars[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i-1] : HL_NORMAL;
+lexer *editorCompileSyntax(struct editorSyntax *syn) {
+  lexer *lx = calloc(1, sizeof(lexer));
+  char *scs = syn->singleline_comment_start;
+  char *mcs = syn->multiline_comment_start;
+  char *mce = syn->multiline_comment_end;
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = (mcs && mce) ? strlen(mcs) : 0;
+  int mce_len = (mcs && mce) ? strlen(mce) : 0;
+  char *quotes = (syn->flags & HL_HIGHLIGHT_STRINGS) && syn->quotes ? syn->quotes : "";
+  int nquotes = strlen(quotes);
+
+  int base[2][2];
+  for (int ps=0; ps<2; ps++)
+    for (int pn=0; pn<2; pn++)
+      base[ps][pn] = lexNewState(lx, 0, 0);
+  int comment = lexNewState(lx, 0, 0);
+
+  int ml = lx->nstates;
+  for (int k=0; k<mce_len; k++) {
+    int s = lexNewState(lx, 0, 0);
+    lx->in_ml[s] = 1;
+  }
 
-    if (scs_len && !in_string && !in_comment)
-      if (!strncmp(&row->chars[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->size - i);
-        break;
+  int str = lx->nstates;
+  for (int q=0; q<2*nquotes; q++)
+    lexNewState(lx, 0, 0);
+
+  lexdelim delims[2*SYN_DELIM_MAX];
+  int ndelims = 0;
+  char *full[2] = { scs, mcs };
+  int full_len[2] = { scs_len, mcs_len };
+  for (int d=0; d<2; d++)
+    for (int k=1; k<full_len[d]; k++)
+      if (lexFindDelim(delims, ndelims, full[d], k) == -1) {
+        delims[ndelims].s = full[d];
+        delims[ndelims].len = k;
+        delims[ndelims].state = lexNewState(lx, k, full[d][k-1]);
+        ndelims++;
       }
 
-    if (mcs_len && mce_len && !in_string) {
-      if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->chars[i], mce, mce_len)) {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        } else {
-          i++;
-          continue;
-        }
-      } else if (!strncmp(&row->chars[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-        i += mcs_len;
-        in_comment = 1;
-        continue;
+  int kwroot[256];
+  for (int c=0; c<256; c++)
+    kwroot[c] = -1;
+  int kwfirst = lx->nstates;
+  for (int j=0; syn->keywords && syn->keywords[j]; j++) {
+    char *kw = syn->keywords[j];
+    int klen = strlen(kw);
+    int kw2 = klen > 0 && kw[klen-1] == '|';
+    if (kw2)
+      klen--;
+    if (klen == 0 || klen > 255)
+      continue;
+
+    unsigned char c0 = kw[0];
+    if (kwroot[c0] == -1)
+      kwroot[c0] = lexNewState(lx, 1, c0);
+    int node = kwroot[c0];
+    for (int i=1; i<klen; i++) {
+      unsigned char c = kw[i];
+      if (lx->table[node][c] == LEX_UNSET) {
+        int child = lexNewState(lx, i+1, c);
+        lx->table[node][c] = LEX_ENTRY(child, HL_NORMAL, 0);
       }
+      node = LEX_NEXT(lx->table[node][c]);
     }
+    if (lx->eol[node] == HL_NORMAL)
+      lx->eol[node] = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+  }
+  int kwlast = lx->nstates;
+
+  for (int ps=0; ps<2; ps++)
+    for (int pn=0; pn<2; pn++)
+      for (int c=0; c<256; c++) {
+        uint32_t t;
+        int d;
+        char ch = c;
+
+        if (scs_len == 1 && c == (unsigned char)scs[0])
+          t = LEX_ENTRY(comment, HL_COMMENT, 0);
+        else if (mcs_len == 1 && c == (unsigned char)mcs[0])
+          t = LEX_ENTRY(ml, HL_MLCOMMENT, 0);
+        else if ((d = lexFindDelim(delims, ndelims, &ch, 1)) != -1)
+          t = LEX_ENTRY(d, HL_NORMAL, 0);
+        else if (c && memchr(quotes, c, nquotes))
+          t = LEX_ENTRY(str + 2*((char *)memchr(quotes, c, nquotes) - quotes), HL_STRING, 0);
+        else if ((syn->flags & HL_HIGHLIGHT_NUMBERS) &&
+            ((isdigit(c) && (ps || pn)) || (c == '.' && pn)))
+          t = LEX_ENTRY(base[0][1], HL_NUMBER, 0);
+        else if (ps && kwroot[c] != -1)
+          t = LEX_ENTRY(kwroot[c], HL_NORMAL, 0);
+        else
+          t = LEX_ENTRY(base[is_separator(c) ? 1 : 0][0], HL_NORMAL, 0);
+
+        lx->table[base[ps][pn]][c] = t;
+      }
 
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (in_string) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i+1 < row->size) {
-          row->hl[i+1] = HL_STRING;
-          i += 2;
-          continue;
-        }
-        if (c == in_string)
-          in_string = 0;
-        i++;
-        prev_sep = 1;
-        continue;
-      } else {
-        if (c == '"' || c == '\'') {
-          in_string = c;
-          row->hl[i] = HL_STRING;
-          i++;
-          continue;
-        }
+  for (int c=0; c<256; c++)
+    lx->table[comment][c] = LEX_ENTRY(comment, HL_COMMENT, 0);
+
+  for (int k=0; k<mce_len; k++)
+    for (int c=0; c<256; c++) {
+      int next;
+      if (c == (unsigned char)mce[k])
+        next = (k+1 == mce_len) ? base[1][0] : ml+k+1;
+      else {
+        char probe[SYN_DELIM_MAX+1];
+        memcpy(probe, mce, k);
+        probe[k] = c;
+        next = ml;
+        for (int j=k; j>0; j--)
+          if (!strncmp(&probe[k+1-j], mce, j)) {
+            next = ml+j;
+            break;
+          }
       }
+      lx->table[ml+k][c] = LEX_ENTRY(next, HL_MLCOMMENT, 0);
     }
 
-    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-          (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
-        i++;
-        prev_sep = 0;
-        continue;
-      }
+  for (int q=0; q<nquotes; q++)
+    for (int c=0; c<256; c++) {
+      int in = str + 2*q, esc = in + 1;
+      if (c == '\\')
+        lx->table[in][c] = LEX_ENTRY(esc, HL_STRING, 0);
+      else if (c == (unsigned char)quotes[q])
+        lx->table[in][c] = LEX_ENTRY(base[1][0], HL_STRING, 0);
+      else
+        lx->table[in][c] = LEX_ENTRY(in, HL_STRING, 0);
+      lx->table[esc][c] = LEX_ENTRY(in, HL_STRING, 0);
     }
 
-    if (prev_sep) {
-      int j;
-      
-      for (j=0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen-1] == '|';
-        if (kw2) klen--;
+  for (int i=0; i<ndelims; i++) {
+    lexdelim *p = &delims[i];
+    char probe[SYN_DELIM_MAX+1];
+    memcpy(probe, p->s, p->len);
+
+    for (int c=0; c<256; c++) {
+      int next;
+      probe[p->len] = c;
+
+      if (p->len+1 == scs_len && !strncmp(probe, scs, scs_len))
+        lx->table[p->state][c] = LEX_ENTRY(comment, HL_COMMENT, HL_COMMENT);
+      else if (p->len+1 == mcs_len && !strncmp(probe, mcs, mcs_len))
+        lx->table[p->state][c] = LEX_ENTRY(ml, HL_MLCOMMENT, HL_MLCOMMENT);
+      else if ((next = lexFindDelim(delims, ndelims, probe, p->len+1)) != -1)
+        lx->table[p->state][c] = LEX_ENTRY(next, HL_NORMAL, 0);
+      else
+        lx->table[p->state][c] = lx->table[base[is_separator(lx->lastc[p->state]) ? 1 : 0][0]][c];
+    }
+  }
 
-        if (!strncmp(&row->chars[i], keywords[j], klen) &&
-            is_separator(row->chars[i+klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL) {
-        prev_sep = 0;
+  for (int node=kwfirst; node<kwlast; node++)
+    for (int c=0; c<256; c++) {
+      if (lx->table[node][c] != LEX_UNSET)
         continue;
-      }
+      if (lx->eol[node] != HL_NORMAL && is_separator(c))
+        lx->table[node][c] = lx->table[base[0][0]][c] | LEX_ENTRY(0, 0, lx->eol[node]);
+      else
+        lx->table[node][c] = lx->table[base[is_separator(lx->lastc[node]) ? 1 : 0][0]][c];
     }
 
-    prev_sep = is_separator(c);
-    i++;
-  }
+  lx->start = base[1][0];
+  lx->ml_start = mce_len ? ml : base[1][0];
 
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx+1 < E.numrows)
-    editorUpdateSyntax(&E.row[row->idx+1]);
+  return lx;
 }
 
-typedef struct colors {
-  int fg;
-  int bg;
-} colors;
+int lexRow(lexer *lx, int in_comment, const char *chars, int size,
+           unsigned char *hl) {
+  int s = in_comment ? lx->ml_start : lx->start;
 
-colors editorSyntaxToColor(int hl) {
-  switch (hl) {
-    case HL_COMMENT:
-    case HL_MLCOMMENT:
-      {
-        colors comment = { 36, 49 };
-        return comment;
-      }
-    case HL_KEYWORD1:
-      {
-        colors kw1 = { 33, 49 };
-        return kw1;
-      }
-    case HL_KEYWORD2:
-      {
-        colors kw2 = { 32, 49 };
-        return kw2;
-      }
-    case HL_STRING:
-      {
-        colors string = { 35, 49 };
-        return string;
-      }
-    case HL_NUMBER:
-      {
-        colors num = { 31, 49 };
-        return num;
-      }
-    case HL_MATCH:
-      {
-        colors match = { 39, 100 };
-        return match;
-      }
-    default:
-      {
-        colors reset = { 39, 49 };
-        return reset;
-      }
+  for (int i=0; i<size; i++) {
+    uint32_t t = lx->table[s][(unsigned char) chars[i]];
+    if (LEX_FLUSH(t))
+      memset(&hl[i - lx->depth[s]], LEX_FLUSH(t), lx->depth[s]);
+    hl[i] = LEX_EMIT(t);
+    s = LEX_NEXT(t);
   }
+  if (lx->eol[s] != HL_NORMAL)
+    memset(&hl[size - lx->depth[s]], lx->eol[s], lx->depth[s]);
+  return lx->in_ml[s];
 }
 
-void editorSelectSyntaxHighlight(void) {
-  E.syntax = NULL;
-  if (E.filename == NULL)
+unsigned char *hlScratch(int len) {
+  static unsigned char *buf;
+  static int cap;
+
+  if (len > cap) {
+    cap = len * 2;
+    buf = realloc(buf, cap);
+  }
+  return buf;
+}
+
+int hlPut(unsigned char *out, int cls, int n) {
+  if (n < HL_SPAN_LONG) {
+    if (out)
+      *out = cls << 4 | n;
+    return 1;
+  }
+
+  int len = 1;
+  if (out)
+    *out++ = cls << 4 | HL_SPAN_LONG;
+  for (n -= HL_SPAN_LONG - 1; n >= 0x80; n >>= 7, len++)
+    if (out)
+      *out++ = (n & 0x7f) | 0x80;
+  if (out)
+    *out = n;
+  return len + 1;
+}
+
+int hlRuns(unsigned char *out, const unsigned char *hl, int size) {
+  int len = 0, run;
+
+  for (int i=0; i<size; i += run) {
+    for (run = 1; i+run < size && hl[i+run] == hl[i]; run++)
+      ;
+    if (i+run == size && hl[i] == HL_NORMAL)
+      break;
+    len += hlPut(out ? out + len : NULL, hl[i], run);
+  }
+  return len;
+}
+
+int hlNext(const unsigned char **p, int *cls) {
+  const unsigned char *s = *p;
+  if (s == NULL || *s == 0)
+    return 0;
+
+  int n = *s & 0x0f;
+  *cls = *s++ >> 4;
+  if (n == HL_SPAN_LONG) {
+    int v = 0, shift = 0;
+    do {
+      v |= (*s & 0x7f) << shift;
+      shift += 7;
+    } while (*s++ & 0x80);
+    n += v - 1;
+  }
+  *p = s;
+  return n;
+}
+
+const unsigned char *hlSpans(erow *row) {
+  return row->hl_inline ? row->spans.in : row->spans.p;
+}
+
+unsigned char *hlDecode(erow *row) {
+  unsigned char *hl = hlScratch(row->size + 1);
+  const unsigned char *p = hlSpans(row);
+  int at = 0, cls, n;
+
+  while (at < row->size && (n = hlNext(&p, &cls)) > 0) {
+    if (n > row->size - at)
+      n = row->size - at;
+    memset(&hl[at], cls, n);
+    at += n;
+  }
+  memset(&hl[at], HL_NORMAL, row->size - at);
+  return hl;
+}
+
+void hlFree(erow *row) {
+  if (!row->hl_inline)
+    free(row->spans.p);
+  row->spans.p = NULL;
+  row->hl_inline = 0;
+}
+
+void hlStore(erow *row, const unsigned char *hl) {
+  hlFree(row);
+  int len = hlRuns(NULL, hl, row->size);
+  if (len == 0)
+    return;
+
+  if (len < (int)sizeof(row->spans.in)) {
+    memset(row->spans.in, 0, sizeof(row->spans.in));
+    hlRuns(row->spans.in, hl, row->size);
+    row->hl_inline = 1;
+    return;
+  }
+  row->spans.p = malloc(len + 1);
+  hlRuns(row->spans.p, hl, row->size);
+  row->spans.p[len] = 0;
+}
+
+unsigned char *hlDup(erow *row) {
+  const unsigned char *p = hlSpans(row);
+  return p ? (unsigned char *) strdup((const char *) p) : NULL;
+}
+
+void hlAdopt(erow *row, unsigned char *spans) {
+  hlFree(row);
+  if (spans && strlen((char *) spans) < sizeof(row->spans.in)) {
+    memset(row->spans.in, 0, sizeof(row->spans.in));
+    strcpy((char *) row->spans.in, (char *) spans);
+    row->hl_inline = 1;
+    free(spans);
+  } else
+    row->spans.p = spans;
+}
+
+int editorHighlightRow(erow *row) {
+  unsigned char *hl = hlScratch(row->size + 1);
+  memset(hl, HL_NORMAL, row->size);
+
+  if (E.syntax == NULL) {
+    hlFree(row);
+    editorBracketsTouch(row, hl);
+    return 0;
+  }
+
+  int at = row - E.row;
+  int in_comment = (at > 0 && E.row[at-1].hl_open_comment);
+  in_comment = lexRow(E.syntax->lexer, in_comment, rowChars(row), row->size, hl);
+  hlStore(row, hl);
+  editorBracketsTouch(row, hl);
+
+  int changed = (row->hl_open_comment != in_comment);
+  row->hl_open_comment = in_comment;
+  return changed;
+}
+
+void editorUpdateSyntax(erow *row) {
+  if (E.macro.batch) {
+    editorMacroDefer(row - E.row, 1);
     return;
+  }
+  while (editorHighlightRow(row) && row+1 < &E.row[E.numrows])
+    row++;
+}
+
+typedef struct colors {
+  int fg;
+  int bg;
+} colors;
+
+colors editorSyntaxToColor(int hl) {
+  switch (hl) {
+    case HL_COMMENT:
+    case HL_MLCOMMENT:
+      {
+        colors comment = { 36, 49 };
+        return comment;
+      }
+    case HL_KEYWORD1:
+      {
+        colors kw1 = { 33, 49 };
+        return kw1;
+      }
+    case HL_KEYWORD2:
+      {
+        colors kw2 = { 32, 49 };
+        return kw2;
+      }
+    case HL_STRING:
+      {
+        colors string = { 35, 49 };
+        return string;
+      }
+    case HL_NUMBER:
+      {
+        colors num = { 31, 49 };
+        return num;
+      }
+    case HL_MATCH:
+      {
+        colors match = { 39, 100 };
+        return match;
+      }
+    case HL_DIFF_ADD:
+      {
+        colors add = { 39, 42 };
+        return add;
+      }
+    case HL_DIFF_DEL:
+      {
+        colors del = { 39, 41 };
+        return del;
+      }
+    case HL_DIFF_CHG:
+      {
+        colors chg = { 39, 44 };
+        return chg;
+      }
+    default:
+      {
+        colors reset = { 39, 49 };
+        return reset;
+      }
+  }
+}
 
-  char *ext = strrchr(E.filename, '.');
+struct editorSyntax *editorSyntaxFor(const char *filename) {
+  char *ext = strrchr(filename, '.');
 
-  for (unsigned int j=0; j<HLDB_ENTRIES; j++) {
-    struct editorSyntax *s = &HLDB[j];
-    unsigned int i = 0;
+  for (int j=0; j<E.num_syntaxes; j++) {
+    struct editorSyntax *s = &E.syntaxdb[j];
 
-    while (s->filematch[i]) {
+    for (int i=0; s->filematch[i]; i++) {
       int is_ext = (s->filematch[i][0] == '.');
       if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-          (!is_ext && strstr(E.filename, s->filematch[i]))) {
-        E.syntax = s;
+          (!is_ext && strstr(filename, s->filematch[i]))) {
+        if (s->lexer == NULL)
+          s->lexer = editorCompileSyntax(s);
+        return s;
+      }
+    }
+  }
+  return NULL;
+}
 
-        for (int filerow=0; filerow<E.numrows; filerow++)
-          editorUpdateSyntax(&E.row[filerow]);
+void editorSelectSyntaxHighlight(void) {
+  E.syntax = NULL;
+  if (E.filename == NULL)
+    return;
 
-        return;
+  E.syntax = editorSyntaxFor(E.filename);
+  if (E.syntax == NULL)
+    return;
+
+  for (int filerow=0; filerow<E.numrows; filerow++)
+    editorUpdateSyntax(&E.row[filerow]);
+}
+
+char **splitWords(char *line, int suffix) {
+  char **words = NULL;
+  int n = 0;
+
+  for (char *w = strtok(line, " \t"); w; w = strtok(NULL, " \t")) {
+    words = realloc(words, sizeof(char *) * (n+2));
+    words[n] = malloc(strlen(w) + 2);
+    sprintf(words[n], suffix ? "%s|" : "%s", w);
+    n++;
+  }
+  if (words)
+    words[n] = NULL;
+
+  return words;
+}
+
+char **joinWords(char **a, char **b) {
+  int na = 0, nb = 0;
+
+  while (a && a[na])
+    na++;
+  while (b && b[nb])
+    nb++;
+
+  char **out = malloc(sizeof(char *) * (na+nb+1));
+  memcpy(out, a, sizeof(char *) * na);
+  memcpy(&out[na], b, sizeof(char *) * nb);
+  out[na+nb] = NULL;
+  free(a);
+  free(b);
+
+  return out;
+}
+
+int editorParseSyntaxFile(char *path, struct editorSyntax *syn) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return 0;
+
+  memset(syn, 0, sizeof(*syn));
+
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    while (linelen > 0 && isspace((unsigned char)line[linelen-1]))
+      line[--linelen] = '\0';
+    if (linelen == 0 || line[0] == '#')
+      continue;
+
+    char *val = strpbrk(line, " \t");
+    if (val)
+      *val++ = '\0';
+    else
+      val = "";
+    while (*val == ' ' || *val == '\t')
+      val++;
+
+    if (!strcmp(line, "filetype")) {
+      free(syn->filetype);
+      syn->filetype = strdup(val);
+    } else if (!strcmp(line, "match"))
+      syn->filematch = joinWords(syn->filematch, splitWords(val, 0));
+    else if (!strcmp(line, "keywords"))
+      syn->keywords = joinWords(syn->keywords, splitWords(val, 0));
+    else if (!strcmp(line, "types"))
+      syn->keywords = joinWords(syn->keywords, splitWords(val, 1));
+    else if (!strcmp(line, "comment")) {
+      free(syn->singleline_comment_start);
+      syn->singleline_comment_start = *val ? strdup(val) : NULL;
+    } else if (!strcmp(line, "multiline")) {
+      char **delims = splitWords(val, 0);
+      if (delims && delims[1]) {
+        syn->multiline_comment_start = delims[0];
+        syn->multiline_comment_end = delims[1];
       }
-      i++;
+      free(delims);
+    } else if (!strcmp(line, "strings")) {
+      char **quotes = splitWords(val, 0);
+      int n = 0;
+      free(syn->quotes);
+      syn->quotes = calloc(1, 64);
+      while (quotes && quotes[n] && n < 63) {
+        syn->quotes[n] = quotes[n][0];
+        free(quotes[n++]);
+      }
+      free(quotes);
+      syn->flags |= HL_HIGHLIGHT_STRINGS;
+    } else if (!strcmp(line, "numbers"))
+      syn->flags |= HL_HIGHLIGHT_NUMBERS;
+  }
+  free(line);
+  fclose(fp);
+
+  char *delim[3] = { syn->singleline_comment_start, syn->multiline_comment_start,
+                     syn->multiline_comment_end };
+  for (int i=0; i<3; i++)
+    if (delim[i] && strlen(delim[i]) > SYN_DELIM_MAX) {
+      editorSetStatusMessage("%s: comment delimiter longer than %d bytes, ignored",
+                             path, SYN_DELIM_MAX);
+      free(syn->filetype);
+      return 0;
+    }
+  if (!syn->filetype || !syn->filematch) {
+    free(syn->filetype);
+    return 0;
+  }
+  if (!syn->keywords)
+    syn->keywords = joinWords(NULL, NULL);
+
+  return 1;
+}
+
+void editorLoadSyntaxDir(char *dirpath) {
+  DIR *dir = opendir(dirpath);
+  if (!dir)
+    return;
+
+  struct dirent *ent;
+  while ((ent = readdir(dir))) {
+    char *ext = strrchr(ent->d_name, '.');
+    if (!ext || strcmp(ext, ".syn"))
+      continue;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dirpath, ent->d_name);
+
+    struct editorSyntax syn;
+    if (editorParseSyntaxFile(path, &syn)) {
+      E.syntaxdb = realloc(E.syntaxdb, sizeof(syn) * (E.num_syntaxes+1));
+      E.syntaxdb[E.num_syntaxes++] = syn;
+    }
+  }
+  closedir(dir);
+}
+
+void editorLoadSyntaxFiles(void) {
+  char path[4096];
+  char *config = getenv("XDG_CONFIG_HOME");
+  char *home = getenv("HOME");
+
+  if (config && *config) {
+    snprintf(path, sizeof(path), "%s/vin/syntax", config);
+    editorLoadSyntaxDir(path);
+  } else if (home) {
+    snprintf(path, sizeof(path), "%s/.config/vin/syntax", home);
+    editorLoadSyntaxDir(path);
+  }
+
+  ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 8);
+  if (len > 0) {
+    path[len] = '\0';
+    char *slash = strrchr(path, '/');
+    if (slash) {
+      strcpy(slash, "/syntax");
+      editorLoadSyntaxDir(path);
     }
   }
+
+  E.syntaxdb = realloc(E.syntaxdb, sizeof(HLDB) + sizeof(HLDB[0]) * E.num_syntaxes);
+  memcpy(&E.syntaxdb[E.num_syntaxes], HLDB, sizeof(HLDB));
+  E.num_syntaxes += HLDB_ENTRIES;
 }
 
-void saveRowHighlighting(int row_num, unsigned char *line) {
+void saveRowHighlighting(int row_num, unsigned char *spans) {
   E.hl_cache = realloc(E.hl_cache, sizeof(saved_hl) * (E.num_matches+1));
   E.hl_cache[E.num_matches].line_num = row_num;
-  E.hl_cache[E.num_matches].saved_line = malloc(E.row[row_num].size);
-  memcpy(E.hl_cache[E.num_matches].saved_line, line, E.row[row_num].size);
+  E.hl_cache[E.num_matches].size = E.row[row_num].size;
+  E.hl_cache[E.num_matches].saved_line = spans;
 }
 
 void restoreRowHighlighting(void) {
@@ -642,8 +1991,14 @@ void restoreRowHighlighting(void) {
 
   while (i>=0) {
     saved_hl *to_restore = &E.hl_cache[i];
-    memcpy(E.row[to_restore->line_num].hl, to_restore->saved_line, E.row[to_restore->line_num].size);
-    free(to_restore->saved_line);
+    erow *row = &E.row[to_restore->line_num];
+    if (to_restore->line_num < E.numrows && row->size == to_restore->size)
+      hlAdopt(row, to_restore->saved_line);
+    else {
+      free(to_restore->saved_line);
+      if (to_restore->line_num < E.numrows)
+        editorHighlightRow(row);
+    }
     i--;
   }
 
@@ -651,222 +2006,6230 @@ void restoreRowHighlighting(void) {
   E.hl_cache = NULL;
 }
 
-/*** row operations ***/
+/*** word index ***/
 
-int editorUpdateRow(erow *row) {
-  int tabs = 0, j = 0;
-  while (j < row->size)
-    if (row->chars[j++] == '\t')
-      tabs++;
+int wordChild(int n, unsigned char c, int create) {
+  wordindex *W = &E.words;
+  int prev = 0, cur = W->nodes[n].child;
 
-  char *new = malloc(row->size + tabs*(TAB_STOP-1) + 1);
-  
-  int i = 0, inc = 1;
-  for (int k=0; k<row->size; k++) {
-    if (row->chars[k] == '\t') {
-      new[i++] = ' ';
-      while (i % TAB_STOP != 0) {
-        inc++;
-        new[i++] = ' ';
-      }
-    } else
-      new[i++] = row->chars[k];
+  while (cur && W->nodes[cur].c < c) {
+    prev = cur;
+    cur = W->nodes[cur].next;
   }
-  new[i] = '\0';
-  row->chars = realloc(row->chars, i+1);
-  memcpy(row->chars, new, i+1);
-  row->size = i;
-  free(new);
+  if (cur && W->nodes[cur].c == c)
+    return cur;
+  if (!create)
+    return 0;
 
-  editorUpdateSyntax(row);
+  if (W->len == W->cap) {
+    W->cap *= 2;
+    W->nodes = realloc(W->nodes, sizeof(wnode) * W->cap);
+  }
+  int k = W->len++;
+  W->nodes[k] = (wnode) { 0, cur, 0, 0, c };
+  if (prev)
+    W->nodes[prev].next = k;
+  else
+    W->nodes[n].child = k;
+  return k;
+}
 
-  return inc;
+void wordsAdd(const char *s, int len, int delta) {
+  wordindex *W = &E.words;
+  int n = 0;
+
+  W->nodes[0].sub += delta;
+  for (int i=0; i<len; i++) {
+    n = wordChild(n, s[i], delta > 0);
+    if (n == 0)
+      return;
+    W->nodes[n].sub += delta;
+  }
+  W->nodes[n].count += delta;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numrows)
+void editorWordsTouch(erow *row, int delta) {
+  if (E.words.nodes == NULL)
     return;
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows+1));
-  memmove(&E.row[at+1], &E.row[at], sizeof(erow) * (E.numrows-at));
-  for (int j = at+1; j <= E.numrows; j++)
-    E.row[j].idx++;
 
-  E.row[at].idx = at;
+  char *chars = rowChars(row);
+  int i = 0;
+  while (i < row->size) {
+    while (i < row->size && is_separator((unsigned char)chars[i]))
+      i++;
+    int start = i;
+    while (i < row->size && !is_separator((unsigned char)chars[i]))
+      i++;
+    if (i - start >= 2)
+      wordsAdd(&chars[start], i - start, delta);
+  }
+}
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len+1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+void editorWordsBuild(void) {
+  wordindex *W = &E.words;
 
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
-  editorUpdateRow(&E.row[at]);
+  W->cap = 1024;
+  W->nodes = malloc(sizeof(wnode) * W->cap);
+  W->nodes[0] = (wnode) { 0, 0, 0, 0, 0 };
+  W->len = 1;
+  for (int i=0; i<E.numrows; i++)
+    editorWordsTouch(&E.row[i], 1);
+}
 
-  E.numrows++;
-  E.dirty++;
+void wordsCollect(int n, char **buf, int *cap, int depth, int plen,
+                  char **out, int *nout) {
+  wordindex *W = &E.words;
+
+  if (W->nodes[n].count > 0 && depth > plen)
+    out[(*nout)++] = strndup(*buf, depth);
+
+  for (int k = W->nodes[n].child; k && *nout < COMPLETE_MAX; k = W->nodes[k].next) {
+    if (W->nodes[k].sub <= 0)
+      continue;
+    if (depth+1 >= *cap) {
+      *cap *= 2;
+      *buf = realloc(*buf, *cap);
+    }
+    (*buf)[depth] = W->nodes[k].c;
+    wordsCollect(k, buf, cap, depth+1, plen, out, nout);
+  }
 }
 
-int editorGetFirstCharIdx(erow *row) {
-  int i = 0;
+int editorWordsLookup(const char *prefix, int plen, char **out) {
+  int n = 0, nout = 0;
+
+  for (int i=0; i<plen && (n = wordChild(n, prefix[i], 0)); i++)
+    ;
+  if (plen > 0 && n == 0)
+    return 0;
+
+  int cap = plen + 64;
+  char *buf = malloc(cap);
+  memcpy(buf, prefix, plen);
+  wordsCollect(n, &buf, &cap, plen, plen, out, &nout);
+  free(buf);
+  return nout;
+}
+
+/*** soft wrap ***/
+
+int wrapHeight(erow *row) {
+  return row->size <= E.wrap.cols ? 1 : (row->size + E.wrap.cols - 1) / E.wrap.cols;
+}
+
+void wrapAdd(int i, int delta) {
+  for (i++; i <= E.wrap.n; i += i & -i)
+    E.wrap.tree[i] += delta;
+}
+
+int wrapPrefix(int i) {
+  int sum = 0;
+  for (; i > 0; i -= i & -i)
+    sum += E.wrap.tree[i];
+  return sum;
+}
+
+int wrapFind(int vline) {
+  int pos = 0, step = 1;
+
+  while (step * 2 <= E.wrap.n)
+    step *= 2;
+  for (; step; step /= 2)
+    if (pos + step <= E.wrap.n && E.wrap.tree[pos+step] <= vline) {
+      pos += step;
+      vline -= E.wrap.tree[pos];
+    }
+  return pos;
+}
+
+void wrapBuild(void) {
+  wrapmap *W = &E.wrap;
+  int resized = W->cols != E.screencols;
+
+  W->cols = E.screencols;
+  W->n = E.numrows;
+  W->tree = realloc(W->tree, sizeof(int) * (W->n + 1));
+  W->tree[0] = 0;
+  for (int i=0; i<W->n; i++) {
+    erow *row = &E.row[i];
+    if (resized || row->vlines == 0)
+      row->vlines = wrapHeight(row);
+    W->tree[i+1] = row->vlines;
+  }
+  for (int i=1; i<=W->n; i++) {
+    int j = i + (i & -i);
+    if (j <= W->n)
+      W->tree[j] += W->tree[i];
+  }
+  W->stale = 0;
+}
+
+void wrapExtend(void) {
+  wrapmap *W = &E.wrap;
+
+  W->tree = realloc(W->tree, sizeof(int) * (E.numrows + 1));
+  for (int i=W->n; i<E.numrows; i++) {
+    erow *row = &E.row[i];
+    row->vlines = wrapHeight(row);
+    W->tree[i+1] = row->vlines + wrapPrefix(i) - wrapPrefix((i+1) - ((i+1) & -(i+1)));
+    W->n = i+1;
+  }
+}
+
+void editorWrapSync(void) {
+  if (!E.wrap.on)
+    return;
+  if (E.wrap.stale || E.wrap.cols != E.screencols || E.wrap.n > E.numrows)
+    wrapBuild();
+  else if (E.wrap.n < E.numrows)
+    wrapExtend();
+}
+
+void editorWrapTouch(erow *row) {
+  if (!E.wrap.on || E.wrap.stale) {
+    row->vlines = 0;
+    return;
+  }
+  int h = wrapHeight(row);
+  if (h != row->vlines && row - E.row < E.wrap.n)
+    wrapAdd(row - E.row, h - row->vlines);
+  row->vlines = h;
+}
+
+void editorWrapCursor(int *vline, int *x) {
+  int line = 0;
+  *x = E.cx;
+
+  if (E.cy < E.numrows) {
+    line = E.cx / E.wrap.cols;
+    if (line >= E.row[E.cy].vlines)
+      line = E.row[E.cy].vlines - 1;
+    *x = E.cx - line * E.wrap.cols;
+    if (*x >= E.wrap.cols)
+      *x = E.wrap.cols - 1;
+  }
+  *vline = wrapPrefix(E.cy) + line;
+}
+
+void editorWrapPage(int dir, int times) {
+  editorWrapSync();
+  int total = wrapPrefix(E.numrows);
+  long long top = E.wrap.top + (long long) dir * E.screenrows * times;
+
+  if (top > total - 1)
+    top = total > 0 ? total - 1 : 0;
+  if (top < 0)
+    top = 0;
+  E.wrap.top = top;
+
+  if (dir > 0) {
+    E.cy = wrapFind(top);
+    if (E.cy < E.numrows && wrapPrefix(E.cy) < top)
+      E.cy++;
+  } else {
+    E.cy = wrapFind(top + E.screenrows - 1);
+    if (E.cy > 0 && wrapPrefix(E.cy+1) > top + E.screenrows)
+      E.cy--;
+  }
+  if (E.cy > E.numrows)
+    E.cy = E.numrows;
+  if (E.cy < E.numrows && E.cx > E.row[E.cy].size)
+    E.cx = E.row[E.cy].size;
+}
+
+void editorSetWrap(int on) {
+  E.wrap.on = on;
+  E.wrap.stale = 1;
+  E.coloff = 0;
+  if (on) {
+    editorWrapSync();
+    E.wrap.top = wrapPrefix(E.rowoff);
+  }
+}
+
+/*** brackets ***/
+
+int bracketKind(char c) {
+  switch (c) {
+    case '(': case ')': return 0;
+    case '[': case ']': return 1;
+    case '{': case '}': return 2;
+  }
+  return -1;
+}
+
+/* Depth change at j, counting only brackets of the given kind (any if -1). */
+int bracketDelta(erow *row, const unsigned char *hl, int j, int kind) {
+  if (hl[j] == HL_COMMENT || hl[j] == HL_MLCOMMENT || hl[j] == HL_STRING)
+    return 0;
+
+  char c = rowChars(row)[j];
+  int k = bracketKind(c);
+  if (k == -1 || (kind != -1 && k != kind))
+    return 0;
+  return c == '(' || c == '[' || c == '{' ? 1 : -1;
+}
+
+void bracketPull(int i) {
+  bracketindex *B = &E.brackets;
+  int l = 2*i, r = 2*i+1;
+
+  for (int k=0; k<BRACKET_KINDS; k++) {
+    int *sum = B->sum[k], *mina = B->mina[k], *minb = B->minb[k];
+    sum[i] = sum[l] + sum[r];
+    mina[i] = mina[l] < sum[l] + mina[r] ? mina[l] : sum[l] + mina[r];
+    minb[i] = minb[l] < sum[l] + minb[r] ? minb[l] : sum[l] + minb[r];
+  }
+}
+
+void bracketScan(erow *row, const unsigned char *hl, int *sum, int *mina, int *minb) {
+  for (int k=0; k<BRACKET_KINDS; k++) {
+    sum[k] = 0;
+    mina[k] = minb[k] = BRACKET_NONE;
+  }
+  for (int j=0; j<row->size; j++) {
+    int d = bracketDelta(row, hl, j, -1);
+    if (d == 0)
+      continue;
+    int k = bracketKind(rowChars(row)[j]);
+    if (sum[k] < minb[k])
+      minb[k] = sum[k];
+    sum[k] += d;
+    if (sum[k] < mina[k])
+      mina[k] = sum[k];
+  }
+}
+
+/* Rows keep only sum and mina per kind.  minb can only differ from
+ * min(0, mina) when the last bracket set a new low, and then it is
+ * min(0, mina + 1); bdip has a bit per kind for that case. */
+void bracketSummary(erow *row, int *sum, int *mina, int *minb) {
+  if (row->bsum[0] == BRACKET_WIDE) {
+    bracketScan(row, hlDecode(row), sum, mina, minb);
+    return;
+  }
+  for (int k=0; k<BRACKET_KINDS; k++) {
+    sum[k] = row->bsum[k];
+    if (row->bmina[k] == SCHAR_MAX) {
+      mina[k] = minb[k] = BRACKET_NONE;
+      continue;
+    }
+    mina[k] = row->bmina[k];
+    int low = mina[k] + (row->bdip >> k & 1);
+    minb[k] = low < 0 ? low : 0;
+  }
+}
+
+void bracketBuild(void) {
+  bracketindex *B = &E.brackets;
+
+  B->size = 1;
+  while (B->size < E.numrows)
+    B->size *= 2;
+  for (int k=0; k<BRACKET_KINDS; k++) {
+    B->sum[k] = realloc(B->sum[k], sizeof(int) * 2 * B->size);
+    B->mina[k] = realloc(B->mina[k], sizeof(int) * 2 * B->size);
+    B->minb[k] = realloc(B->minb[k], sizeof(int) * 2 * B->size);
+  }
+  for (int i=0; i<B->size; i++) {
+    int j = B->size + i;
+    int sum[BRACKET_KINDS], mina[BRACKET_KINDS], minb[BRACKET_KINDS];
+    if (i < E.numrows)
+      bracketSummary(&E.row[i], sum, mina, minb);
+    for (int k=0; k<BRACKET_KINDS; k++) {
+      B->sum[k][j] = i < E.numrows ? sum[k] : 0;
+      B->mina[k][j] = i < E.numrows ? mina[k] : BRACKET_NONE;
+      B->minb[k][j] = i < E.numrows ? minb[k] : BRACKET_NONE;
+    }
+  }
+  for (int i=B->size-1; i>0; i--)
+    bracketPull(i);
+  B->n = E.numrows;
+  B->stale = 0;
+}
+
+void editorBracketsSync(void) {
+  if (E.brackets.stale || E.brackets.n != E.numrows)
+    bracketBuild();
+}
+
+int bracketPacks(int v) {
+  return v == BRACKET_NONE || (v > SCHAR_MIN && v < SCHAR_MAX);
+}
+
+void editorBracketsTouch(erow *row, const unsigned char *hl) {
+  bracketindex *B = &E.brackets;
+  int sum[BRACKET_KINDS], mina[BRACKET_KINDS], minb[BRACKET_KINDS];
+  int packs = 1;
+
+  bracketScan(row, hl, sum, mina, minb);
+  for (int k=0; k<BRACKET_KINDS; k++)
+    packs = packs && bracketPacks(sum[k]) && bracketPacks(mina[k]);
+  if (packs) {
+    row->bdip = 0;
+    for (int k=0; k<BRACKET_KINDS; k++) {
+      row->bsum[k] = sum[k];
+      row->bmina[k] = mina[k] == BRACKET_NONE ? SCHAR_MAX : mina[k];
+      if (mina[k] != BRACKET_NONE && minb[k] != (mina[k] < 0 ? mina[k] : 0))
+        row->bdip |= 1 << k;
+    }
+  } else
+    row->bsum[0] = BRACKET_WIDE;
+
+  int at = row - E.row;
+  if (B->stale || at >= B->n)
+    return;
+  int i = B->size + at;
+  for (int k=0; k<BRACKET_KINDS; k++) {
+    B->sum[k][i] = sum[k];
+    B->mina[k][i] = mina[k];
+    B->minb[k][i] = minb[k];
+  }
+  for (i /= 2; i > 0; i /= 2)
+    bracketPull(i);
+}
+
+int bracketPrefix(int at, int kind) {
+  bracketindex *B = &E.brackets;
+  int sum = 0;
+
+  for (int lo = B->size, hi = B->size + at; lo < hi; lo /= 2, hi /= 2) {
+    if (lo & 1)
+      sum += B->sum[kind][lo++];
+    if (hi & 1)
+      sum += B->sum[kind][--hi];
+  }
+  return sum;
+}
+
+int bracketFirst(int node, int lo, int hi, int from, int *base, int depth, int kind) {
+  bracketindex *B = &E.brackets;
+
+  if (hi <= from)
+    return -1;
+  if (lo >= from && *base + B->mina[kind][node] >= depth) {
+    *base += B->sum[kind][node];
+    return -1;
+  }
+  if (hi - lo == 1)
+    return lo;
+  int mid = (lo + hi) / 2;
+  int r = bracketFirst(2*node, lo, mid, from, base, depth, kind);
+  return r != -1 ? r : bracketFirst(2*node+1, mid, hi, from, base, depth, kind);
+}
+
+int bracketLast(int node, int lo, int hi, int to, int *base, int depth, int kind) {
+  bracketindex *B = &E.brackets;
+
+  if (lo >= to)
+    return -1;
+  if (hi <= to && *base - B->sum[kind][node] + B->minb[kind][node] >= depth) {
+    *base -= B->sum[kind][node];
+    return -1;
+  }
+  if (hi - lo == 1)
+    return lo;
+  int mid = (lo + hi) / 2;
+  int r = bracketLast(2*node+1, mid, hi, to, base, depth, kind);
+  return r != -1 ? r : bracketLast(2*node, lo, mid, to, base, depth, kind);
+}
+
+int editorBracketDepth(int at, int col, int kind) {
+  editorBracketsSync();
+  int depth = bracketPrefix(at, kind);
+  unsigned char *hl = hlDecode(&E.row[at]);
+
+  for (int j=0; j<col && j<E.row[at].size; j++)
+    depth += bracketDelta(&E.row[at], hl, j, kind);
+  return depth;
+}
+
+int bracketForward(int *cy, int *cx, int depth, int kind) {
+  int at = *cy, base = editorBracketDepth(*cy, *cx, kind);
+  unsigned char *hl = hlDecode(&E.row[at]);
+
+  for (int j=*cx; j<E.row[at].size; j++) {
+    base += bracketDelta(&E.row[at], hl, j, kind);
+    if (base < depth) {
+      *cx = j;
+      return 1;
+    }
+  }
+
+  base = bracketPrefix(at+1, kind);
+  at = bracketFirst(1, 0, E.brackets.size, at+1, &base, depth, kind);
+  if (at == -1 || at >= E.numrows)
+    return 0;
+  hl = hlDecode(&E.row[at]);
+  for (int j=0; j<E.row[at].size; j++) {
+    base += bracketDelta(&E.row[at], hl, j, kind);
+    if (base < depth) {
+      *cy = at;
+      *cx = j;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int bracketBackward(int *cy, int *cx, int depth, int kind) {
+  int at = *cy, to = *cx, found = -1;
+
+  editorBracketsSync();
+  for (;;) {
+    int base = bracketPrefix(at, kind);
+    unsigned char *hl = hlDecode(&E.row[at]);
+    for (int j=0; j<to && j<E.row[at].size; j++) {
+      int d = bracketDelta(&E.row[at], hl, j, kind);
+      if (d != 0 && base < depth)
+        found = j;
+      base += d;
+    }
+    if (found != -1) {
+      *cy = at;
+      *cx = found;
+      return 1;
+    }
+    if (to == INT_MAX)
+      return 0;
+
+    base = bracketPrefix(at, kind);
+    at = bracketLast(1, 0, E.brackets.size, at, &base, depth, kind);
+    if (at == -1)
+      return 0;
+    to = INT_MAX;
+  }
+}
+
+void editorMatchPair(void) {
+  erow *row = CURR_ROW;
+  if (row == NULL)
+    return;
+
+  int cy = E.cy, cx = E.cx;
+  unsigned char *hl = hlDecode(row);
+  while (cx < row->size && bracketDelta(row, hl, cx, -1) == 0)
+    cx++;
+  if (cx == row->size)
+    return;
+
+  int ok, kind = bracketKind(rowChars(row)[cx]);
+  if (bracketDelta(row, hl, cx, kind) > 0) {
+    int depth = editorBracketDepth(cy, cx, kind);
+    cx++;
+    ok = bracketForward(&cy, &cx, depth + 1, kind);
+  } else
+    ok = bracketBackward(&cy, &cx, editorBracketDepth(cy, cx, kind), kind);
+  if (ok) {
+    E.cy = cy;
+    E.cx = cx;
+  }
+}
+
+void editorBlockEdge(int close, char c, int times) {
+  if (E.cy >= E.numrows)
+    return;
+
+  int cy = E.cy, cx = E.cx, kind = bracketKind(c);
+  while (times > 0) {
+    int depth = editorBracketDepth(cy, cx, kind);
+    if (close ? !bracketForward(&cy, &cx, depth, kind) : !bracketBackward(&cy, &cx, depth, kind))
+      return;
+    if (rowChars(&E.row[cy])[cx] == c)
+      times--;
+    if (times > 0 && close)
+      cx++;
+  }
+  E.cy = cy;
+  E.cx = cx;
+}
+
+/*** cold storage ***/
+
+int lzLength(unsigned char *dst, int op, int n) {
+  for (; n >= 255; n -= 255)
+    dst[op++] = 255;
+  dst[op++] = n;
+  return op;
+}
+
+int lzSequence(unsigned char *dst, int op, const char *lit, int nlit, int off, int mlen) {
+  int m = mlen ? mlen - LZ_MIN_MATCH : 0;
+  int tok = op++;
+
+  dst[tok] = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+  if (nlit >= 15)
+    op = lzLength(dst, op, nlit - 15);
+  memcpy(&dst[op], lit, nlit);
+  op += nlit;
+  if (mlen == 0)
+    return op;
+
+  dst[op++] = off & 0xff;
+  dst[op++] = off >> 8;
+  if (m >= 15)
+    op = lzLength(dst, op, m - 15);
+  return op;
+}
+
+int lzCompress(const char *src, int len, unsigned char *dst) {
+  int table[1 << LZ_HASH_BITS];
+  int ip = 0, anchor = 0, op = 0;
+
+  memset(table, 0xff, sizeof(table));
+  while (ip + LZ_MIN_MATCH <= len) {
+    uint32_t seq, prev = 0;
+    memcpy(&seq, &src[ip], 4);
+    uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+    int ref = table[h];
+    table[h] = ip;
+
+    if (ref >= 0 && ip - ref <= 0xffff)
+      memcpy(&prev, &src[ref], 4);
+    if (ref < 0 || ip - ref > 0xffff || prev != seq) {
+      ip++;
+      continue;
+    }
+
+    int mlen = LZ_MIN_MATCH;
+    while (ip + mlen < len && src[ref + mlen] == src[ip + mlen])
+      mlen++;
+    op = lzSequence(dst, op, &src[anchor], ip - anchor, ip - ref, mlen);
+    ip += mlen;
+    anchor = ip;
+  }
+  return lzSequence(dst, op, &src[anchor], len - anchor, 0, 0);
+}
+
+int lzRead(const unsigned char **ip) {
+  int n = 0, b;
+
+  do {
+    b = *(*ip)++;
+    n += b;
+  } while (b == 255);
+  return n;
+}
+
+void lzDecompress(const unsigned char *src, int len, char *dst) {
+  const unsigned char *ip = src, *end = src + len;
+
+  while (ip < end) {
+    int tok = *ip++;
+    int nlit = tok >> 4;
+    if (nlit == 15)
+      nlit += lzRead(&ip);
+    memcpy(dst, ip, nlit);
+    dst += nlit;
+    ip += nlit;
+    if (ip >= end)
+      break;
+
+    int off = ip[0] | ip[1] << 8;
+    int m = tok & 15;
+    ip += 2;
+    if (m == 15)
+      m += lzRead(&ip);
+    m += LZ_MIN_MATCH;
+    if (off >= m)
+      memcpy(dst, dst - off, m);
+    else
+      for (int k=0; k<m; k++)
+        dst[k] = dst[k - off];
+    dst += m;
+  }
+}
+
+coldblock *coldFind(const char *p) {
+  coldstore *C = &E.cold;
+  uintptr_t a = (uintptr_t) p;
+  int lo = 0, hi = C->n;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    coldblock *b = C->blocks[mid];
+    if (a < (uintptr_t) b->base)
+      hi = mid;
+    else if (a >= (uintptr_t) b->base + b->maplen)
+      lo = mid + 1;
+    else
+      return b;
+  }
+  return NULL;
+}
+
+/* Cold texts carry refs 0, their count lives in the block, and a frozen
+ * page reads back as zeros, so one load tells them from heap texts.  Debug
+ * builds map frozen blocks PROT_NONE, so a pointer read past a trim faults
+ * instead of returning zeros; the header can't be read there. */
+int textCold(const char *p) {
+#ifdef VIN_DEBUG
+  return coldFind(p) != NULL;
+#else
+  return TEXT_HDR(p)->refs == 0;
+#endif
+}
+
+void coldThaw(coldblock *b) {
+  if (__sync_bool_compare_and_swap(&b->state, COLD_FROZEN, COLD_THAWING)) {
+#ifdef VIN_DEBUG
+    mprotect(b->base, b->maplen, PROT_READ | PROT_WRITE);
+#endif
+    lzDecompress(b->comp, b->clen, b->base);
+    b->tick = E.cold.clock;
+    __sync_synchronize();
+    b->state = COLD_HOT;
+  }
+  while (b->state != COLD_HOT)
+    ;
+}
+
+char *textChars(char *p) {
+  if (textCold(p)) {
+    coldblock *b = coldFind(p);
+    if (b->state != COLD_HOT)
+      coldThaw(b);
+  }
+  return p;
+}
+
+char *rowChars(erow *row) {
+  return textChars(row->chars);
+}
+
+void coldFreeze(coldblock *b) {
+  madvise(b->base, b->maplen, MADV_DONTNEED);
+#ifdef VIN_DEBUG
+  mprotect(b->base, b->maplen, PROT_NONE);
+#endif
+  b->state = COLD_FROZEN;
+}
+
+void coldFree(coldblock *b) {
+  coldstore *C = &E.cold;
+  int i = 0;
+
+  while (C->blocks[i] != b)
+    i++;
+  memmove(&C->blocks[i], &C->blocks[i+1], sizeof(coldblock *) * (C->n - i - 1));
+  C->n--;
+  munmap(b->base, b->maplen);
+  free(b->comp);
+  free(b);
+}
+
+void coldPack(int *rows, int n, size_t bytes) {
+  coldstore *C = &E.cold;
+  long page = sysconf(_SC_PAGESIZE);
+  coldblock *b = calloc(1, sizeof(coldblock));
+
+  b->maplen = (bytes + page - 1) / page * page;
+  b->base = mmap(NULL, b->maplen, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (b->base == MAP_FAILED) {
+    free(b);
+    return;
+  }
+
+  for (int i=0; i<n; i++) {
+    erow *row = &E.row[rows[i]];
+    rowtext *t = (rowtext *) &b->base[b->len];
+    t->refs = 0;
+    memcpy(t->chars, row->chars, row->size + 1);
+    textRelease(row->chars);
+    row->chars = t->chars;
+    b->len += COLD_TEXT(row->size);
+  }
+  b->refs = n;
+  b->comp = malloc(b->len + b->len / 255 + 16);
+  b->clen = lzCompress(b->base, b->len, b->comp);
+  b->comp = realloc(b->comp, b->clen);
+
+  if (C->n == C->cap) {
+    C->cap = C->cap ? C->cap * 2 : 64;
+    C->blocks = realloc(C->blocks, sizeof(coldblock *) * C->cap);
+  }
+  int at = C->n;
+  while (at > 0 && (uintptr_t) C->blocks[at-1]->base > (uintptr_t) b->base)
+    at--;
+  memmove(&C->blocks[at+1], &C->blocks[at], sizeof(coldblock *) * (C->n - at));
+  C->blocks[at] = b;
+  C->n++;
+  coldFreeze(b);
+}
+
+void editorColdTrim(void) {
+  coldstore *C = &E.cold;
+  if (C->target == 0 || C->n == 0)
+    return;
+
+  C->clock++;
+  int lo = E.rowoff - E.screenrows, hi = E.rowoff + 2 * E.screenrows;
+  for (int i = lo > 0 ? lo : 0; i < hi && i < E.numrows; i++) {
+    coldblock *b = coldFind(E.row[i].chars);
+    if (b)
+      b->tick = C->clock;
+  }
+  if (E.cy < E.numrows) {
+    coldblock *b = coldFind(E.row[E.cy].chars);
+    if (b)
+      b->tick = C->clock;
+  }
+
+  size_t hot = 0;
+  for (int i=0; i<C->n; i++)
+    if (C->blocks[i]->state == COLD_HOT)
+      hot += C->blocks[i]->maplen;
+  while (hot > C->target) {
+    coldblock *victim = NULL;
+    for (int i=0; i<C->n; i++) {
+      coldblock *b = C->blocks[i];
+      if (b->state == COLD_HOT && b->tick != C->clock &&
+          (victim == NULL || b->tick < victim->tick))
+        victim = b;
+    }
+    if (victim == NULL)
+      break;
+    coldFreeze(victim);
+    hot -= victim->maplen;
+  }
+}
+
+void editorColdPoll(void) {
+  coldstore *C = &E.cold;
+  if (C->target == 0 || E.numrows == 0)
+    return;
+
+  editorColdTrim();
+
+  if (E.dirty != C->dirty || E.numrows != C->numrows || E.rowoff != C->rowoff) {
+    C->dirty = E.dirty;
+    C->numrows = E.numrows;
+    C->rowoff = E.rowoff;
+    C->clean = 0;
+  }
+  if (C->clean >= E.numrows)
+    return;
+
+  long long start = monotonicMs();
+  int lo = E.rowoff - COLD_MARGIN, hi = E.rowoff + E.screenrows + COLD_MARGIN;
+  int n = 0, packed = 0;
+  size_t bytes = 0;
+
+  while (C->clean < E.numrows) {
+    int i = C->scan < E.numrows ? C->scan : 0;
+    C->scan = (i + 1) % E.numrows;
+    C->clean++;
+
+    erow *row = &E.row[i];
+    if ((i < lo || i >= hi) && !textCold(row->chars) &&
+        TEXT_HDR(row->chars)->refs == 1) {
+      if (n == C->rowcap) {
+        C->rowcap = C->rowcap ? C->rowcap * 2 : 1024;
+        C->rows = realloc(C->rows, sizeof(int) * C->rowcap);
+      }
+      C->rows[n++] = i;
+      bytes += COLD_TEXT(row->size);
+    }
+
+    if (bytes >= COLD_BLOCK || (n && (C->scan == 0 || C->clean == E.numrows))) {
+      coldPack(C->rows, n, bytes);
+      n = 0;
+      bytes = 0;
+      C->clean = 0;
+      packed = 1;
+    }
+    if ((C->clean & 0xffff) == 0 && n == 0 && monotonicMs() - start >= COLD_PACK_MS)
+      break;
+  }
+  if (packed)
+    malloc_trim(0);
+}
+
+void editorSetMemTarget(int mb) {
+  E.cold.target = mb > 0 ? (size_t) (mb < COLD_MIN_MB ? COLD_MIN_MB : mb) << 20 : 0;
+  E.cold.clean = 0;
+}
+
+/*** row operations ***/
+
+char *textAlloc(size_t len) {
+  rowtext *t = malloc(sizeof(rowtext) + len + 1);
+  t->refs = 1;
+  return t->chars;
+}
+
+char *textRealloc(char *p, size_t len) {
+  if (p == NULL)
+    return textAlloc(len);
+  rowtext *t = realloc(TEXT_HDR(p), sizeof(rowtext) + len + 1);
+  return t->chars;
+}
+
+char *textRetain(char *p) {
+  if (textCold(p))
+    coldFind(p)->refs++;
+  else
+    TEXT_HDR(p)->refs++;
+  return p;
+}
+
+void textRelease(char *p) {
+  if (p == NULL)
+    return;
+  if (textCold(p)) {
+    coldblock *b = coldFind(p);
+    if (--b->refs == 0)
+      coldFree(b);
+  } else if (--TEXT_HDR(p)->refs == 0)
+    free(TEXT_HDR(p));
+}
+
+void editorRowWritable(erow *row) {
+  if (!textCold(row->chars) && TEXT_HDR(row->chars)->refs == 1)
+    return;
+
+  char *own = textAlloc(row->size);
+  memcpy(own, rowChars(row), row->size+1);
+  textRelease(row->chars);
+  row->chars = own;
+}
+
+void editorUpdateSyntaxRange(int at, int n) {
+  if (E.macro.batch) {
+    editorMacroDefer(at, n);
+    return;
+  }
+  for (int i=at; i<at+n; i++)
+    editorHighlightRow(&E.row[i]);
+  if (at+n < E.numrows)
+    editorUpdateSyntax(&E.row[at+n]);
+}
+
+int editorExpandTabs(erow *row) {
+  char *chars = rowChars(row);
+  int tabs = 0, j = 0;
+  while (j < row->size)
+    if (chars[j++] == '\t')
+      tabs++;
+
+  if (tabs == 0)
+    return 1;
+
+  char *new = malloc(row->size + tabs*(TAB_STOP-1) + 1);
+  
+  int i = 0, inc = 1;
+  for (int k=0; k<row->size; k++) {
+    if (chars[k] == '\t') {
+      new[i++] = ' ';
+      while (i % TAB_STOP != 0) {
+        inc++;
+        new[i++] = ' ';
+      }
+    } else
+      new[i++] = chars[k];
+  }
+  new[i] = '\0';
+  editorRowWritable(row);
+  row->chars = textRealloc(row->chars, i);
+  memcpy(row->chars, new, i+1);
+  row->size = i;
+  free(new);
+
+  return inc;
+}
+
+int editorUpdateRow(erow *row) {
+  int inc = editorExpandTabs(row);
+  editorUpdateSyntax(row);
+
+  return inc;
+}
+
+void editorOpenRows(int at, int n) {
+  if (E.numrows + n > E.rowcap) {
+    int cap = E.rowcap ? E.rowcap : 64;
+    while (cap < E.numrows + n)
+      cap *= 2;
+    E.row = realloc(E.row, sizeof(erow) * cap);
+    E.rowcap = cap;
+  }
+  memmove(&E.row[at+n], &E.row[at], sizeof(erow) * (E.numrows-at));
+  for (int i=at; i<at+n; i++)
+    E.row[i].vlines = 0;
+  if (at < E.numrows)
+    E.wrap.stale = 1;
+  E.brackets.stale = 1;
+  if (E.macro.batch && at <= E.macro.hl_hi)
+    E.macro.hl_hi += n;
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+  if (at < 0 || at > E.numrows)
+    return;
+  editorJournalRecord(J_INSERT_ROW, at, 0, s, len);
+  editorRegistersTouch(J_INSERT_ROW, at, 1);
+  editorDiffTouch(J_INSERT_ROW, at, 1);
+  editorHashTouch(J_INSERT_ROW, at, 1);
+  editorOpenRows(at, 1);
+
+  E.row[at].size = len;
+  E.row[at].chars = textAlloc(len);
+  memcpy(E.row[at].chars, s, len);
+  E.row[at].chars[len] = '\0';
+
+  E.row[at].spans.p = NULL;
+  E.row[at].hl_inline = 0;
+  E.row[at].hl_open_comment = 0;
+  E.numrows++;
+  editorUpdateRow(&E.row[at]);
+  editorWordsTouch(&E.row[at], 1);
+
+  E.dirty++;
+  editorShiftMatches(at, 0, 1);
+}
+
+void editorInsertRows(int at, char **s, int *len, int n) {
+  if (at < 0 || at > E.numrows || n <= 0)
+    return;
+  for (int i=0; i<n; i++)
+    editorJournalRecord(J_INSERT_ROW, at+i, 0, s[i], len[i]);
+  editorRegistersTouch(J_INSERT_ROW, at, n);
+  editorDiffTouch(J_INSERT_ROW, at, n);
+  editorHashTouch(J_INSERT_ROW, at, n);
+  editorOpenRows(at, n);
+
+  for (int i=0; i<n; i++) {
+    erow *row = &E.row[at+i];
+    row->size = len[i];
+    row->chars = textAlloc(len[i]);
+    memcpy(row->chars, s[i], len[i]);
+    row->chars[len[i]] = '\0';
+    row->spans.p = NULL;
+    row->hl_inline = 0;
+    row->hl_open_comment = 0;
+    editorExpandTabs(row);
+    editorWordsTouch(row, 1);
+  }
+  E.numrows += n;
+  E.dirty++;
+
+  editorUpdateSyntaxRange(at, n);
+  editorShiftMatches(at, 0, n);
+}
+
+void editorInsertRowsShared(int at, char **texts, int *sizes, int n) {
+  if (at < 0 || at > E.numrows || n <= 0)
+    return;
+  for (int i=0; i<n; i++)
+    editorJournalRecord(J_INSERT_ROW, at+i, 0, textChars(texts[i]), sizes[i]);
+  editorRegistersTouch(J_INSERT_ROW, at, n);
+  editorDiffTouch(J_INSERT_ROW, at, n);
+  editorHashTouch(J_INSERT_ROW, at, n);
+  editorOpenRows(at, n);
+
+  for (int i=0; i<n; i++) {
+    erow *row = &E.row[at+i];
+    row->size = sizes[i];
+    row->chars = textRetain(texts[i]);
+    row->spans.p = NULL;
+    row->hl_inline = 0;
+    row->hl_open_comment = 0;
+    editorWordsTouch(row, 1);
+  }
+  E.numrows += n;
+  E.dirty++;
+
+  editorUpdateSyntaxRange(at, n);
+  editorShiftMatches(at, 0, n);
+}
+
+void editorSetRowText(int at, char *text, int len) {
+  editorJournalRecord(J_REPLACE, at, 0, text, len);
+  editorRegistersTouch(J_REPLACE, at, 1);
+  editorDiffTouch(J_REPLACE, at, 1);
+  editorHashTouch(J_REPLACE, at, 1);
+  erow *row = &E.row[at];
+
+  editorWordsTouch(row, -1);
+  textRelease(row->chars);
+  row->chars = text;
+  row->size = len;
+  editorExpandTabs(row);
+  editorWordsTouch(row, 1);
+  editorWrapTouch(row);
+  E.dirty++;
+}
+
+void editorReplaceRow(int at, char *s, size_t len) {
+  if (at < 0 || at >= E.numrows)
+    return;
+
+  char *text = textAlloc(len);
+  memcpy(text, s, len);
+  text[len] = '\0';
+  editorSetRowText(at, text, len);
+  editorUpdateSyntax(&E.row[at]);
+}
+
+int editorGetFirstCharIdx(erow *row) {
+  int i = 0;
+
+  if (E.cy == E.numrows)
+    return 0;
+
+  char *chars = rowChars(row);
+  while (i < row->size) {
+    if (chars[i] != ' ')
+      return i;
+    i++;
+  }
+
+  return 0;
+}
+
+void editorFreeRow(erow *row) {
+  textRelease(row->chars);
+  hlFree(row);
+}
+
+void editorDelRows(int at, int n) {
+  if (at < 0 || at >= E.numrows || n <= 0)
+    return;
+  if (n > E.numrows - at)
+    n = E.numrows - at;
+  editorJournalRecord(J_DEL_ROWS, at, n, NULL, 0);
+  editorRegistersTouch(J_DEL_ROWS, at, n);
+  editorDiffTouch(J_DEL_ROWS, at, n);
+  editorHashTouch(J_DEL_ROWS, at, n);
+
+  for (int i=at; i<at+n; i++) {
+    editorWordsTouch(&E.row[i], -1);
+    editorFreeRow(&E.row[i]);
+  }
+  memmove(&E.row[at], &E.row[at+n], sizeof(erow) * (E.numrows-at-n));
+  E.numrows -= n;
+  E.wrap.stale = 1;
+  E.brackets.stale = 1;
+  E.dirty++;
+  if (E.macro.batch && at < E.macro.hl_hi)
+    E.macro.hl_hi = at+n > E.macro.hl_hi ? at : E.macro.hl_hi - n;
+
+  if (at < E.numrows)
+    editorUpdateSyntax(&E.row[at]);
+  editorShiftMatches(at, n, 0);
+}
+
+void editorDelRow(int at) {
+  editorDelRows(at, 1);
+}
+
+int editorRowInsertChar(erow *row, int at, int c) {
+  if (at < 0 || at > row->size)
+    at = row->size;
+  char ch = c;
+  editorJournalRecord(J_INSERT_CHAR, row - E.row, at, &ch, 1);
+  editorRegistersTouch(J_INSERT_CHAR, row - E.row, 1);
+  editorDiffTouch(J_INSERT_CHAR, row - E.row, 1);
+  editorHashTouch(J_INSERT_CHAR, row - E.row, 1);
+  editorWordsTouch(row, -1);
+  editorRowWritable(row);
+  row->chars = textRealloc(row->chars, row->size+1);
+  memmove(&row->chars[at+1], &row->chars[at], row->size-at+1);
+  row->size++;
+  row->chars[at] = c;
+  int inc = editorUpdateRow(row);
+  editorWordsTouch(row, 1);
+  editorWrapTouch(row);
+  E.dirty++;
+
+  return inc;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorJournalRecord(J_APPEND, row - E.row, 0, s, len);
+  editorRegistersTouch(J_APPEND, row - E.row, 1);
+  editorDiffTouch(J_APPEND, row - E.row, 1);
+  editorHashTouch(J_APPEND, row - E.row, 1);
+  editorWordsTouch(row, -1);
+  editorRowWritable(row);
+  row->chars = textRealloc(row->chars, row->size+len);
+  memcpy(&row->chars[row->size], s, len);
+  row->size += len;
+  row->chars[row->size] = '\0';
+  editorUpdateRow(row);
+  editorWordsTouch(row, 1);
+  editorWrapTouch(row);
+  E.dirty++;
+}
+
+void editorRowTruncate(erow *row, int at) {
+  if (at < 0 || at >= row->size)
+    return;
+  editorJournalRecord(J_TRUNCATE, row - E.row, at, NULL, 0);
+  editorRegistersTouch(J_TRUNCATE, row - E.row, 1);
+  editorDiffTouch(J_TRUNCATE, row - E.row, 1);
+  editorHashTouch(J_TRUNCATE, row - E.row, 1);
+  editorWordsTouch(row, -1);
+  editorRowWritable(row);
+  row->size = at;
+  row->chars[row->size] = '\0';
+  editorUpdateRow(row);
+  editorWordsTouch(row, 1);
+  editorWrapTouch(row);
+  E.dirty++;
+}
+
+int editorRowDelChar(erow *row, int at) {
+  if (at < 0 || at >= row->size)
+    return 0;
+  editorJournalRecord(J_DEL_CHAR, row - E.row, at, NULL, 0);
+  editorRegistersTouch(J_DEL_CHAR, row - E.row, 1);
+  editorDiffTouch(J_DEL_CHAR, row - E.row, 1);
+  editorHashTouch(J_DEL_CHAR, row - E.row, 1);
+  editorWordsTouch(row, -1);
+  editorRowWritable(row);
+
+  int tabCheck(char *ptr, int len);
+
+  if ((at+1) % TAB_STOP == 0) {
+    int len;
+    if ((len = tabCheck(&row->chars[at], TAB_STOP)) > 1) {
+      memmove(&row->chars[at+1-len], &row->chars[at+1], row->size-at);
+      row->size -= len;
+      editorUpdateRow(row);
+      editorWordsTouch(row, 1);
+      editorWrapTouch(row);
+      E.dirty++;
+      return len;
+    }
+  }
+  memmove(&row->chars[at], &row->chars[at+1], row->size-at);
+  row->size--;
+  editorUpdateRow(row);
+  editorWordsTouch(row, 1);
+  editorWrapTouch(row);
+  E.dirty++;
+  
+  return 1;
+}
+
+/*** registers ***/
+
+int regIndex(int name) {
+  if (name >= 'a' && name <= 'z')
+    return name - 'a' + 1;
+  return 0;
+}
+
+void regClear(reg *r) {
+  if (!r->live)
+    for (int i=0; i<r->count; i++)
+      textRelease(r->text[i]);
+  free(r->text);
+  free(r->size);
+  r->text = NULL;
+  r->size = NULL;
+  r->type = REG_EMPTY;
+  r->live = 0;
+  r->count = 0;
+}
+
+void regMaterialize(reg *r) {
+  if (!r->live)
+    return;
+
+  r->text = malloc(sizeof(char *) * r->count);
+  r->size = malloc(sizeof(int) * r->count);
+  for (int i=0; i<r->count; i++) {
+    r->text[i] = textRetain(E.row[r->start+i].chars);
+    r->size[i] = E.row[r->start+i].size;
+  }
+  r->live = 0;
+}
+
+void editorRegistersTouch(int op, int at, int n) {
+  for (int i=0; i<NUM_REGS; i++) {
+    reg *r = &E.regs[i];
+    if (!r->live)
+      continue;
+
+    int end = r->start + r->count;
+    if (op == J_INSERT_ROW) {
+      if (at <= r->start)
+        r->start += n;
+      else if (at < end)
+        regMaterialize(r);
+    } else if (op == J_DEL_ROWS) {
+      if (at + n <= r->start)
+        r->start -= n;
+      else if (at < end)
+        regMaterialize(r);
+    } else if (at < end && at + n > r->start)
+      regMaterialize(r);
+  }
+}
+
+void editorYank(int type, int sy, int sx, int ey, int ex) {
+  reg *r = &E.regs[regIndex(E.regname)];
+
+  regClear(r);
+  r->type = type;
+  r->live = 1;
+  r->start = sy;
+  r->count = ey - sy + 1;
+  r->sx = sx;
+  r->ex = ex;
+}
+
+/*** macros ***/
+
+char *regKeys(reg *r, int *len) {
+  regMaterialize(r);
+
+  int cap = 1;
+  for (int i=0; i<r->count; i++)
+    cap += r->size[i] + 1;
+  char *keys = malloc(cap);
+  int n = 0;
+
+  for (int i=0; i<r->count; i++) {
+    int from = (r->type == REG_CHARS && i == 0) ? r->sx : 0;
+    int to = (r->type == REG_CHARS && i == r->count-1) ? r->ex : r->size[i];
+    if (to > from) {
+      memcpy(&keys[n], &textChars(r->text[i])[from], to - from);
+      n += to - from;
+    }
+    if (r->type == REG_LINES || i < r->count-1)
+      keys[n++] = '\r';
+  }
+  *len = n;
+  return keys;
+}
+
+void editorMacroRecord(char c) {
+  macrostate *M = &E.macro;
+
+  M->typed = 1;
+  if (!M->rec)
+    return;
+  if (M->len == M->cap) {
+    M->cap = M->cap ? M->cap * 2 : 64;
+    M->buf = realloc(M->buf, M->cap);
+  }
+  M->buf[M->len++] = c;
+}
+
+void editorMacroToggle(int name) {
+  macrostate *M = &E.macro;
+
+  if (!M->rec) {
+    M->rec = name;
+    M->len = 0;
+    return;
+  }
+
+  if (M->typed && M->len > 0)
+    M->len--;
+  reg *r = &E.regs[regIndex(M->rec)];
+  regClear(r);
+  r->type = REG_CHARS;
+  r->count = 1;
+  r->text = malloc(sizeof(char *));
+  r->size = malloc(sizeof(int));
+  r->text[0] = textAlloc(M->len);
+  memcpy(r->text[0], M->buf, M->len);
+  r->text[0][M->len] = '\0';
+  r->size[0] = M->len;
+  r->sx = 0;
+  r->ex = M->len;
+  M->rec = 0;
+}
+
+void editorMacroAbort(void) {
+  macrostate *M = &E.macro;
+
+  while (M->depth > 0)
+    free(M->stack[--M->depth].keys);
+}
+
+void editorMacroPlay(int name, int times) {
+  macrostate *M = &E.macro;
+
+  if (name == '@')
+    name = M->last;
+  reg *r = &E.regs[regIndex(name)];
+  if (!name || r->type == REG_EMPTY) {
+    editorSetStatusMessage("Nothing in register %c", name ? name : '@');
+    return;
+  }
+  if (M->depth == MACRO_DEPTH) {
+    editorMacroAbort();
+    editorSetStatusMessage("Macro recursion too deep");
+    return;
+  }
+
+  int len;
+  char *keys = regKeys(r, &len);
+  if (len == 0) {
+    free(keys);
+    return;
+  }
+  M->last = name;
+  if (!M->batch) {
+    M->batch = 1;
+    M->steps = 0;
+    M->hl_lo = INT_MAX;
+    M->hl_hi = -1;
+  }
+  M->stack[M->depth++] = (macroframe) { keys, len, 0, times };
+}
+
+int editorMacroNext(char *c) {
+  macrostate *M = &E.macro;
+
+  if (++M->steps % MACRO_POLL_KEYS == 0 && !M->held) {
+    struct pollfd p = { STDIN_FILENO, POLLIN, 0 };
+    if (poll(&p, 1, 0) > 0 && read(STDIN_FILENO, &M->hold, 1) == 1) {
+      if (M->hold == CTRL_KEY('c')) {
+        editorMacroAbort();
+        editorSetStatusMessage("Macro interrupted");
+        return 0;
+      }
+      M->held = 1;
+    }
+  }
+
+  macroframe *f = &M->stack[M->depth-1];
+  *c = f->keys[f->pos++];
+  if (f->pos == f->len) {
+    if (--f->times > 0)
+      f->pos = 0;
+    else
+      free(M->stack[--M->depth].keys);
+  }
+  M->typed = 0;
+  return 1;
+}
+
+void editorMacroDefer(int at, int n) {
+  macrostate *M = &E.macro;
+
+  if (at < M->hl_lo)
+    M->hl_lo = at;
+  if (at+n-1 > M->hl_hi)
+    M->hl_hi = at+n-1;
+}
+
+void editorMacroFinish(void) {
+  macrostate *M = &E.macro;
+
+  M->batch = 0;
+  if (M->hl_lo >= E.numrows)
+    return;
+  int hi = M->hl_hi < E.numrows ? M->hl_hi : E.numrows-1;
+  editorUpdateSyntaxRange(M->hl_lo, hi - M->hl_lo + 1);
+}
+
+/*** helpers ***/
+
+int tabCheck(char *ptr, int len) {
+  int i = 0, count = 0;
+
+  while (len-- > 0) {
+    if (ptr[i--] != ' ')
+      return count;
+    else
+      count++;
+  }
+
+  return count;
+}
+
+uint64_t hashBytes(uint64_t h, const char *s, size_t len) {
+  for (size_t i=0; i<len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 0x100000001b3ULL;
+  }
+  h ^= '\n';
+  h *= 0x100000001b3ULL;
+
+  return h;
+}
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+unsigned char char_class[256];
+
+void initCharClasses(void) {
+  for (int c=0; c<256; c++) {
+    if (c == ' ' || c == '\t' || c == '\0')
+      char_class[c] = CC_BLANK;
+    else if (isalnum(c) || c == '_' || c >= 0x80)
+      char_class[c] = CC_WORD;
+    else
+      char_class[c] = CC_PUNCT;
+  }
+}
+
+int scanClass(const char *s, int from, int len, int cls) {
+  const unsigned char *p = (const unsigned char *) s;
+
+  if (cls == CC_BLANK) {
+    uint64_t word;
+    while (from + 8 <= len) {
+      memcpy(&word, &p[from], 8);
+      if (word != 0x2020202020202020ULL)
+        break;
+      from += 8;
+    }
+  }
+
+  while (from + 4 <= len &&
+      ((char_class[p[from]] ^ cls) | (char_class[p[from+1]] ^ cls) |
+       (char_class[p[from+2]] ^ cls) | (char_class[p[from+3]] ^ cls)) == 0)
+    from += 4;
+  while (from < len && char_class[p[from]] == cls)
+    from++;
+
+  return from;
+}
+
+int scanClassBack(const char *s, int from, int cls) {
+  const unsigned char *p = (const unsigned char *) s;
+
+  while (from >= 3 &&
+      ((char_class[p[from]] ^ cls) | (char_class[p[from-1]] ^ cls) |
+       (char_class[p[from-2]] ^ cls) | (char_class[p[from-3]] ^ cls)) == 0)
+    from -= 4;
+  while (from >= 0 && char_class[p[from]] == cls)
+    from--;
+
+  return from;
+}
+
+/*** editor operations***/
+
+void editorInsertChar(int c) {
+  if (E.cy == E.numrows)
+    editorInsertRow(E.numrows, "", 0);
+  int inc = editorRowInsertChar(&E.row[E.cy], E.cx, c);
+  E.cx += inc;
+}
+
+void editorInsertNewline(void) {
+  if (E.cx == 0)
+    editorInsertRow(E.cy, "", 0);
+  else {
+    erow *row = &E.row[E.cy];
+    editorInsertRow(E.cy+1, &rowChars(row)[E.cx], row->size - E.cx);
+    editorRowTruncate(&E.row[E.cy], E.cx);
+  }
+  E.cy++;
+  E.cx = 0;
+}
+
+void editorDelChar(void) {
+  if (E.cy == E.numrows)
+    return;
+  if (E.cx == 0 && E.cy == 0)
+    return;
+
+  erow *row = &E.row[E.cy];
+  if (E.cx > 0) {
+    int dec = editorRowDelChar(row, E.cx-1);
+    E.cx -= dec;
+  } else {
+    E.cx = E.row[E.cy-1].size;
+    editorRowAppendString(&E.row[E.cy-1], rowChars(row), row->size);
+    editorDelRow(E.cy);
+    E.cy--;
+  }
+}
+
+void editorCompleteReset(void) {
+  completion *C = &E.compl;
+
+  for (int i=0; i<C->n; i++)
+    free(C->words[i]);
+  free(C->words);
+  free(C->prefix);
+  memset(C, 0, sizeof(*C));
+}
+
+void editorComplete(int dir) {
+  completion *C = &E.compl;
+  erow *row = CURR_ROW;
+  if (row == NULL)
+    return;
+
+  if (!C->active) {
+    if (E.words.nodes == NULL)
+      editorWordsBuild();
+
+    char *chars = rowChars(row);
+    int start = E.cx;
+    while (start > 0 && !is_separator((unsigned char)chars[start-1]))
+      start--;
+    int plen = E.cx - start;
+
+    C->words = malloc(sizeof(char *) * COMPLETE_MAX);
+    C->n = editorWordsLookup(&chars[start], plen, C->words);
+    if (C->n == 0) {
+      editorCompleteReset();
+      editorSetStatusMessage("Pattern not found");
+      return;
+    }
+    C->prefix = strndup(&chars[start], plen);
+    C->active = 1;
+    C->idx = -1;
+    C->start = start;
+    C->len = plen;
+  }
+
+  C->idx = (C->idx + 1 + dir + C->n + 1) % (C->n + 1) - 1;
+  char *text = C->idx == -1 ? C->prefix : C->words[C->idx];
+  int len = strlen(text);
+
+  for (int i=0; i<C->len; i++)
+    editorRowDelChar(row, C->start);
+  for (int i=0; i<len; i++)
+    editorRowInsertChar(row, C->start+i, text[i]);
+  C->len = len;
+  E.cx = C->start + len;
+
+  if (C->idx == -1)
+    editorSetStatusMessage("Back at original");
+  else
+    editorSetStatusMessage("match %d of %d", C->idx+1, C->n);
+}
+
+void editorGetSelection(int *sy, int *sx, int *ey, int *ex) {
+  if (E.vy < E.cy || (E.vy == E.cy && E.vx <= E.cx)) {
+    *sy = E.vy; *sx = E.vx;
+    *ey = E.cy; *ex = E.cx;
+  } else {
+    *sy = E.cy; *sx = E.cx;
+    *ey = E.vy; *ex = E.vx;
+  }
+
+  if (E.vmode == 'V') {
+    *sx = 0;
+    *ex = E.row[*ey].size;
+  } else if (*ex < E.row[*ey].size)
+    (*ex)++;
+}
+
+int editorSelectionCols(int filerow, int *from, int *to) {
+  int sy, sx, ey, ex;
+
+  if (E.mode != VISUAL || E.numrows == 0)
+    return 0;
+  editorGetSelection(&sy, &sx, &ey, &ex);
+  if (filerow < sy || filerow > ey)
+    return 0;
+
+  *from = filerow == sy ? sx : 0;
+  *to = filerow == ey ? ex : E.row[filerow].size;
+  return 1;
+}
+
+void editorYankSelection(void) {
+  int sy, sx, ey, ex;
+
+  editorGetSelection(&sy, &sx, &ey, &ex);
+  editorYank(E.vmode == 'V' ? REG_LINES : REG_CHARS, sy, sx, ey, ex);
+  E.cy = sy;
+  E.cx = E.vmode == 'V' ? E.cx : sx;
+  if (ey > sy)
+    editorSetStatusMessage("%d lines yanked", ey - sy + 1);
+}
+
+void editorDeleteRange(int linewise, int sy, int sx, int ey, int ex) {
+  if (E.numrows == 0)
+    return;
+  editorYank(linewise ? REG_LINES : REG_CHARS, sy, sx, ey, ex);
+
+  if (linewise) {
+    editorDelRows(sy, ey - sy + 1);
+    E.cy = sy < E.numrows ? sy : E.numrows - 1;
+    if (E.cy < 0)
+      E.cy = 0;
+    if (E.cy < E.numrows)
+      editorGoToFirstChar();
+    else
+      E.cx = 0;
+  } else {
+    erow *first = &E.row[sy], *last = &E.row[ey];
+    int len = sx + last->size - ex;
+    char *joined = malloc(len + 1);
+
+    memcpy(joined, rowChars(first), sx);
+    memcpy(&joined[sx], &rowChars(last)[ex], last->size - ex);
+    editorReplaceRow(sy, joined, len);
+    free(joined);
+    editorDelRows(sy+1, ey - sy);
+
+    E.cy = sy;
+    E.cx = sx;
+    if (E.cx >= E.row[sy].size)
+      E.cx = E.row[sy].size > 0 ? E.row[sy].size-1 : 0;
+  }
+
+  if (ey > sy)
+    editorSetStatusMessage("%d fewer lines", linewise ? ey - sy + 1 : ey - sy);
+}
+
+void editorDeleteSelection(void) {
+  int sy, sx, ey, ex;
+
+  editorGetSelection(&sy, &sx, &ey, &ex);
+  editorDeleteRange(E.vmode == 'V', sy, sx, ey, ex);
+}
+
+void editorPasteLines(reg *r, int at, int times) {
+  int n = r->count * times;
+  char **texts = malloc(sizeof(char *) * n);
+  int *sizes = malloc(sizeof(int) * n);
+
+  for (int i=0; i<n; i++) {
+    texts[i] = r->text[i % r->count];
+    sizes[i] = r->size[i % r->count];
+  }
+  editorInsertRowsShared(at, texts, sizes, n);
+  free(texts);
+  free(sizes);
+
+  E.cy = at;
+  editorGoToFirstChar();
+  if (n > 2)
+    editorSetStatusMessage("%d more lines", n);
+}
+
+void editorPasteChars(reg *r, int at) {
+  erow *row = &E.row[E.cy];
+  char *chars = rowChars(row);
+  int n = r->count;
+  int first_end = n == 1 ? r->ex : r->size[0];
+  int first_len = first_end - r->sx;
+  int right_len = row->size - at;
+
+  if (n == 1) {
+    char *buf = malloc(row->size + first_len + 1);
+    memcpy(buf, chars, at);
+    memcpy(&buf[at], &textChars(r->text[0])[r->sx], first_len);
+    memcpy(&buf[at + first_len], &chars[at], right_len);
+    editorReplaceRow(E.cy, buf, row->size + first_len);
+    free(buf);
+    E.cx = at + first_len - 1;
+    if (E.cx < 0)
+      E.cx = 0;
+    return;
+  }
+
+  char *last = textAlloc(r->ex + right_len);
+  memcpy(last, textChars(r->text[n-1]), r->ex);
+  memcpy(&last[r->ex], &chars[at], right_len);
+  last[r->ex + right_len] = '\0';
+
+  char *head = malloc(at + first_len + 1);
+  memcpy(head, chars, at);
+  memcpy(&head[at], &textChars(r->text[0])[r->sx], first_len);
+  editorReplaceRow(E.cy, head, at + first_len);
+  free(head);
+
+  char **texts = malloc(sizeof(char *) * (n-1));
+  int *sizes = malloc(sizeof(int) * (n-1));
+  for (int i=1; i<n-1; i++) {
+    texts[i-1] = r->text[i];
+    sizes[i-1] = r->size[i];
+  }
+  texts[n-2] = last;
+  sizes[n-2] = r->ex + right_len;
+  editorInsertRowsShared(E.cy+1, texts, sizes, n-1);
+  textRelease(last);
+  free(texts);
+  free(sizes);
+
+  E.cx = at;
+}
+
+void editorPaste(int after, int times) {
+  reg *r = &E.regs[regIndex(E.regname)];
+
+  if (r->type == REG_EMPTY) {
+    editorSetStatusMessage("Nothing in register %c", E.regname ? E.regname : '"');
+    return;
+  }
+  regMaterialize(r);
+
+  if (r->type == REG_LINES) {
+    int at = after ? E.cy+1 : E.cy;
+    editorPasteLines(r, at > E.numrows ? E.numrows : at, times);
+    return;
+  }
+
+  if (E.numrows == 0)
+    editorInsertRow(0, "", 0);
+  int start_cy = -1, start_cx = 0;
+  while (times--) {
+    int at = (after && E.row[E.cy].size > 0) ? E.cx+1 : E.cx;
+    if (at > E.row[E.cy].size)
+      at = E.row[E.cy].size;
+    editorPasteChars(r, at);
+    after = 1;
+
+    if (r->count > 1) {
+      if (start_cy == -1) {
+        start_cy = E.cy;
+        start_cx = E.cx;
+      }
+      E.cy += r->count-1;
+      E.cx = r->ex > 0 ? r->ex-1 : 0;
+    }
+  }
+  if (start_cy != -1) {
+    E.cy = start_cy;
+    E.cx = start_cx;
+  }
+}
+
+/*** file i/o ***/
+
+char *editorRowsToString(int *buflen) {
+  int totlen = 0;
+  
+  for (int j=0; j<E.numrows; j++)
+    totlen += E.row[j].size + 1;
+  *buflen = totlen;
+
+  char *buf = malloc(totlen);
+  char *p = buf;
+  
+  for (int j=0; j<E.numrows; j++) {
+    if (j % COLD_TRIM_ROWS == 0)
+      editorColdTrim();
+    memcpy(p, rowChars(&E.row[j]), E.row[j].size);
+    p += E.row[j].size;
+    *p = '\n';
+    p++;
+  }
+  
+  return buf;
+}
+
+void editorOpen(char *filename) {
+  free(E.filename);
+  E.filename = strdup(filename);
+
+  editorSelectSyntaxHighlight();
+  if (E.syntax && !strcmp(E.syntax->filetype, "c"))
+    editorSymbolsIndex(filename);
+
+  FILE *fp = fopen(filename, "r");
+  if (!fp)
+    die("fopen");
+
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+
+  if (E.follow.on) {
+    struct stat st;
+    fstat(fileno(fp), &st);
+    E.follow.dev = st.st_dev;
+    E.follow.ino = st.st_ino;
+    E.follow.offset = 0;
+  }
+
+  while ((linelen = getline(&line, &linecap , fp)) != -1) {
+    if (E.follow.on) {
+      if (line[linelen-1] != '\n')
+        break;
+      E.follow.offset += linelen;
+    }
+    while (linelen > 0 && (line[linelen-1] == '\n' ||
+          line[linelen-1] == '\r'))
+      linelen--;
+    editorInsertRow(E.numrows, line, linelen);
+  }
+  free(line);
+  fclose(fp);
+  E.dirty = 0;
+
+  editorWatchFile();
+  editorJournalOpen(1);
+}
+
+void editorCloseFile(void) {
+  if (E.hex.on)
+    editorHexClose();
+  if (E.diff.on)
+    editorDiffClose();
+  editorJournalClose();
+  for (int i=0; i<NUM_REGS; i++)
+    regMaterialize(&E.regs[i]);
+  editorClearMatches();
+
+  for (int i=0; i<E.numrows; i++)
+    editorFreeRow(&E.row[i]);
+  E.numrows = 0;
+  free(E.words.nodes);
+  memset(&E.words, 0, sizeof(E.words));
+  free(E.hashes.hash);
+  free(E.hashes.valid);
+  memset(&E.hashes, 0, sizeof(E.hashes));
+  E.cx = E.cy = 0;
+  E.rowoff = E.coloff = 0;
+  E.dirty = 0;
+  E.jobs.shown = -1;
+  free(E.syms.pending);
+  E.syms.pending = NULL;
+}
+
+int editorEdit(char *filename) {
+  struct stat st;
+
+  if (E.filename && stat(filename, &st) == 0 &&
+      st.st_dev == E.disk_st.st_dev && st.st_ino == E.disk_st.st_ino)
+    return 0;
+  if (E.dirty) {
+    editorSetStatusMessage("No write since last change");
+    return -1;
+  }
+  if (access(filename, R_OK) == -1) {
+    editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+    return -1;
+  }
+
+  editorCloseFile();
+  editorOpen(filename);
+  return 0;
+}
+
+void editorSave(void) {
+  if (E.hex.on) {
+    editorHexSave();
+    return;
+  }
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s", NULL);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+    editorWatchFile();
+  }
+
+  if (editorDiskChanged()) {
+    char *ans = editorPrompt("File changed on disk since last read. Write anyway? (y/n) %s", NULL);
+    int ok = ans && (ans[0] == 'y' || ans[0] == 'Y');
+    free(ans);
+    if (!ok) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+  }
+
+  int len;
+  char *buf = editorRowsToString(&len);
+
+  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+  if (fd != -1) {
+    if (ftruncate(fd, len) != -1) {
+      if (write(fd, buf, len) == len) {
+        fstat(fd, &E.disk_st);
+        close(fd);
+        free(buf);
+        E.dirty = 0;
+        if (E.jnl.fd == -1)
+          editorJournalOpen(0);
+        else
+          editorJournalReset();
+        editorSetStatusMessage("\"%s\" %dL, %dB written", E.filename, E.numrows, len);
+        return;
+      }
+    }
+    close(fd);
+  }
+
+  free(buf);
+  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+
+/*** hex view ***/
+
+int hexFind(size_t off) {
+  hexview *H = &E.hex;
+  int lo = 0, hi = H->npatches;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (H->patches[mid].off < off)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+unsigned char hexByte(size_t off, int *patched) {
+  hexview *H = &E.hex;
+  int i = hexFind(off);
+
+  *patched = i < H->npatches && H->patches[i].off == off;
+  return *patched ? H->patches[i].byte : H->map[off];
+}
+
+void editorHexPatch(size_t off, unsigned char byte) {
+  hexview *H = &E.hex;
+  int i = hexFind(off);
+  int found = i < H->npatches && H->patches[i].off == off;
+
+  if (byte == H->map[off]) {
+    if (found) {
+      memmove(&H->patches[i], &H->patches[i+1], sizeof(hexpatch) * (H->npatches-i-1));
+      H->npatches--;
+    }
+  } else if (found)
+    H->patches[i].byte = byte;
+  else {
+    if (H->npatches == H->cap) {
+      H->cap = H->cap ? H->cap * 2 : 64;
+      H->patches = realloc(H->patches, sizeof(hexpatch) * H->cap);
+    }
+    memmove(&H->patches[i+1], &H->patches[i], sizeof(hexpatch) * (H->npatches-i));
+    H->patches[i].off = off;
+    H->patches[i].byte = byte;
+    H->npatches++;
+  }
+  E.dirty = H->npatches;
+}
+
+void editorHexOpen(char *filename) {
+  hexview *H = &E.hex;
+
+  free(E.filename);
+  E.filename = strdup(filename);
+
+  H->writable = 1;
+  H->fd = open(filename, O_RDWR);
+  if (H->fd == -1) {
+    H->writable = 0;
+    H->fd = open(filename, O_RDONLY);
+  }
+  if (H->fd == -1 || fstat(H->fd, &E.disk_st) == -1)
+    die("open");
+
+  H->size = E.disk_st.st_size;
+  H->map = NULL;
+  if (H->size) {
+    H->map = mmap(NULL, H->size, PROT_READ, MAP_SHARED, H->fd, 0);
+    if (H->map == MAP_FAILED)
+      die("mmap");
+  }
+  H->cur = H->top = 0;
+  H->nibble = -1;
+  H->on = 1;
+  E.syntax = NULL;
+  E.dirty = 0;
+}
+
+void editorHexClose(void) {
+  hexview *H = &E.hex;
+
+  if (H->map)
+    munmap(H->map, H->size);
+  close(H->fd);
+  free(H->patches);
+  memset(H, 0, sizeof(*H));
+}
+
+void editorHexSave(void) {
+  hexview *H = &E.hex;
+  unsigned char buf[4096];
+
+  if (!H->writable) {
+    editorSetStatusMessage("Can't save! %s is read-only", E.filename);
+    return;
+  }
+
+  int i = 0;
+  while (i < H->npatches) {
+    size_t start = H->patches[i].off;
+    int n = 0;
+    while (i < H->npatches && n < (int)sizeof(buf) && H->patches[i].off == start + n)
+      buf[n++] = H->patches[i++].byte;
+    if (pwrite(H->fd, buf, n, start) != n) {
+      editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+      memmove(H->patches, &H->patches[i-n], sizeof(hexpatch) * (H->npatches-i+n));
+      H->npatches -= i-n;
+      E.dirty = H->npatches;
+      return;
+    }
+  }
+
+  fstat(H->fd, &E.disk_st);
+  editorSetStatusMessage("\"%s\" %d bytes patched", E.filename, H->npatches);
+  H->npatches = 0;
+  E.dirty = 0;
+}
+
+void editorHexScroll(void) {
+  hexview *H = &E.hex;
+  size_t line = H->cur / HEX_COLS;
+
+  if (line < H->top)
+    H->top = line;
+  if (line >= H->top + E.screenrows)
+    H->top = line - E.screenrows + 1;
+}
+
+void editorHexMove(long long delta) {
+  hexview *H = &E.hex;
+  long long off = (long long)H->cur + delta;
+
+  if (off >= (long long)H->size)
+    off = H->size ? H->size - 1 : 0;
+  if (off < 0)
+    off = 0;
+  H->cur = off;
+  H->nibble = -1;
+}
+
+int editorHexKeypress(int c, int times) {
+  hexview *H = &E.hex;
+  int col = H->cur % HEX_COLS;
+
+  switch (c) {
+    case QUIT: case WRITE: case EX_CMD: case FIND_FILE: case BREAK:
+      if (E.mode != INSERT)
+        H->nibble = -1;
+      return 0;
+
+    case LEFT:
+      editorHexMove(-(times < col ? times : col));
+      break;
+    case RIGHT:
+      editorHexMove(times < HEX_COLS-1 - col ? times : HEX_COLS-1 - col);
+      break;
+    case UP: case DOWN:
+      editorHexMove((long long)(c == UP ? -times : times) * HEX_COLS);
+      break;
+    case MV_UP: case MV_DOWN:
+      editorHexMove((long long)(c == MV_UP ? -times : times) * (E.screenrows/2) * HEX_COLS);
+      break;
+    case PG_UP: case PG_DOWN:
+      editorHexMove((long long)(c == PG_UP ? -times : times) * E.screenrows * HEX_COLS);
+      break;
+    case FULL_LEFT: case START_LINE:
+      editorHexMove(-col);
+      break;
+    case END_LINE:
+      editorHexMove(HEX_COLS-1 - col);
+      break;
+    case GOTO_TOP: case GOTO_BOT:
+      if (E.count)
+        editorGoToLine(E.count);
+      else
+        editorHexMove(c == GOTO_TOP ? -(long long)H->cur : (long long)H->size);
+      break;
+
+    case BACKSPACE:
+      if (E.mode == INSERT) {
+        if (H->nibble == -1)
+          editorHexMove(-1);
+        H->nibble = -1;
+      }
+      break;
+
+    default:
+      if (E.mode != INSERT || !isxdigit(c) || H->cur >= H->size)
+        break;
+      {
+        int v = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+        if (H->nibble == -1) {
+          H->nibble = v;
+          break;
+        }
+        editorHexPatch(H->cur, H->nibble << 4 | v);
+        if (H->cur + 1 < H->size)
+          editorHexMove(1);
+        H->nibble = -1;
+      }
+      break;
+  }
+  return 1;
+}
+
+/*** swap journal ***/
+
+char *editorJournalPath(char *filename) {
+  char *slash = strrchr(filename, '/');
+  int dirlen = slash ? slash - filename + 1 : 0;
+  char *path = malloc(strlen(filename) + 6);
+
+  sprintf(path, "%.*s.%s.vsw", dirlen, filename, filename + dirlen);
+  return path;
+}
+
+int putVarint(char *p, uint64_t v) {
+  int n = 0;
+  while (v >= 0x80) {
+    p[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+  return n;
+}
+
+int getVarint(const char *p, const char *end, uint64_t *v) {
+  int n = 0, shift = 0;
+  *v = 0;
+  while (p+n < end && shift < 64) {
+    unsigned char b = p[n++];
+    *v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return n;
+    shift += 7;
+  }
+  return -1;
+}
+
+void editorJournalWriteHeader(int fd) {
+  char hdr[32];
+  int64_t base[3] = { E.disk_st.st_size, E.disk_st.st_mtim.tv_sec, E.disk_st.st_mtim.tv_nsec };
+
+  memcpy(hdr, JOURNAL_MAGIC, 8);
+  memcpy(&hdr[8], base, sizeof(base));
+  write(fd, hdr, sizeof(hdr));
+}
+
+void editorJournalRecord(int op, int at, int col, const char *s, size_t len) {
+  journal *j = &E.jnl;
+  char hdr[31];
+  int n = 0;
+
+  if (j->fd == -1 || j->replaying)
+    return;
+
+  hdr[n++] = op;
+  n += putVarint(&hdr[n], at);
+  n += putVarint(&hdr[n], col);
+  n += putVarint(&hdr[n], len);
+
+  pthread_mutex_lock(&j->lock);
+  while (j->len > 0 && j->len + n + len > JOURNAL_PENDING_MAX) {
+    pthread_cond_signal(&j->wake);
+    pthread_cond_wait(&j->drained, &j->lock);
+  }
+  if (j->len + n + len > j->cap) {
+    j->cap = (j->len + n + len) * 2;
+    j->pending = realloc(j->pending, j->cap);
+  }
+  memcpy(&j->pending[j->len], hdr, n);
+  if (len)
+    memcpy(&j->pending[j->len + n], s, len);
+  j->len += n + len;
+  if (j->len >= j->sync_bytes || j->sync_ms == 0)
+    pthread_cond_signal(&j->wake);
+  pthread_mutex_unlock(&j->lock);
+}
+
+void *editorJournalThread(void *arg) {
+  journal *j = arg;
+  char *out = NULL;
+  size_t outcap = 0;
+
+  pthread_mutex_lock(&j->lock);
+  while (1) {
+    if (!j->stop && j->len == 0 && j->sync_ms == 0)
+      pthread_cond_wait(&j->wake, &j->lock);
+    else if (!j->stop && j->len < j->sync_bytes && j->sync_ms > 0) {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += j->sync_ms / 1000;
+      ts.tv_nsec += (j->sync_ms % 1000) * 1000000L;
+      if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&j->wake, &j->lock, &ts);
+    }
+    if (j->len == 0) {
+      if (j->stop)
+        break;
+      continue;
+    }
+
+    char *buf = j->pending;
+    size_t len = j->len, cap = j->cap;
+    j->pending = out;
+    j->cap = outcap;
+    j->len = 0;
+    out = buf;
+    outcap = cap;
+    pthread_cond_broadcast(&j->drained);
+
+    pthread_mutex_lock(&j->io);
+    pthread_mutex_unlock(&j->lock);
+
+    size_t done = 0;
+    while (done < len) {
+      ssize_t w = write(j->fd, out + done, len - done);
+      if (w <= 0 && errno != EINTR)
+        break;
+      if (w > 0)
+        done += w;
+    }
+    fdatasync(j->fd);
+
+    pthread_mutex_unlock(&j->io);
+    pthread_mutex_lock(&j->lock);
+  }
+  pthread_mutex_unlock(&j->lock);
+
+  free(out);
+  return NULL;
+}
+
+int editorJournalApply(const char *p, const char *end) {
+  int applied = 0;
+
+  while (p < end) {
+    uint64_t at, col, len;
+    int op = *p++, n;
+
+    if ((n = getVarint(p, end, &at)) < 0)
+      break;
+    p += n;
+    if ((n = getVarint(p, end, &col)) < 0)
+      break;
+    p += n;
+    if ((n = getVarint(p, end, &len)) < 0 || len > (uint64_t)(end - p - n))
+      break;
+    p += n;
+
+    char *s = (char *) p;
+    p += len;
+
+    if (op != J_INSERT_ROW && at >= (uint64_t)E.numrows)
+      break;
+
+    switch (op) {
+      case J_INSERT_CHAR:
+        editorRowInsertChar(&E.row[at], col, s[0]);
+        break;
+      case J_DEL_CHAR:
+        editorRowDelChar(&E.row[at], col);
+        break;
+      case J_INSERT_ROW:
+        editorInsertRow(at, s, len);
+        break;
+      case J_DEL_ROWS:
+        editorDelRows(at, col);
+        break;
+      case J_APPEND:
+        editorRowAppendString(&E.row[at], s, len);
+        break;
+      case J_REPLACE:
+        editorReplaceRow(at, s, len);
+        break;
+      case J_TRUNCATE:
+        editorRowTruncate(&E.row[at], col);
+        break;
+      default:
+        return applied;
+    }
+    applied++;
+  }
+
+  return applied;
+}
+
+int editorJournalReplay(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size <= 32)
+    return 0;
+
+  char *buf = malloc(st.st_size);
+  if (read(fd, buf, st.st_size) != st.st_size) {
+    free(buf);
+    return 0;
+  }
+
+  int64_t base[3] = { E.disk_st.st_size, E.disk_st.st_mtim.tv_sec, E.disk_st.st_mtim.tv_nsec };
+  if (memcmp(buf, JOURNAL_MAGIC, 8) || memcmp(&buf[8], base, sizeof(base))) {
+    free(buf);
+    editorSetStatusMessage("Stale swap journal discarded");
+    return 0;
+  }
+
+  char *ans = editorPrompt("Swap journal found. Recover unsaved changes? (y/n) %s", NULL);
+  int ok = ans && (ans[0] == 'y' || ans[0] == 'Y');
+  free(ans);
+  if (!ok) {
+    free(buf);
+    return 0;
+  }
+
+  E.jnl.replaying = 1;
+  int applied = editorJournalApply(&buf[32], &buf[st.st_size]);
+  E.jnl.replaying = 0;
+  free(buf);
+
+  editorSetStatusMessage("Recovered %d changes from swap journal", applied);
+  return 1;
+}
+
+void editorJournalOpen(int recover) {
+  journal *j = &E.jnl;
+  int replayed = 0;
+
+  free(j->path);
+  j->path = editorJournalPath(E.filename);
+
+  if (recover) {
+    int fd = open(j->path, O_RDONLY);
+    if (fd != -1) {
+      replayed = editorJournalReplay(fd);
+      close(fd);
+    }
+  }
+
+  j->fd = open(j->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (j->fd == -1) {
+    editorSetStatusMessage("Can't open swap journal: %s", strerror(errno));
+    return;
+  }
+  if (!replayed) {
+    ftruncate(j->fd, 0);
+    editorJournalWriteHeader(j->fd);
+  }
+
+  j->stop = 0;
+  pthread_mutex_init(&j->lock, NULL);
+  pthread_mutex_init(&j->io, NULL);
+  pthread_cond_init(&j->wake, NULL);
+  pthread_cond_init(&j->drained, NULL);
+  pthread_create(&j->thread, NULL, editorJournalThread, j);
+}
+
+void editorJournalSetSync(int ms, int bytes) {
+  journal *j = &E.jnl;
+  int open = j->fd != -1;
+
+  if (open)
+    pthread_mutex_lock(&j->lock);
+  j->sync_ms = ms > 0 ? ms : 0;
+  j->sync_bytes = bytes > 0 ? bytes : 1;
+  if (open) {
+    pthread_cond_signal(&j->wake);
+    pthread_mutex_unlock(&j->lock);
+  }
+}
+
+void editorJournalReset(void) {
+  journal *j = &E.jnl;
+  if (j->fd == -1)
+    return;
+
+  pthread_mutex_lock(&j->lock);
+  pthread_mutex_lock(&j->io);
+  j->len = 0;
+  ftruncate(j->fd, 0);
+  editorJournalWriteHeader(j->fd);
+  pthread_mutex_unlock(&j->io);
+  pthread_mutex_unlock(&j->lock);
+}
+
+void editorJournalClose(void) {
+  journal *j = &E.jnl;
+  if (j->fd == -1)
+    return;
+
+  pthread_mutex_lock(&j->lock);
+  j->stop = 1;
+  pthread_cond_signal(&j->wake);
+  pthread_mutex_unlock(&j->lock);
+  pthread_join(j->thread, NULL);
+
+  close(j->fd);
+  unlink(j->path);
+  j->fd = -1;
+}
+
+/*** match operations ***/
+
+void insertMatch(int cx, int cy, int rowoff) {
+  E.match_cache = realloc(E.match_cache, sizeof(match) * (E.num_matches+1));
+
+  int at = E.num_matches;
+  E.match_cache[at].cx = cx;
+  E.match_cache[at].cy = cy;
+  E.match_cache[at].rowoff = rowoff;
+  if (at == 0 || cy > E.match_last)
+    E.match_last = cy;
+
+  E.num_matches++;
+}
+
+void editorClearMatches(void) {
+  restoreRowHighlighting();
+  free(E.match_cache);
+  E.match_cache = NULL;
+  E.num_matches = 0;
+  E.match_index = 0;
+  free(E.search);
+  E.search = NULL;
+}
+
+void editorShiftMatches(int at, int removed, int added) {
+  if (E.num_matches == 0 || at > E.match_last)
+    return;
+
+  int kept = 0;
+  E.match_last = 0;
+  for (int i=0; i<E.num_matches; i++) {
+    match m = E.match_cache[i];
+    saved_hl h = E.hl_cache[i];
+
+    if (m.cy >= at && m.cy < at+removed) {
+      free(h.saved_line);
+      if (E.match_index > kept)
+        E.match_index--;
+      continue;
+    }
+    if (m.cy >= at+removed) {
+      m.cy += added - removed;
+      h.line_num += added - removed;
+    }
+    E.match_cache[kept] = m;
+    E.hl_cache[kept] = h;
+    if (m.cy > E.match_last)
+      E.match_last = m.cy;
+    kept++;
+  }
+
+  E.num_matches = kept;
+  if (E.match_index >= E.num_matches)
+    E.match_index = 0;
+  if (E.num_matches == 0) {
+    free(E.match_cache);
+    free(E.hl_cache);
+    E.match_cache = NULL;
+    E.hl_cache = NULL;
+  }
+}
+
+/*** find ***/
+
+void editorGoToCurrMatch(void) {
+  match curr_match = E.match_cache[E.match_index];
+
+  E.cx = curr_match.cx;
+  E.cy = curr_match.cy;
+  E.rowoff = curr_match.rowoff;
+}
+
+void editorGoToNextMatch(void) {
+  E.dirsearch ? E.match_index++ : E.match_index--;
+  if (E.match_index == E.num_matches)
+    E.match_index = 0;
+  if (E.match_index == -1)
+    E.match_index = E.num_matches-1;
+  editorGoToCurrMatch();
+}
+
+void editorGoToPrevMatch(void) {
+  E.dirsearch ? E.match_index-- : E.match_index++;
+  if (E.match_index == E.num_matches)
+    E.match_index = 0;
+  if (E.match_index == -1)
+    E.match_index = E.num_matches-1;
+  editorGoToCurrMatch();
+}
+
+void editorMatchRows(int from) {
+  for (int i=from; E.search && i<E.numrows; i++) {
+    erow *row = &E.row[i];
+    char *chars = rowChars(row);
+    char *match = strstr(chars, E.search);
+    if (match) {
+      unsigned char *hl = hlDecode(row);
+      memset(&hl[match-chars], HL_MATCH, strlen(E.search));
+      saveRowHighlighting(i, hlDup(row));
+      hlStore(row, hl);
+      insertMatch(match-chars, i, E.numrows);
+    }
+  }
+}
+
+void editorFindCallback(char *query, int key) {
+  if (key == RETURN_CLI)
+    return;
+
+  editorClearMatches();
+
+  if (key == CANCEL_CLI)
+    return;
+  E.search = strdup(query);
+
+  for (int i=0; i<E.numrows; i++) {
+    if (i % COLD_TRIM_ROWS == 0)
+      editorColdTrim();
+    erow *row = &E.row[i];
+    char *chars = rowChars(row);
+    char *match = strstr(chars, query);
+    if (match) {
+      if (i<=E.cy)
+        E.match_index = E.num_matches;
+      unsigned char *hl = hlDecode(row);
+      memset(&hl[match-chars], HL_MATCH, strlen(query));
+      saveRowHighlighting(i, hlDup(row));
+      hlStore(row, hl);
+      insertMatch(match-chars, i, E.numrows);
+    }
+  }
+
+  if (E.num_matches > 0)
+    editorGoToCurrMatch();
+}
+
+void editorFind(int fwd) {
+  int saved_cx = E.cx;
+  int saved_cy = E.cy;
+  int saved_coloff = E.coloff;
+  int saved_rowoff = E.rowoff;
+
+  E.dirsearch = fwd;
+  char *query = editorPrompt(E.dirsearch ? "/%s" : "?%s", editorFindCallback);
+
+  if (query)
+    free(query);
+  else {
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+  }
+}
+
+/*** substitute ***/
+
+void substPut(char **buf, int *len, int *cap, const char *s, int n) {
+  if (*len + n + 1 > *cap) {
+    while (*len + n + 1 > *cap)
+      *cap = *cap ? *cap * 2 : 256;
+    *buf = realloc(*buf, *cap);
+  }
+  memcpy(*buf + *len, s, n);
+  *len += n;
+}
+
+void substExpand(char **buf, int *len, int *cap, char *rep,
+                 const char *line, regmatch_t *m) {
+  for (char *r = rep; *r; r++) {
+    if (*r == '&')
+      substPut(buf, len, cap, line + m[0].rm_so, m[0].rm_eo - m[0].rm_so);
+    else if (*r == '\\' && isdigit((unsigned char)r[1])) {
+      regmatch_t *g = &m[*++r - '0'];
+      if (g->rm_so != -1)
+        substPut(buf, len, cap, line + g->rm_so, g->rm_eo - g->rm_so);
+    } else if (*r == '\\' && r[1] == 't') {
+      substPut(buf, len, cap, "\t", 1);
+      r++;
+    } else if (*r == '\\' && r[1]) {
+      substPut(buf, len, cap, ++r, 1);
+    } else
+      substPut(buf, len, cap, r, 1);
+  }
+}
+
+int substLine(subst *s, regex_t *re, const char *line, int size,
+              char **buf, int *len, int *cap) {
+  regmatch_t m[10];
+  int pos = 0, n = 0;
+
+  *len = 0;
+  while (pos <= size) {
+    if (s->lit) {
+      char *hit = memmem(line+pos, size-pos, s->lit, s->litlen);
+      if (hit == NULL)
+        break;
+      m[0].rm_so = hit - line;
+      m[0].rm_eo = m[0].rm_so + s->litlen;
+      for (int i=1; i<10; i++)
+        m[i].rm_so = m[i].rm_eo = -1;
+    } else {
+      if (regexec(re, line+pos, s->nmatch, m, pos > 0 ? REG_NOTBOL : 0) != 0)
+        break;
+      for (int i=s->nmatch; i<10; i++)
+        m[i].rm_so = m[i].rm_eo = -1;
+      for (int i=0; i<s->nmatch; i++) {
+        if (m[i].rm_so != -1) {
+          m[i].rm_so += pos;
+          m[i].rm_eo += pos;
+        }
+      }
+    }
+
+    substPut(buf, len, cap, line+pos, m[0].rm_so - pos);
+    substExpand(buf, len, cap, s->rep, line, m);
+    n++;
+
+    if (m[0].rm_eo == m[0].rm_so) {
+      if (m[0].rm_eo < size)
+        substPut(buf, len, cap, line + m[0].rm_eo, 1);
+      pos = m[0].rm_eo + 1;
+    } else
+      pos = m[0].rm_eo;
+    if (!s->global)
+      break;
+  }
+
+  if (n > 0 && pos < size)
+    substPut(buf, len, cap, line+pos, size-pos);
+  return n;
+}
+
+void *substWorker(void *arg) {
+  substjob *j = arg;
+  regex_t re;
+  char *buf = NULL;
+  int len, cap = 0;
+
+  if (!j->s->lit && regcomp(&re, j->s->pat, j->s->cflags) != 0) {
+    j->err = 1;
+    return NULL;
+  }
+
+  for (int i=j->from; i<j->to; i++) {
+    erow *row = &E.row[i];
+    int n = substLine(j->s, &re, rowChars(row), row->size, &buf, &len, &cap);
+    if (n == 0)
+      continue;
+
+    char *text = textAlloc(len);
+    memcpy(text, buf, len);
+    text[len] = '\0';
+
+    int k = j->nchanged++;
+    if ((k & (k-1)) == 0) {
+      int ncap = k ? k*2 : 1;
+      j->rows = realloc(j->rows, sizeof(int) * ncap);
+      j->texts = realloc(j->texts, sizeof(char *) * ncap);
+      j->sizes = realloc(j->sizes, sizeof(int) * ncap);
+    }
+    j->rows[k] = i;
+    j->texts[k] = text;
+    j->sizes[k] = len;
+    j->nsubs += n;
+  }
+
+  free(buf);
+  if (!j->s->lit)
+    regfree(&re);
+  return NULL;
+}
+
+char *substField(char **p, char delim) {
+  char *start = *p, *out = *p, *s = *p;
+
+  while (*s && *s != delim) {
+    if (*s == '\\' && s[1] == delim)
+      s++;
+    else if (*s == '\\' && s[1])
+      *out++ = *s++;
+    *out++ = *s++;
+  }
+  if (*s)
+    s++;
+  *out = '\0';
+  *p = s;
+  return start;
+}
+
+void editorSubstitute(int from, int to, char *args) {
+  subst s = {0};
+  char delim = *args;
+
+  if (delim == '\0' || isalnum((unsigned char)delim) || delim == '\\' ||
+      delim == ' ') {
+    editorSetStatusMessage("Invalid substitute: %s", args);
+    return;
+  }
+  args++;
+  s.pat = substField(&args, delim);
+  s.rep = substField(&args, delim);
+  s.cflags = REG_EXTENDED;
+  for (; *args; args++) {
+    if (*args == 'g')
+      s.global = 1;
+    else if (*args == 'i')
+      s.cflags |= REG_ICASE;
+    else if (*args != 'I') {
+      editorSetStatusMessage("Trailing characters: %s", args);
+      return;
+    }
+  }
+  if (*s.pat == '\0') {
+    editorSetStatusMessage("No previous regular expression");
+    return;
+  }
+
+  if (!(s.cflags & REG_ICASE) && strpbrk(s.pat, ".[]()*+?{}|^$\\") == NULL) {
+    s.lit = s.pat;
+    s.litlen = strlen(s.pat);
+  } else {
+    regex_t re;
+    int rc = regcomp(&re, s.pat, s.cflags);
+    if (rc != 0) {
+      char err[64];
+      regerror(rc, &re, err, sizeof(err));
+      editorSetStatusMessage("Invalid pattern: %s", err);
+      return;
+    }
+    s.nmatch = 1;
+    for (char *r = s.rep; *r; r++) {
+      if (*r == '\\' && isdigit((unsigned char)r[1])) {
+        s.nmatch = re.re_nsub < 9 ? re.re_nsub+1 : 10;
+        break;
+      } else if (*r == '\\' && r[1])
+        r++;
+    }
+    regfree(&re);
+  }
+
+  int total = to - from;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = total / SUBST_MIN_ROWS + 1;
+  if (nthreads > ncpu)
+    nthreads = ncpu > 0 ? ncpu : 1;
+  if (nthreads > SUBST_MAX_THREADS)
+    nthreads = SUBST_MAX_THREADS;
+
+  substjob jobs[SUBST_MAX_THREADS];
+  memset(jobs, 0, sizeof(jobs));
+  for (int t=0; t<nthreads; t++) {
+    jobs[t].s = &s;
+    jobs[t].from = from + (long)total * t / nthreads;
+    jobs[t].to = from + (long)total * (t+1) / nthreads;
+  }
+  if (nthreads == 1)
+    substWorker(&jobs[0]);
+  else {
+    for (int t=0; t<nthreads; t++)
+      if (pthread_create(&jobs[t].thread, NULL, substWorker, &jobs[t]) != 0)
+        die("pthread_create");
+    for (int t=0; t<nthreads; t++)
+      pthread_join(jobs[t].thread, NULL);
+  }
+
+  long nsubs = 0;
+  int nlines = 0, last = -1, failed = 0;
+  for (int t=0; t<nthreads; t++)
+    failed |= jobs[t].err;
+  if (!failed)
+    editorClearMatches();
+  for (int t=0; t<nthreads; t++) {
+    substjob *j = &jobs[t];
+    if (failed) {
+      for (int k=0; k<j->nchanged; k++)
+        textRelease(j->texts[k]);
+      j->nchanged = 0;
+    }
+    for (int k=0; k<j->nchanged; k++)
+      editorSetRowText(j->rows[k], j->texts[k], j->sizes[k]);
+    for (int k=0; k<j->nchanged; k++)
+      editorUpdateSyntax(&E.row[j->rows[k]]);
+    if (j->nchanged)
+      last = j->rows[j->nchanged-1];
+    nlines += j->nchanged;
+    nsubs += j->nsubs;
+    free(j->rows);
+    free(j->texts);
+    free(j->sizes);
+  }
+
+  if (failed)
+    editorSetStatusMessage("Substitute failed");
+  else if (nsubs == 0)
+    editorSetStatusMessage("Pattern not found: %s", s.pat);
+  else {
+    E.cy = last;
+    editorGoToFirstChar();
+    editorSetStatusMessage("%ld substitution%s on %d line%s", nsubs,
+                           nsubs == 1 ? "" : "s", nlines, nlines == 1 ? "" : "s");
+  }
+}
+
+/*** sort ***/
+
+uint64_t sortPrefix(const char *s, int len, int icase) {
+  uint64_t key = 0;
+
+  for (int i=0; i<8; i++) {
+    unsigned char c = i < len ? s[i] : 0;
+    key = key << 8 | (icase ? tolower(c) : c);
+  }
+  return key;
+}
+
+uint64_t sortNumber(const char *s, int len) {
+  for (int i=0; i<len; i++) {
+    if (!isdigit((unsigned char)s[i]))
+      continue;
+    int neg = i > 0 && s[i-1] == '-';
+    long long v = 0, max = 1LL << 62;
+    for (; i<len && isdigit((unsigned char)s[i]); i++)
+      v = v < max / 10 ? v * 10 + (s[i] - '0') : max;
+    return (uint64_t)(neg ? -v : v) + max + 1;
+  }
+  return 0;
+}
+
+int sortCompare(const sortitem *a, const sortitem *b, int numeric, int icase) {
+  if (a->key != b->key)
+    return a->key < b->key ? -1 : 1;
+  if (numeric)
+    return 0;
+
+  int n = a->len < b->len ? a->len : b->len;
+  for (int i=8; i<n; i++) {
+    unsigned char x = a->s[i], y = b->s[i];
+    if (icase) {
+      x = tolower(x);
+      y = tolower(y);
+    }
+    if (x != y)
+      return x < y ? -1 : 1;
+  }
+  return (a->len > b->len) - (a->len < b->len);
+}
+
+int sortQsortCompare(const void *a, const void *b, void *arg) {
+  const sortitem *x = a, *y = b;
+  int c = sortCompare(x, y, 0, *(int *)arg);
+  return c ? c : x->idx - y->idx;
+}
+
+void sortRadix(sortitem *items, sortitem *tmp, int n) {
+  for (int shift=0; shift<64; shift+=8) {
+    int count[257] = {0};
+    for (int i=0; i<n; i++)
+      count[(items[i].key >> shift & 0xff) + 1]++;
+    if (count[(items[0].key >> shift & 0xff) + 1] == n)
+      continue;
+    for (int b=0; b<256; b++)
+      count[b+1] += count[b];
+    for (int i=0; i<n; i++)
+      tmp[count[items[i].key >> shift & 0xff]++] = items[i];
+    memcpy(items, tmp, sizeof(sortitem) * n);
+  }
+}
+
+void *sortSlice(void *arg) {
+  sortjob *j = arg;
+  sortitem *items = j->items + j->lo;
+  int n = j->hi - j->lo;
+
+  for (int i=0; i<n; i++)
+    items[i].key = j->numeric ? sortNumber(items[i].s, items[i].len)
+                              : sortPrefix(items[i].s, items[i].len, j->icase);
+  if (n < 2)
+    return NULL;
+  if (j->numeric)
+    sortRadix(items, j->tmp + j->lo, n);
+  else
+    qsort_r(items, n, sizeof(sortitem), sortQsortCompare, &j->icase);
+  return NULL;
+}
+
+void *sortMerge(void *arg) {
+  sortjob *j = arg;
+  int a = j->lo, b = j->mid, k = j->lo;
+
+  while (a < j->mid && b < j->hi)
+    j->tmp[k++] = sortCompare(&j->items[b], &j->items[a], j->numeric, j->icase) < 0
+                ? j->items[b++] : j->items[a++];
+  while (a < j->mid)
+    j->tmp[k++] = j->items[a++];
+  while (b < j->hi)
+    j->tmp[k++] = j->items[b++];
+  memcpy(&j->items[j->lo], &j->tmp[j->lo], sizeof(sortitem) * (j->hi - j->lo));
+  return NULL;
+}
+
+void sortRun(sortjob *jobs, int n, void *(*fn)(void *)) {
+  if (n == 1) {
+    fn(&jobs[0]);
+    return;
+  }
+  for (int t=0; t<n; t++)
+    if (pthread_create(&jobs[t].thread, NULL, fn, &jobs[t]) != 0)
+      die("pthread_create");
+  for (int t=0; t<n; t++)
+    pthread_join(jobs[t].thread, NULL);
+}
+
+void editorSort(int from, int to, char *args) {
+  int numeric = 0, icase = 0, reverse = 0, unique = 0;
+
+  for (; *args; args++) {
+    if (*args == 'n')
+      numeric = 1;
+    else if (*args == 'i')
+      icase = 1;
+    else if (*args == 'r' || *args == '!')
+      reverse = 1;
+    else if (*args == 'u')
+      unique = 1;
+    else if (*args != ' ') {
+      editorSetStatusMessage("Invalid argument: %s", args);
+      return;
+    }
+  }
+
+  int n = to - from;
+  if (n < 2)
+    return;
+  sortitem *items = malloc(sizeof(sortitem) * n);
+  sortitem *tmp = malloc(sizeof(sortitem) * n);
+  for (int i=0; i<n; i++) {
+    items[i].s = rowChars(&E.row[from+i]);
+    items[i].len = E.row[from+i].size;
+    items[i].idx = i;
+  }
+
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = n / SORT_MIN_ROWS + 1;
+  if (nthreads > ncpu)
+    nthreads = ncpu > 0 ? ncpu : 1;
+  if (nthreads > SORT_MAX_THREADS)
+    nthreads = SORT_MAX_THREADS;
+
+  int bound[SORT_MAX_THREADS+1];
+  sortjob jobs[SORT_MAX_THREADS];
+  memset(jobs, 0, sizeof(jobs));
+  for (int t=0; t<=nthreads; t++)
+    bound[t] = (long)n * t / nthreads;
+  for (int t=0; t<SORT_MAX_THREADS; t++) {
+    jobs[t].items = items;
+    jobs[t].tmp = tmp;
+    jobs[t].numeric = numeric;
+    jobs[t].icase = icase;
+  }
+  for (int t=0; t<nthreads; t++) {
+    jobs[t].lo = bound[t];
+    jobs[t].hi = bound[t+1];
+  }
+  sortRun(jobs, nthreads, sortSlice);
+
+  for (int w=1; w<nthreads; w*=2) {
+    int m = 0;
+    for (int t=0; t+w<nthreads; t+=2*w) {
+      jobs[m].lo = bound[t];
+      jobs[m].mid = bound[t+w];
+      jobs[m].hi = bound[t+2*w < nthreads ? t+2*w : nthreads];
+      m++;
+    }
+    sortRun(jobs, m, sortMerge);
+  }
+
+  if (reverse) {
+    for (int i=0, k=n-1; i<k; i++, k--) {
+      sortitem x = items[i];
+      items[i] = items[k];
+      items[k] = x;
+    }
+    for (int i=0, k; i<n; i=k) {
+      for (k=i+1; k<n && !sortCompare(&items[i], &items[k], numeric, icase); k++)
+        ;
+      for (int a=i, b=k-1; a<b; a++, b--) {
+        sortitem x = items[a];
+        items[a] = items[b];
+        items[b] = x;
+      }
+    }
+  }
+
+  int m = n;
+  if (unique) {
+    m = 1;
+    for (int i=1; i<n; i++)
+      if (sortCompare(&items[m-1], &items[i], numeric, icase))
+        items[m++] = items[i];
+  }
+
+  char **texts = malloc(sizeof(char *) * m);
+  int *sizes = malloc(sizeof(int) * m);
+  for (int i=0; i<m; i++) {
+    texts[i] = items[i].s;
+    sizes[i] = items[i].len;
+  }
+  free(items);
+  free(tmp);
+
+  editorClearMatches();
+  editorInsertRowsShared(to, texts, sizes, m);
+  editorDelRows(from, n);
+  free(texts);
+  free(sizes);
+
+  E.cy = from;
+  editorGoToFirstChar();
+  if (m < n)
+    editorSetStatusMessage("%d lines sorted, %d duplicates removed", n, n - m);
+  else
+    editorSetStatusMessage("%d lines sorted", n);
+}
+
+/*** quickfix ***/
+
+void editorQuickfixClear(void) {
+  pthread_mutex_lock(&E.qf.lock);
+  for (int i=0; i<E.qf.len; i++) {
+    free(E.qf.items[i].path);
+    free(E.qf.items[i].text);
+  }
+  free(E.qf.items);
+  E.qf.items = NULL;
+  E.qf.len = E.qf.cap = 0;
+  E.qf.index = -1;
+  E.qf.seen = 0;
+  pthread_mutex_unlock(&E.qf.lock);
+}
+
+void editorQuickfixAdd(qfitem *items, int n) {
+  pthread_mutex_lock(&E.qf.lock);
+  if (E.qf.len + n > E.qf.cap) {
+    while (E.qf.len + n > E.qf.cap)
+      E.qf.cap = E.qf.cap ? E.qf.cap * 2 : 64;
+    E.qf.items = realloc(E.qf.items, sizeof(qfitem) * E.qf.cap);
+  }
+  memcpy(&E.qf.items[E.qf.len], items, sizeof(qfitem) * n);
+  E.qf.len += n;
+  pthread_mutex_unlock(&E.qf.lock);
+}
+
+void editorQuickfixGo(int idx) {
+  pthread_mutex_lock(&E.qf.lock);
+  int len = E.qf.len;
+  if (len == 0) {
+    pthread_mutex_unlock(&E.qf.lock);
+    editorSetStatusMessage("No quickfix entries");
+    return;
+  }
+  if (idx < 0)
+    idx = 0;
+  if (idx >= len)
+    idx = len-1;
+  qfitem it = E.qf.items[idx];
+  pthread_mutex_unlock(&E.qf.lock);
+
+  if (editorEdit(it.path) == -1)
+    return;
+  E.qf.index = idx;
+
+  E.cy = it.line-1 < E.numrows ? it.line-1 : E.numrows-1;
+  if (E.cy < 0)
+    E.cy = 0;
+  E.cx = 0;
+  if (E.cy < E.numrows)
+    E.cx = it.col < E.row[E.cy].size ? it.col : 0;
+  editorSetStatusMessage("(%d of %d) %s:%d: %s", idx+1, len, it.path, it.line, it.text);
+}
+
+void editorQuickfixStep(int n) {
+  int idx = E.qf.index == -1 && n > 0 ? n-1 : E.qf.index + n;
+  pthread_mutex_lock(&E.qf.lock);
+  int len = E.qf.len;
+  pthread_mutex_unlock(&E.qf.lock);
+
+  if (len > 0 && (idx < 0 || idx >= len)) {
+    editorSetStatusMessage(idx < 0 ? "No previous match" : "No more matches");
+    return;
+  }
+  editorQuickfixGo(idx);
+}
+
+/*** grep ***/
+
+char *grepJoin(const char *dir, const char *name) {
+  if (!strcmp(dir, "."))
+    return strdup(name);
+
+  size_t dlen = strlen(dir);
+  char *path = malloc(dlen + strlen(name) + 2);
+  int slash = dlen > 0 && dir[dlen-1] == '/';
+  sprintf(path, slash ? "%s%s" : "%s/%s", dir, name);
+  return path;
+}
+
+ignorelist *grepLoadIgnore(grepjob *g, char *dir, ignorelist *parent) {
+  char *path = grepJoin(dir, ".gitignore");
+  FILE *fp = fopen(path, "r");
+  free(path);
+  if (!fp)
+    return parent;
+
+  ignorelist *ign = calloc(1, sizeof(ignorelist));
+  ign->parent = parent;
+  if (strcmp(dir, "."))
+    ign->baselen = strlen(dir) + (dir[strlen(dir)-1] != '/');
+
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &linecap, fp)) != -1) {
+    while (len > 0 && isspace((unsigned char)line[len-1]))
+      line[--len] = '\0';
+    if (len == 0 || line[0] == '#')
+      continue;
+
+    ignpat ip = {0};
+    char *p = line;
+    if (*p == '!') {
+      ip.neg = 1;
+      p++;
+    }
+    if (*p && p[strlen(p)-1] == '/') {
+      ip.dironly = 1;
+      p[strlen(p)-1] = '\0';
+    }
+    if (strchr(p, '/'))
+      ip.anchored = 1;
+    if (*p == '/')
+      p++;
+    if (*p == '\0')
+      continue;
+    ip.glob = strdup(p);
+
+    ign->pats = realloc(ign->pats, sizeof(ignpat) * (ign->npats+1));
+    ign->pats[ign->npats++] = ip;
+  }
+  free(line);
+  fclose(fp);
+
+  pthread_mutex_lock(&g->lock);
+  ign->next = g->ignores;
+  g->ignores = ign;
+  pthread_mutex_unlock(&g->lock);
+  return ign;
+}
+
+int grepIgnored(ignorelist *ign, char *path, int isdir) {
+  char *name = strrchr(path, '/');
+  name = name ? name+1 : path;
+
+  for (; ign; ign = ign->parent) {
+    char *rel = path + ign->baselen;
+    for (int i=ign->npats-1; i>=0; i--) {
+      ignpat *ip = &ign->pats[i];
+      if (ip->dironly && !isdir)
+        continue;
+      if (fnmatch(ip->glob, ip->anchored ? rel : name,
+                  ip->anchored ? FNM_PATHNAME : 0) == 0)
+        return !ip->neg;
+    }
+  }
+  return 0;
+}
+
+void grepQueue(grepjob *g, grepitem *items, int n) {
+  if (g->qlen + n > g->qcap) {
+    while (g->qlen + n > g->qcap)
+      g->qcap = g->qcap ? g->qcap * 2 : 256;
+    g->queue = realloc(g->queue, sizeof(grepitem) * g->qcap);
+  }
+  memcpy(&g->queue[g->qlen], items, sizeof(grepitem) * n);
+  g->qlen += n;
+  pthread_cond_broadcast(&g->wake);
+}
+
+void grepPush(grepjob *g, grepitem *items, int n) {
+  if (n == 0)
+    return;
+
+  pthread_mutex_lock(&g->lock);
+  grepQueue(g, items, n);
+  pthread_mutex_unlock(&g->lock);
+}
+
+void grepDir(grepjob *g, grepitem *it) {
+  DIR *d = opendir(it->path);
+  if (!d)
+    return;
+
+  ignorelist *ign = grepLoadIgnore(g, it->path, it->ign);
+  if (g->watch)
+    dirWatchAdd(g->watch, it->path, ign);
+  grepitem *items = NULL;
+  int n = 0, cap = 0;
+  struct dirent *de;
+
+  while ((de = readdir(d)) != NULL && !g->stop) {
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+        !strcmp(de->d_name, ".git"))
+      continue;
+
+    char *path = grepJoin(it->path, de->d_name);
+    int type = de->d_type;
+    if (type == DT_UNKNOWN) {
+      struct stat st;
+      if (lstat(path, &st) == 0)
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+    }
+    if ((type != DT_DIR && type != DT_REG) ||
+        grepIgnored(ign, path, type == DT_DIR)) {
+      free(path);
+      continue;
+    }
+
+    if (n == cap) {
+      cap = cap ? cap*2 : 32;
+      items = realloc(items, sizeof(grepitem) * cap);
+    }
+    items[n].path = path;
+    items[n].isdir = (type == DT_DIR);
+    items[n].ign = ign;
+    n++;
+  }
+  closedir(d);
+
+  grepPush(g, items, n);
+  free(items);
+}
+
+void grepFile(grepjob *g, char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return;
+  }
+  size_t size = st.st_size;
+  char *buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (buf == MAP_FAILED)
+    return;
+  madvise(buf, size, MADV_SEQUENTIAL);
+
+  qfitem *hits = NULL;
+  int n = 0, cap = 0;
+
+  if (memchr(buf, '\0', size < GREP_BINARY_PROBE ? size : GREP_BINARY_PROBE))
+    goto done;
+
+  const char *end = buf + size, *p = buf, *lstart = buf, *hit;
+  int line = 1;
+  while (p < end && (hit = memmem(p, end-p, g->pat, g->patlen)) != NULL) {
+    const char *nl;
+    while ((nl = memchr(lstart, '\n', hit - lstart)) != NULL) {
+      line++;
+      lstart = nl+1;
+    }
+    const char *lend = memchr(hit, '\n', end - hit);
+    if (lend == NULL)
+      lend = end;
+
+    int col = 0;
+    for (const char *q = lstart; q < hit; q++)
+      col = *q == '\t' ? (col/TAB_STOP + 1) * TAB_STOP : col+1;
+
+    const char *t = lstart;
+    while (t < lend && isspace((unsigned char)*t))
+      t++;
+    int tlen = lend - t;
+    if (tlen > 0 && t[tlen-1] == '\r')
+      tlen--;
+    if (tlen > GREP_TEXT_MAX)
+      tlen = GREP_TEXT_MAX;
+
+    if (n == cap) {
+      cap = cap ? cap*2 : 16;
+      hits = realloc(hits, sizeof(qfitem) * cap);
+    }
+    hits[n].path = strdup(path);
+    hits[n].line = line;
+    hits[n].col = col;
+    hits[n].text = strndup(t, tlen);
+    n++;
+
+    p = lstart = lend + 1;
+    line++;
+  }
+  if (n > 0)
+    editorQuickfixAdd(hits, n);
+
+done:
+  free(hits);
+  munmap(buf, size);
+  pthread_mutex_lock(&g->lock);
+  g->files++;
+  pthread_mutex_unlock(&g->lock);
+}
+
+void *grepWorker(void *arg) {
+  grepjob *g = arg;
+
+  pthread_mutex_lock(&g->lock);
+  while (1) {
+    while (g->qlen == 0 && g->busy > 0 && !g->stop)
+      pthread_cond_wait(&g->wake, &g->lock);
+    if (g->stop || g->qlen == 0)
+      break;
+
+    grepitem it = g->queue[--g->qlen];
+    g->busy++;
+    pthread_mutex_unlock(&g->lock);
+
+    if (it.isdir)
+      grepDir(g, &it);
+    else
+      g->visit(g, it.path);
+    free(it.path);
+
+    pthread_mutex_lock(&g->lock);
+    g->busy--;
+    if (g->busy == 0 && g->qlen == 0)
+      pthread_cond_broadcast(&g->wake);
+  }
+  if (--g->running == 0)
+    g->done = 1;
+  pthread_mutex_unlock(&g->lock);
+  return NULL;
+}
+
+void grepJobFree(grepjob *g) {
+  pthread_mutex_lock(&g->lock);
+  g->stop = 1;
+  pthread_cond_broadcast(&g->wake);
+  pthread_mutex_unlock(&g->lock);
+  for (int i=0; i<g->nthreads; i++)
+    pthread_join(g->threads[i], NULL);
+
+  for (int i=0; i<g->qlen; i++)
+    free(g->queue[i].path);
+  while (g->ignores && !g->keep_ignores) {
+    ignorelist *ign = g->ignores;
+    g->ignores = ign->next;
+    for (int i=0; i<ign->npats; i++)
+      free(ign->pats[i].glob);
+    free(ign->pats);
+    free(ign);
+  }
+  free(g->queue);
+  free(g->pat);
+  pthread_mutex_destroy(&g->lock);
+  pthread_cond_destroy(&g->wake);
+  free(g);
+}
+
+grepjob *grepStart(char *root, int isdir, ignorelist *ign,
+                   void (*visit)(grepjob *, char *)) {
+  grepjob *g = calloc(1, sizeof(grepjob));
+  g->visit = visit;
+  pthread_mutex_init(&g->lock, NULL);
+  pthread_cond_init(&g->wake, NULL);
+
+  grepitem it = { strdup(root), isdir, ign };
+  grepPush(g, &it, 1);
+
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  g->nthreads = ncpu < 2 ? 2 : ncpu > GREP_MAX_THREADS ? GREP_MAX_THREADS : ncpu;
+  g->running = g->nthreads;
+  return g;
+}
+
+void grepRun(grepjob *g) {
+  for (int i=0; i<g->nthreads; i++)
+    if (pthread_create(&g->threads[i], NULL, grepWorker, g) != 0)
+      die("pthread_create");
+}
+
+void walkEnqueue(grepjob **slot, char *path, int isdir, ignorelist *ign,
+                 void (*visit)(grepjob *, char *), dirwatch *watch) {
+  grepjob *g = *slot;
+
+  if (g) {
+    pthread_mutex_lock(&g->lock);
+    if (g->running > 0 && !g->stop && (g->busy > 0 || g->qlen > 0)) {
+      grepitem it = { strdup(path), isdir, ign };
+      grepQueue(g, &it, 1);
+      pthread_mutex_unlock(&g->lock);
+      return;
+    }
+    pthread_mutex_unlock(&g->lock);
+    grepJobFree(g);
+  }
+
+  g = grepStart(path, isdir, ign, visit);
+  g->watch = watch;
+  g->keep_ignores = 1;
+  *slot = g;
+  grepRun(g);
+}
+
+int walkReap(grepjob **slot) {
+  grepjob *g = *slot;
+  if (g == NULL)
+    return 0;
+
+  pthread_mutex_lock(&g->lock);
+  int done = g->done;
+  pthread_mutex_unlock(&g->lock);
+  if (!done)
+    return 0;
+
+  grepJobFree(g);
+  *slot = NULL;
+  return 1;
+}
+
+void dirWatchAdd(dirwatch *w, char *path, ignorelist *ign) {
+  int wd = inotify_add_watch(w->fd, path, w->mask | IN_ONLYDIR);
+  if (wd < 0)
+    return;
+
+  pthread_mutex_lock(&w->lock);
+  if (wd >= w->ndirs) {
+    int n = w->ndirs ? w->ndirs : 64;
+    while (n <= wd)
+      n *= 2;
+    w->dirs = realloc(w->dirs, sizeof(finddir) * n);
+    memset(&w->dirs[w->ndirs], 0, sizeof(finddir) * (n - w->ndirs));
+    w->ndirs = n;
+  }
+  free(w->dirs[wd].path);
+  w->dirs[wd].path = strdup(path);
+  w->dirs[wd].ign = ign;
+  pthread_mutex_unlock(&w->lock);
+}
+
+void dirWatchRead(dirwatch *w,
+                  void (*handle)(struct inotify_event *, char *, ignorelist *)) {
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+
+  if (w->fd == -1)
+    return;
+
+  while ((len = read(w->fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + len; ) {
+      struct inotify_event *ev = (struct inotify_event *) p;
+      p += sizeof(struct inotify_event) + ev->len;
+
+      pthread_mutex_lock(&w->lock);
+      if (ev->wd < 0 || ev->wd >= w->ndirs || w->dirs[ev->wd].path == NULL) {
+        pthread_mutex_unlock(&w->lock);
+        continue;
+      }
+      if (ev->mask & IN_IGNORED) {
+        free(w->dirs[ev->wd].path);
+        w->dirs[ev->wd].path = NULL;
+        pthread_mutex_unlock(&w->lock);
+        continue;
+      }
+      char *path = ev->len ? grepJoin(w->dirs[ev->wd].path, ev->name) : NULL;
+      ignorelist *ign = w->dirs[ev->wd].ign;
+      pthread_mutex_unlock(&w->lock);
+
+      if (path)
+        handle(ev, path, ign);
+      free(path);
+    }
+  }
+}
+
+void editorGrepStop(void) {
+  if (E.grep == NULL)
+    return;
+  grepJobFree(E.grep);
+  E.grep = NULL;
+}
+
+void editorGrep(char *args) {
+  char *pat, *dir;
+
+  while (*args == ' ')
+    args++;
+  if (*args == '"') {
+    pat = ++args;
+    char *out = args;
+    while (*args && *args != '"') {
+      if (*args == '\\' && args[1])
+        args++;
+      *out++ = *args++;
+    }
+    if (*args)
+      args++;
+    *out = '\0';
+  } else {
+    pat = args;
+    while (*args && *args != ' ')
+      args++;
+    if (*args)
+      *args++ = '\0';
+  }
+  while (*args == ' ')
+    args++;
+  dir = *args ? args : ".";
+
+  if (*pat == '\0') {
+    editorSetStatusMessage("Usage: :grep pattern [dir]");
+    return;
+  }
+
+  struct stat st;
+  if (stat(dir, &st) == -1) {
+    editorSetStatusMessage("Can't search %s: %s", dir, strerror(errno));
+    return;
+  }
+
+  editorGrepStop();
+  editorQuickfixClear();
+
+  grepjob *g = grepStart(dir, S_ISDIR(st.st_mode), NULL, grepFile);
+  g->pat = strdup(pat);
+  g->patlen = strlen(pat);
+  E.grep = g;
+  grepRun(g);
+
+  editorSetStatusMessage("grep: searching %s for %s", dir, pat);
+}
+
+int editorQuickfixPoll(void) {
+  grepjob *g = E.grep;
+  if (g == NULL)
+    return 0;
+
+  pthread_mutex_lock(&g->lock);
+  int done = g->done, files = g->files;
+  pthread_mutex_unlock(&g->lock);
+  pthread_mutex_lock(&E.qf.lock);
+  int len = E.qf.len;
+  pthread_mutex_unlock(&E.qf.lock);
+
+  if (len == E.qf.seen && !done)
+    return 0;
+  E.qf.seen = len;
+
+  if (done) {
+    editorGrepStop();
+    if (len == 0)
+      editorSetStatusMessage("grep: no matches in %d files", files);
+    else
+      editorSetStatusMessage("grep: %d matches in %d files, ]q to jump", len, files);
+  } else
+    editorSetStatusMessage("grep: %d matches so far (%d files)...", len, files);
+  return 1;
+}
+
+/*** finder ***/
+
+uint64_t finderMask(const char *s, int len) {
+  uint64_t mask = 0;
+
+  for (int i=0; i<len; i++) {
+    unsigned char c = tolower((unsigned char)s[i]);
+    if (c >= 'a' && c <= 'z')
+      mask |= 1ULL << (c - 'a');
+    else if (c >= '0' && c <= '9')
+      mask |= 1ULL << (26 + c - '0');
+    else
+      mask |= 1ULL << (36 + c % 28);
+  }
+  return mask;
+}
+
+int fuzzyScan(const char *s, int len, int from, const char *q, int qlen) {
+  int score = 0, qi = 0, prev = -2;
+
+  for (int i=from; i<len && qi<qlen; i++) {
+    if (tolower((unsigned char)s[i]) != q[qi])
+      continue;
+
+    int bonus = 1;
+    if (i == 0 || strchr("/_-. ", s[i-1]))
+      bonus += 8;
+    else if (islower((unsigned char)s[i-1]) && isupper((unsigned char)s[i]))
+      bonus += 6;
+    if (i == prev+1)
+      bonus += 5;
+    score += bonus;
+    prev = i;
+    qi++;
+  }
+  return qi == qlen ? score : -1;
+}
+
+int fuzzyScore(fentry *f, const char *q, int qlen) {
+  int score = fuzzyScan(f->path, f->len, 0, q, qlen);
+  if (score < 0)
+    return -1;
+
+  int base = fuzzyScan(f->path, f->len, f->base, q, qlen);
+  if (base >= 0 && base + 10 > score)
+    score = base + 10;
+  return score * 16 - f->len;
+}
+
+void *finderScoreSlice(void *arg) {
+  findjob *j = arg;
+
+  for (int i=j->from; i<j->to; i++) {
+    int idx = j->cand ? j->cand[i] : i;
+    fentry *f = &E.finder.files[idx];
+    if ((f->mask & j->qmask) != j->qmask)
+      continue;
+
+    int score = fuzzyScore(f, j->q, j->qlen);
+    if (score < 0)
+      continue;
+    j->hits[j->from + j->nhits++] = idx;
+
+    int k = j->ntop;
+    if (k == FINDER_ROWS && score <= j->score[k-1])
+      continue;
+    if (k < FINDER_ROWS)
+      j->ntop++;
+    else
+      k--;
+    while (k > 0 && j->score[k-1] < score) {
+      j->score[k] = j->score[k-1];
+      j->top[k] = j->top[k-1];
+      k--;
+    }
+    j->score[k] = score;
+    j->top[k] = idx;
+  }
+  return NULL;
+}
+
+void finderScore(const char *query) {
+  finder *F = &E.finder;
+  char q[256];
+  int qlen = 0;
+
+  for (; query[qlen] && qlen < (int)sizeof(q)-1; qlen++)
+    q[qlen] = tolower((unsigned char)query[qlen]);
+  q[qlen] = '\0';
+
+  pthread_mutex_lock(&F->lock);
+  int narrow = F->query && F->qgen == F->gen && !strncmp(q, F->query, strlen(F->query));
+  int n = narrow ? F->nhits : F->nfiles;
+  int *cand = narrow ? F->hits : NULL;
+  int *hits = malloc(sizeof(int) * (n ? n : 1));
+
+  int nthreads = n / FINDER_MIN_SLICE + 1;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > ncpu)
+    nthreads = ncpu > 0 ? ncpu : 1;
+  if (nthreads > FINDER_MAX_THREADS)
+    nthreads = FINDER_MAX_THREADS;
+
+  findjob jobs[FINDER_MAX_THREADS];
+  memset(jobs, 0, sizeof(jobs));
+  for (int t=0; t<nthreads; t++) {
+    jobs[t].q = q;
+    jobs[t].qlen = qlen;
+    jobs[t].qmask = finderMask(q, qlen);
+    jobs[t].cand = cand;
+    jobs[t].from = (long)n * t / nthreads;
+    jobs[t].to = (long)n * (t+1) / nthreads;
+    jobs[t].hits = hits;
+  }
+  if (nthreads == 1)
+    finderScoreSlice(&jobs[0]);
+  else {
+    for (int t=0; t<nthreads; t++)
+      if (pthread_create(&jobs[t].thread, NULL, finderScoreSlice, &jobs[t]) != 0)
+        die("pthread_create");
+    for (int t=0; t<nthreads; t++)
+      pthread_join(jobs[t].thread, NULL);
+  }
+
+  int nhits = 0, score[FINDER_ROWS];
+  F->ntop = 0;
+  for (int t=0; t<nthreads; t++) {
+    memmove(&hits[nhits], &hits[jobs[t].from], sizeof(int) * jobs[t].nhits);
+    nhits += jobs[t].nhits;
+
+    for (int i=0; i<jobs[t].ntop; i++) {
+      int k = F->ntop;
+      if (k == FINDER_ROWS && jobs[t].score[i] <= score[k-1])
+        break;
+      if (k < FINDER_ROWS)
+        F->ntop++;
+      else
+        k--;
+      while (k > 0 && score[k-1] < jobs[t].score[i]) {
+        score[k] = score[k-1];
+        F->top[k] = F->top[k-1];
+        k--;
+      }
+      score[k] = jobs[t].score[i];
+      F->top[k] = jobs[t].top[i];
+    }
+  }
+
+  free(F->hits);
+  F->hits = hits;
+  F->nhits = nhits;
+  free(F->query);
+  F->query = strdup(q);
+  F->qgen = F->gen;
+  if (F->sel >= F->ntop)
+    F->sel = F->ntop ? F->ntop-1 : 0;
+  pthread_mutex_unlock(&F->lock);
+}
+
+int *finderSlot(const char *path) {
+  finder *F = &E.finder;
+  uint64_t h = hashBytes(HASH_INIT, path, strlen(path)) & (F->cap-1);
+  int *pp = &F->buckets[h];
+
+  while (*pp != -1 && strcmp(F->files[*pp].path, path))
+    pp = &F->files[*pp].next;
+  return pp;
+}
+
+void finderUnlink(int i) {
+  int *pp = finderSlot(E.finder.files[i].path);
+  *pp = E.finder.files[i].next;
+}
+
+void finderInsert(char *path) {
+  finder *F = &E.finder;
+
+  if (F->nfiles == F->cap) {
+    F->cap = F->cap ? F->cap * 2 : 1024;
+    F->files = realloc(F->files, sizeof(fentry) * F->cap);
+    free(F->buckets);
+    F->buckets = malloc(sizeof(int) * F->cap);
+    memset(F->buckets, -1, sizeof(int) * F->cap);
+    for (int i=0; i<F->nfiles; i++) {
+      int *pp = finderSlot(F->files[i].path);
+      F->files[i].next = -1;
+      *pp = i;
+    }
+  }
+
+  int *pp = finderSlot(path);
+  if (*pp != -1)
+    return;
+  *pp = F->nfiles;
+  fentry *f = &F->files[F->nfiles++];
+  f->path = strdup(path);
+  f->len = strlen(path);
+  char *slash = strrchr(path, '/');
+  f->base = slash ? slash - path + 1 : 0;
+  f->mask = finderMask(path, f->len);
+  f->next = -1;
+  F->gen++;
+}
+
+void finderAdd(grepjob *g, char *path) {
+  (void) g;
+  pthread_mutex_lock(&E.finder.lock);
+  finderInsert(path);
+  pthread_mutex_unlock(&E.finder.lock);
+}
+
+void finderDelete(int i) {
+  finder *F = &E.finder;
+  int last = F->nfiles - 1;
+
+  finderUnlink(i);
+  free(F->files[i].path);
+  if (i != last) {
+    finderUnlink(last);
+    F->files[i] = F->files[last];
+    F->files[i].next = -1;
+    *finderSlot(F->files[i].path) = i;
+  }
+  F->nfiles--;
+  F->gen++;
+}
+
+void finderRemove(char *path, int prefix) {
+  finder *F = &E.finder;
+  int plen = strlen(path);
+
+  pthread_mutex_lock(&F->lock);
+  if (!prefix) {
+    int i = F->cap ? *finderSlot(path) : -1;
+    if (i != -1)
+      finderDelete(i);
+  } else {
+    for (int i=F->nfiles-1; i>=0; i--) {
+      fentry *f = &F->files[i];
+      if (f->len > plen && f->path[plen] == '/' && !strncmp(f->path, path, plen))
+        finderDelete(i);
+    }
+  }
+  F->ntop = 0;
+  pthread_mutex_unlock(&F->lock);
+}
+
+void finderWalk(char *path, ignorelist *ign) {
+  finder *F = &E.finder;
+  walkEnqueue(&F->walk, path, 1, ign, finderAdd,
+              F->watch.fd != -1 ? &F->watch : NULL);
+}
+
+void finderEvent(struct inotify_event *ev, char *path, ignorelist *ign) {
+  int isdir = (ev->mask & IN_ISDIR) != 0;
+
+  if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+    if (strcmp(ev->name, ".git") && !grepIgnored(ign, path, isdir)) {
+      if (isdir)
+        finderWalk(path, ign);
+      else
+        finderAdd(NULL, path);
+    }
+  } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+    finderRemove(path, isdir);
+  }
+}
+
+int editorFinderPoll(void) {
+  finder *F = &E.finder;
+
+  dirWatchRead(&F->watch, finderEvent);
+  walkReap(&F->walk);
+
+  pthread_mutex_lock(&F->lock);
+  int stale = F->active && F->qgen != F->gen;
+  pthread_mutex_unlock(&F->lock);
+  if (!stale)
+    return 0;
+
+  finderScore(F->query ? F->query : "");
+  return 1;
+}
+
+void editorFinderCallback(char *query, int key) {
+  finder *F = &E.finder;
+
+  if (key == CTRL_KEY('n')) {
+    if (F->sel + 1 < F->ntop)
+      F->sel++;
+  } else if (key == CTRL_KEY('p')) {
+    if (F->sel > 0)
+      F->sel--;
+  } else if (key != RETURN_CLI && key != CANCEL_CLI) {
+    F->sel = 0;
+    finderScore(query);
+  }
+}
+
+void editorFindFile(void) {
+  finder *F = &E.finder;
+
+  if (F->watch.fd == -1) {
+    F->watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    F->watch.mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+    finderWalk(".", NULL);
+  }
+
+  F->active = 1;
+  F->sel = 0;
+  finderScore("");
+  char *query = editorPrompt("Find: %s", editorFinderCallback);
+
+  char *path = NULL;
+  pthread_mutex_lock(&F->lock);
+  if (query && F->ntop > 0)
+    path = strdup(F->files[F->top[F->sel]].path);
+  F->active = 0;
+  pthread_mutex_unlock(&F->lock);
+
+  if (path)
+    editorEdit(path);
+  free(path);
+  free(query);
+}
+
+/*** symbols ***/
+
+int symIsSource(const char *path) {
+  const char *ext = strrchr(path, '.');
+  return ext && (!strcmp(ext, ".c") || !strcmp(ext, ".h"));
+}
+
+int isIdentChar(int c) {
+  return isalnum(c) || c == '_';
+}
+
+const char *symKey(const char *path) {
+  while (path[0] == '.' && path[1] == '/')
+    path += 2;
+  return path;
+}
+
+int symToken(symtok *t, const char *s, int from, int to, int line) {
+  if (to - from >= SYM_NAME_MAX)
+    return 0;
+  memcpy(t->name, &s[from], to - from);
+  t->name[to - from] = '\0';
+  t->line = line;
+  t->col = 0;
+  for (int i=0; i<from; i++)
+    t->col = s[i] == '\t' ? (t->col/TAB_STOP + 1) * TAB_STOP : t->col+1;
+  return 1;
+}
+
+void symEmit(symparse *p, symtok *t, char kind) {
+  if (t->name[0] == '\0')
+    return;
+  if (p->ndefs == p->cap) {
+    p->cap = p->cap ? p->cap*2 : 32;
+    p->defs = realloc(p->defs, sizeof(symdef) * p->cap);
+  }
+  symdef *d = &p->defs[p->ndefs++];
+  d->name = strdup(t->name);
+  d->line = t->line;
+  d->col = t->col;
+  d->kind = kind;
+  d->next = NULL;
+  d->file = NULL;
+}
+
+void symLine(symparse *p, const char *s, int len, const unsigned char *hl, int line) {
+  int i = 0;
+  while (i < len && isspace((unsigned char)s[i]))
+    i++;
+
+  if (p->cpp || (i < len && s[i] == '#' && hl[i] == HL_NORMAL)) {
+    if (!p->cpp) {
+      while (++i < len && isspace((unsigned char)s[i]))
+        ;
+      if (len - i > 6 && !strncmp(&s[i], "define", 6) &&
+          isspace((unsigned char)s[i+6])) {
+        for (i += 6; i < len && isspace((unsigned char)s[i]); i++)
+          ;
+        int j = i;
+        while (j < len && isIdentChar((unsigned char)s[j]))
+          j++;
+        symtok t;
+        if (j > i && symToken(&t, s, i, j, line))
+          symEmit(p, &t, 'd');
+      }
+    }
+    p->cpp = len > 0 && s[len-1] == '\\';
+    return;
+  }
+
+  while (i < len) {
+    unsigned char c = s[i];
+    if (hl[i] == HL_COMMENT || hl[i] == HL_MLCOMMENT || hl[i] == HL_STRING ||
+        isspace(c)) {
+      i++;
+      continue;
+    }
+
+    if (isalpha(c) || c == '_') {
+      int j = i;
+      while (j < len && isIdentChar((unsigned char)s[j]))
+        j++;
+
+      if (p->depth == 0) {
+        const char *w = &s[i];
+        int wlen = j - i;
+
+        if (hl[i] == HL_KEYWORD1 || hl[i] == HL_KEYWORD2) {
+          p->agg = 0;
+          if (wlen == 7 && !strncmp(w, "typedef", 7))
+            p->tdef = 1;
+          else if ((wlen == 6 && !strncmp(w, "struct", 6)) ||
+                   (wlen == 5 && !strncmp(w, "union", 5)) ||
+                   (wlen == 4 && !strncmp(w, "enum", 4))) {
+            p->agg = 1;
+            p->kind = *w;
+          }
+          p->ident = 0;
+        } else if (p->paren == 0) {
+          if (p->agg == 1 && symToken(&p->aggname, s, i, j, line))
+            p->agg = 2;
+          else
+            p->agg = 0;
+          p->ident = symToken(&p->last, s, i, j, line);
+        } else if (p->paren == 1 && p->star && p->tdef && p->fptr.name[0] == '\0')
+          symToken(&p->fptr, s, i, j, line);
+        if (p->paren == 0)
+          p->params = 0;
+      }
+      p->star = 0;
+      i = j;
+      continue;
+    }
+
+    if (isdigit(c)) {
+      while (i < len && isIdentChar((unsigned char)s[i]))
+        i++;
+      p->ident = p->star = 0;
+      continue;
+    }
+
+    i++;
+    if (p->depth > 0) {
+      if (c == '{')
+        p->depth++;
+      else if (c == '}' && --p->depth == 0)
+        p->ident = p->params = p->agg = 0;
+      continue;
+    }
+
+    switch (c) {
+      case '(':
+        if (p->paren == 0) {
+          p->params = p->ident && !p->tdef ? -1 : 0;
+          if (p->params)
+            p->func = p->last;
+        }
+        p->paren++;
+        break;
+      case ')':
+        if (p->paren > 0 && --p->paren == 0 && p->params == -1)
+          p->params = 1;
+        break;
+      case '{':
+        if (p->params == 1)
+          symEmit(p, &p->func, 'f');
+        else if (p->agg == 2)
+          symEmit(p, &p->aggname, p->kind);
+        p->depth++;
+        p->last.name[0] = '\0';
+        p->params = p->agg = 0;
+        break;
+      case ';': case ',':
+        if (p->paren > 0)
+          break;
+        if (p->tdef)
+          symEmit(p, p->fptr.name[0] ? &p->fptr : &p->last, 't');
+        if (c == ';')
+          p->tdef = 0;
+        p->fptr.name[0] = p->last.name[0] = '\0';
+        p->params = p->agg = 0;
+        break;
+      default:
+        if (p->paren == 0)
+          p->params = p->agg = 0;
+    }
+    p->star = (c == '*');
+    p->ident = 0;
+  }
+}
+
+void symParseBuf(symparse *p, const char *buf, size_t size, lexer *lx) {
+  unsigned char *hl = NULL;
+  int hlcap = 0, in_comment = 0;
+  const char *end = buf + size;
+
+  for (int line = 1; buf < end; line++) {
+    const char *nl = memchr(buf, '\n', end - buf);
+    int len = (nl ? nl : end) - buf;
+    if (len > 0 && buf[len-1] == '\r')
+      len--;
+
+    if (len > hlcap) {
+      hlcap = len * 2;
+      hl = realloc(hl, hlcap);
+    }
+    in_comment = lexRow(lx, in_comment, buf, len, hl);
+    symLine(p, buf, len, hl, line);
+
+    if (nl == NULL)
+      break;
+    buf = nl + 1;
+  }
+  free(hl);
+}
+
+void symLink(symdef *d) {
+  symtab *S = &E.syms;
+  uint64_t h = hashBytes(HASH_INIT, d->name, strlen(d->name)) & (S->nbuckets-1);
+  d->next = S->names[h];
+  S->names[h] = d;
+}
+
+void symUnlink(symdef *d) {
+  symtab *S = &E.syms;
+  uint64_t h = hashBytes(HASH_INIT, d->name, strlen(d->name)) & (S->nbuckets-1);
+  symdef **pp = &S->names[h];
+  while (*pp != d)
+    pp = &(*pp)->next;
+  *pp = d->next;
+}
+
+void symGrow(int nfiles, int ndefs) {
+  symtab *S = &E.syms;
+
+  if (nfiles >= S->fbuckets) {
+    int n = S->fbuckets ? S->fbuckets : 1024;
+    while (n <= nfiles)
+      n *= 2;
+    symfile **files = calloc(n, sizeof(symfile *));
+    for (int b=0; b<S->fbuckets; b++)
+      while (S->files[b]) {
+        symfile *f = S->files[b];
+        S->files[b] = f->next;
+        uint64_t h = hashBytes(HASH_INIT, f->path, strlen(f->path)) & (n-1);
+        f->next = files[h];
+        files[h] = f;
+      }
+    free(S->files);
+    S->files = files;
+    S->fbuckets = n;
+  }
+
+  if (ndefs >= S->nbuckets) {
+    int n = S->nbuckets ? S->nbuckets : 4096;
+    while (n <= ndefs)
+      n *= 2;
+    free(S->names);
+    S->names = calloc(n, sizeof(symdef *));
+    S->nbuckets = n;
+    for (int b=0; b<S->fbuckets; b++)
+      for (symfile *f = S->files[b]; f; f = f->next)
+        for (int i=0; i<f->ndefs; i++)
+          symLink(&f->defs[i]);
+  }
+}
+
+symfile **symFileSlot(const char *path) {
+  symtab *S = &E.syms;
+  uint64_t h = hashBytes(HASH_INIT, path, strlen(path)) & (S->fbuckets-1);
+  symfile **pp = &S->files[h];
+
+  while (*pp && strcmp((*pp)->path, path))
+    pp = &(*pp)->next;
+  return pp;
+}
+
+void symFreeDefs(symfile *f) {
+  for (int i=0; i<f->ndefs; i++) {
+    symUnlink(&f->defs[i]);
+    free(f->defs[i].name);
+  }
+  E.syms.ndefs -= f->ndefs;
+  free(f->defs);
+  f->defs = NULL;
+  f->ndefs = 0;
+}
+
+void symDropFile(symfile **pp) {
+  symfile *f = *pp;
+
+  symFreeDefs(f);
+  *pp = f->next;
+  free(f->path);
+  free(f);
+  E.syms.nfiles--;
+  E.syms.dirty = 1;
+}
+
+void symPut(const char *path, time_t mtime, long nsec, off_t size,
+            symdef *defs, int ndefs) {
+  symtab *S = &E.syms;
+
+  symGrow(S->nfiles + 1, S->ndefs + ndefs);
+  symfile **pp = symFileSlot(path);
+  symfile *f = *pp;
+  if (f == NULL) {
+    f = calloc(1, sizeof(symfile));
+    f->path = strdup(path);
+    *pp = f;
+    S->nfiles++;
+  } else
+    symFreeDefs(f);
+
+  f->mtime = mtime;
+  f->nsec = nsec;
+  f->size = size;
+  f->defs = defs;
+  f->ndefs = ndefs;
+  f->seen = 1;
+  for (int i=0; i<ndefs; i++) {
+    defs[i].file = f;
+    symLink(&defs[i]);
+  }
+  S->ndefs += ndefs;
+  S->dirty = 1;
+}
+
+void symRemove(const char *path, int prefix) {
+  symtab *S = &E.syms;
+  int plen = strlen(path);
+
+  pthread_mutex_lock(&S->lock);
+  if (!prefix) {
+    symfile **pp = symFileSlot(path);
+    if (*pp)
+      symDropFile(pp);
+  } else {
+    for (int b=0; b<S->fbuckets; b++)
+      for (symfile **pp = &S->files[b]; *pp; ) {
+        if (!strncmp((*pp)->path, path, plen) && (*pp)->path[plen] == '/')
+          symDropFile(pp);
+        else
+          pp = &(*pp)->next;
+      }
+  }
+  pthread_mutex_unlock(&S->lock);
+}
+
+void symIndexFile(const char *path) {
+  symtab *S = &E.syms;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return;
+  }
+
+  pthread_mutex_lock(&S->lock);
+  symfile *f = *symFileSlot(path);
+  int fresh = f && f->mtime == st.st_mtim.tv_sec &&
+              f->nsec == st.st_mtim.tv_nsec && f->size == st.st_size;
+  if (f)
+    f->seen = 1;
+  pthread_mutex_unlock(&S->lock);
+  if (fresh) {
+    close(fd);
+    return;
+  }
+
+  symparse p;
+  memset(&p, 0, sizeof(p));
+  size_t size = st.st_size;
+  char *buf = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (buf != MAP_FAILED) {
+    if (!memchr(buf, '\0', size < GREP_BINARY_PROBE ? size : GREP_BINARY_PROBE))
+      symParseBuf(&p, buf, size, S->syntax->lexer);
+    munmap(buf, size);
+  }
+
+  pthread_mutex_lock(&S->lock);
+  symPut(path, st.st_mtim.tv_sec, st.st_mtim.tv_nsec, st.st_size, p.defs, p.ndefs);
+  pthread_mutex_unlock(&S->lock);
+}
+
+void symVisit(grepjob *g, char *path) {
+  (void) g;
+  if (symIsSource(path))
+    symIndexFile(symKey(path));
+}
+
+char *symCachePath(void) {
+  char *cache = getenv("XDG_CACHE_HOME");
+  char *home = getenv("HOME");
+  char dir[1024];
+
+  if (cache && *cache)
+    snprintf(dir, sizeof(dir), "%s", cache);
+  else if (home)
+    snprintf(dir, sizeof(dir), "%s/.cache", home);
+  else
+    return NULL;
+  mkdir(dir, 0700);
+  strncat(dir, "/vin", sizeof(dir) - strlen(dir) - 1);
+  if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+    return NULL;
+
+  char *cwd = getcwd(NULL, 0);
+  if (cwd == NULL)
+    return NULL;
+  uint64_t h = hashBytes(HASH_INIT, cwd, strlen(cwd));
+  free(cwd);
+
+  char *path = malloc(strlen(dir) + 32);
+  sprintf(path, "%s/symbols-%016llx", dir, (unsigned long long) h);
+  return path;
+}
+
+void symLoadCache(void) {
+  char *path = symCachePath();
+  FILE *fp = path ? fopen(path, "r") : NULL;
+  free(path);
+  if (fp == NULL)
+    return;
+
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t len;
+
+  if (getline(&line, &linecap, fp) == -1 ||
+      strncmp(line, SYM_CACHE_MAGIC "\n", sizeof(SYM_CACHE_MAGIC))) {
+    free(line);
+    fclose(fp);
+    return;
+  }
+
+  pthread_mutex_lock(&E.syms.lock);
+  while ((len = getline(&line, &linecap, fp)) != -1) {
+    long long mtime, size;
+    long nsec;
+    int ndefs, off;
+
+    if (len > 0 && line[len-1] == '\n')
+      line[--len] = '\0';
+    if (sscanf(line, "F %lld %ld %lld %d %n", &mtime, &nsec, &size, &ndefs, &off) != 4 ||
+        ndefs < 0)
+      break;
+    char *file = strdup(line + off);
+
+    symdef *defs = calloc(ndefs ? ndefs : 1, sizeof(symdef));
+    int n = 0;
+    for (; n < ndefs && (len = getline(&line, &linecap, fp)) != -1; n++) {
+      char kind;
+      if (len > 0 && line[len-1] == '\n')
+        line[--len] = '\0';
+      if (sscanf(line, "%c %d %d %n", &kind, &defs[n].line, &defs[n].col, &off) != 3)
+        break;
+      defs[n].kind = kind;
+      defs[n].name = strdup(line + off);
+    }
+    if (n == ndefs)
+      symPut(file, mtime, nsec, size, defs, ndefs);
+    free(file);
+    if (n != ndefs) {
+      for (int i=0; i<n; i++)
+        free(defs[i].name);
+      free(defs);
+      break;
+    }
+  }
+  E.syms.dirty = 0;
+  pthread_mutex_unlock(&E.syms.lock);
+
+  free(line);
+  fclose(fp);
+}
+
+void symSaveCache(void) {
+  symtab *S = &E.syms;
+  char *path = symCachePath();
+  if (path == NULL)
+    return;
+
+  char *tmp = malloc(strlen(path) + 5);
+  sprintf(tmp, "%s.tmp", path);
+  FILE *fp = fopen(tmp, "w");
+  if (fp == NULL) {
+    free(tmp);
+    free(path);
+    return;
+  }
+
+  fprintf(fp, "%s\n", SYM_CACHE_MAGIC);
+  pthread_mutex_lock(&S->lock);
+  for (int b=0; b<S->fbuckets; b++)
+    for (symfile *f = S->files[b]; f; f = f->next) {
+      if (strchr(f->path, '\n'))
+        continue;
+      fprintf(fp, "F %lld %ld %lld %d %s\n", (long long) f->mtime, f->nsec,
+              (long long) f->size, f->ndefs, f->path);
+      for (int i=0; i<f->ndefs; i++)
+        fprintf(fp, "%c %d %d %s\n", f->defs[i].kind, f->defs[i].line,
+                f->defs[i].col, f->defs[i].name);
+    }
+  S->dirty = 0;
+  pthread_mutex_unlock(&S->lock);
+
+  if (fclose(fp) == 0)
+    rename(tmp, path);
+  else
+    unlink(tmp);
+  free(tmp);
+  free(path);
+}
+
+void symEvent(struct inotify_event *ev, char *path, ignorelist *ign) {
+  symtab *S = &E.syms;
+  int isdir = (ev->mask & IN_ISDIR) != 0;
+
+  if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+    symRemove(path, isdir);
+    return;
+  }
+  if (!strcmp(ev->name, ".git") || grepIgnored(ign, path, isdir))
+    return;
+
+  if (isdir && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+    walkEnqueue(&S->walk, path, 1, ign, symVisit, &S->watch);
+  else if (!isdir && symIsSource(path) && (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)))
+    walkEnqueue(&S->walk, path, 0, ign, symVisit, &S->watch);
+}
+
+void editorSymbolsStart(void) {
+  symtab *S = &E.syms;
+  if (S->syntax)
+    return;
+
+  for (int j=0; j<E.num_syntaxes && S->syntax == NULL; j++)
+    if (!strcmp(E.syntaxdb[j].filetype, "c"))
+      S->syntax = &E.syntaxdb[j];
+  if (S->syntax == NULL)
+    return;
+  if (S->syntax->lexer == NULL)
+    S->syntax->lexer = editorCompileSyntax(S->syntax);
+
+  symGrow(0, 0);
+  symLoadCache();
+  for (int b=0; b<S->fbuckets; b++)
+    for (symfile *f = S->files[b]; f; f = f->next)
+      f->seen = 0;
+
+  S->watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  S->watch.mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE;
+  S->scanning = 1;
+  walkEnqueue(&S->walk, ".", 1, NULL, symVisit, &S->watch);
+}
+
+void editorSymbolsIndex(char *filename) {
+  if (E.syms.syntax && (filename[0] == '/' || !strncmp(symKey(filename), "../", 3)))
+    walkEnqueue(&E.syms.walk, filename, 0, NULL, symVisit, &E.syms.watch);
+}
+
+int editorSymbolsPoll(void) {
+  symtab *S = &E.syms;
+  if (S->syntax == NULL)
+    return 0;
+
+  dirWatchRead(&S->watch, symEvent);
+  if (walkReap(&S->walk) && S->scanning) {
+    pthread_mutex_lock(&S->lock);
+    for (int b=0; b<S->fbuckets; b++)
+      for (symfile **pp = &S->files[b]; *pp; ) {
+        if (!(*pp)->seen)
+          symDropFile(pp);
+        else
+          pp = &(*pp)->next;
+      }
+    pthread_mutex_unlock(&S->lock);
+    S->scanning = 0;
+  }
+  if (S->walk == NULL && S->dirty)
+    symSaveCache();
+  if (S->walk == NULL && S->pending) {
+    char *name = S->pending;
+    S->pending = NULL;
+    editorGoToDefinition(name);
+    free(name);
+    return 1;
+  }
+  return 0;
+}
+
+int symLookup(const char *name, symdef *out, char **path, struct stat *st) {
+  symtab *S = &E.syms;
+  const char *cur = E.filename ? symKey(E.filename) : "";
+  symdef *best = NULL;
+
+  pthread_mutex_lock(&S->lock);
+  uint64_t h = hashBytes(HASH_INIT, name, strlen(name)) & (S->nbuckets-1);
+  for (symdef *d = S->names[h]; d; d = d->next) {
+    if (strcmp(d->name, name))
+      continue;
+    if (best == NULL || !strcmp(d->file->path, cur))
+      best = d;
+    if (!strcmp(d->file->path, cur))
+      break;
+  }
+  if (best) {
+    *out = *best;
+    *path = strdup(best->file->path);
+    st->st_mtim.tv_sec = best->file->mtime;
+    st->st_mtim.tv_nsec = best->file->nsec;
+    st->st_size = best->file->size;
+  }
+  pthread_mutex_unlock(&S->lock);
+  return best != NULL;
+}
+
+int symBufferLookup(const char *name, symdef *out) {
+  symtab *S = &E.syms;
+
+  if (!S->bufvalid || S->bufgen != E.gen) {
+    for (int i=0; i<S->nbufdefs; i++)
+      free(S->bufdefs[i].name);
+    free(S->bufdefs);
+
+    symparse p;
+    memset(&p, 0, sizeof(p));
+    for (int i=0; i<E.numrows; i++)
+      symLine(&p, rowChars(&E.row[i]), E.row[i].size, hlDecode(&E.row[i]), i+1);
+    S->bufdefs = p.defs;
+    S->nbufdefs = p.ndefs;
+    S->bufgen = E.gen;
+    S->bufvalid = 1;
+  }
+
+  for (int i=0; i<S->nbufdefs; i++)
+    if (!strcmp(S->bufdefs[i].name, name)) {
+      *out = S->bufdefs[i];
+      return 1;
+    }
+  return 0;
+}
+
+void editorGoToDefinition(char *name) {
+  char word[SYM_NAME_MAX];
+
+  if (name == NULL) {
+    if (E.cy >= E.numrows || E.cx >= E.row[E.cy].size ||
+        !isIdentChar((unsigned char)rowChars(&E.row[E.cy])[E.cx])) {
+      editorSetStatusMessage("No identifier under cursor");
+      return;
+    }
+    erow *row = &E.row[E.cy];
+    char *chars = rowChars(row);
+    int from = E.cx, to = E.cx;
+    while (from > 0 && isIdentChar((unsigned char)chars[from-1]))
+      from--;
+    while (to < row->size && isIdentChar((unsigned char)chars[to]))
+      to++;
+    if (to - from >= SYM_NAME_MAX)
+      return;
+    memcpy(word, &chars[from], to - from);
+    word[to - from] = '\0';
+    name = word;
+  }
+
+  symdef def;
+  char *path = NULL;
+  int found = 0;
+
+  if (E.dirty && E.syntax && !strcmp(E.syntax->filetype, "c") &&
+      symBufferLookup(name, &def)) {
+    path = strdup(E.filename);
+    found = 1;
+  }
+
+  if (E.syms.syntax == NULL) {
+    editorSymbolsStart();
+    if (E.filename)
+      editorSymbolsIndex(E.filename);
+  }
+  if (E.syms.syntax == NULL) {
+    editorSetStatusMessage("No C syntax to index with");
+    return;
+  }
+  for (int tries=0; !found && tries<2; tries++) {
+    struct stat idx, st;
+    if (!symLookup(name, &def, &path, &idx))
+      break;
+    if (stat(path, &st) == 0 && st.st_mtim.tv_sec == idx.st_mtim.tv_sec &&
+        st.st_mtim.tv_nsec == idx.st_mtim.tv_nsec && st.st_size == idx.st_size)
+      found = 1;
+    else {
+      symRemove(path, 0);
+      symIndexFile(path);
+      free(path);
+      path = NULL;
+    }
+  }
+
+  if (!found && E.syms.walk) {
+    free(E.syms.pending);
+    E.syms.pending = strdup(name);
+    editorSetStatusMessage("Indexing symbols...");
+    return;
+  }
+  if (!found) {
+    editorSetStatusMessage("No definition of %s", name);
+    return;
+  }
+  if (editorEdit(path) == 0) {
+    E.cy = def.line-1 < E.numrows ? def.line-1 : E.numrows-1;
+    if (E.cy < 0)
+      E.cy = 0;
+    E.cx = E.cy < E.numrows && def.col < E.row[E.cy].size ? def.col : 0;
+    editorSetStatusMessage("%s:%d: %s", path, def.line, name);
+  }
+  free(path);
+}
+
+/*** ex commands ***/
+
+int editorParseAddress(char **p, int *line) {
+  char *s = *p;
+
+  if (*s == '.') {
+    *line = E.cy+1;
+    s++;
+  } else if (*s == '$') {
+    *line = E.numrows;
+    s++;
+  } else if (isdigit((unsigned char)*s))
+    *line = strtol(s, &s, 10);
+  else if (*s != '+' && *s != '-')
+    return 0;
+  else
+    *line = E.cy+1;
+
+  while (*s == '+' || *s == '-') {
+    int sign = (*s++ == '+') ? 1 : -1;
+    *line += sign * (isdigit((unsigned char)*s) ? strtol(s, &s, 10) : 1);
+  }
+
+  *p = s;
+  return 1;
+}
+
+void editorExCommand(char *cmd) {
+  char *p = cmd;
+  int from = E.cy+1, to = E.cy+1, ranged = 0;
+
+  while (*p == ' ' || *p == ':')
+    p++;
+
+  if (*p == '%') {
+    from = 1;
+    to = E.numrows;
+    ranged = 1;
+    p++;
+  } else if (editorParseAddress(&p, &from)) {
+    to = from;
+    ranged = 1;
+    if (*p == ',') {
+      p++;
+      if (!editorParseAddress(&p, &to)) {
+        editorSetStatusMessage("Invalid range");
+        return;
+      }
+    }
+  }
+  while (*p == ' ')
+    p++;
+
+  if (*p == '\0') {
+    if (ranged)
+      editorGoToLine(to);
+    return;
+  }
+
+  if (!strncmp(p, "grep ", 5)) {
+    editorGrep(p+5);
+    return;
+  } else if (!strcmp(p, "make") || !strncmp(p, "make ", 5)) {
+    editorQuickfixClear();
+    editorJobStart(p);
+    return;
+  } else if (!strncmp(p, "job ", 4)) {
+    editorJobStart(p+4);
+    return;
+  } else if (!strcmp(p, "jobs")) {
+    editorJobsList();
+    return;
+  } else if (!strncmp(p, "joblog", 6) && strchr(" ", p[6])) {
+    editorJobLog(p+6);
+    return;
+  } else if (!strncmp(p, "jobstop", 7) && strchr(" ", p[7])) {
+    editorJobStop(p+7);
+    return;
+  } else if (!strncmp(p, "e ", 2)) {
+    while (*++p == ' ')
+      ;
+    editorEdit(p);
+    return;
+  } else if (!strncmp(p, "tag ", 4)) {
+    for (p += 4; *p == ' '; p++)
+      ;
+    editorGoToDefinition(p);
+    return;
+  } else if (!strcmp(p, "set wrap") || !strcmp(p, "set nowrap")) {
+    editorSetWrap(p[4] == 'w');
+    return;
+  } else if (!strncmp(p, "set fps=", 8)) {
+    int fps = atoi(p+8);
+    E.frame_ms = fps > 0 ? 1000 / fps : 0;
+    return;
+  } else if (!strncmp(p, "set mem=", 8)) {
+    editorSetMemTarget(atoi(p+8));
+    return;
+  } else if (!strncmp(p, "set fsync=", 10)) {
+    editorJournalSetSync(atoi(p+10), E.jnl.sync_bytes);
+    return;
+  } else if (!strncmp(p, "set fsyncbytes=", 15)) {
+    editorJournalSetSync(E.jnl.sync_ms, atoi(p+15));
+    return;
+  } else if (!strcmp(p, "stopserver") || !strcmp(p, "stopserver!")) {
+    editorServerStop(p[10] == '!');
+    return;
+  } else if (!strcmp(p, "cn") || !strcmp(p, "cp")) {
+    editorQuickfixStep(p[1] == 'n' ? 1 : -1);
+    return;
+  }
+
+  if (from > to) {
+    int tmp = from;
+    from = to;
+    to = tmp;
+  }
+
+  if (*p == '!') {
+    if (!ranged || from < 1 || to > E.numrows) {
+      editorSetStatusMessage("Filter needs a range, e.g. :%%!sort");
+      return;
+    }
+    editorFilter(from-1, to, p+1);
+  } else if (!strncmp(p, "sort", 4) && strchr(" !", p[4])) {
+    if (!ranged) {
+      from = 1;
+      to = E.numrows;
+    }
+    if (from < 1 || to > E.numrows) {
+      editorSetStatusMessage("Invalid range");
+      return;
+    }
+    editorSort(from-1, to, p+4);
+  } else if (!strcmp(p, "d") || *p == 's') {
+    if (from < 1 || to > E.numrows) {
+      editorSetStatusMessage("Invalid range");
+      return;
+    }
+    if (*p == 's')
+      editorSubstitute(from-1, to, p+1);
+    else
+      editorDeleteRange(1, from-1, 0, to-1, 0);
+  } else if (!strcmp(p, "w"))
+    editorSave();
+  else if (!strcmp(p, "q"))
+    editorProcessKeypress(QUIT);
+  else if (!strcmp(p, "wq") || !strcmp(p, "x")) {
+    editorSave();
+    if (!E.dirty)
+      editorProcessKeypress(QUIT);
+  } else
+    editorSetStatusMessage("Not an editor command: %s", p);
+}
+
+/*** file watching ***/
+
+void editorWatchFile(void) {
+  if (stat(E.filename, &E.disk_st) == -1)
+    memset(&E.disk_st, 0, sizeof(E.disk_st));
+
+  if (E.watch_fd == -1)
+    E.watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (E.watch_fd == -1)
+    return;
+  if (E.watch_wd != -1)
+    inotify_rm_watch(E.watch_fd, E.watch_wd);
+
+  char *slash = strrchr(E.filename, '/');
+  char *dir = slash ? strndup(E.filename, slash - E.filename + 1) : strdup(".");
+
+  E.watch_wd = inotify_add_watch(E.watch_fd, dir,
+      IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+  free(dir);
+}
+
+int editorDiskChanged(void) {
+  struct stat st;
+
+  if (E.filename == NULL || stat(E.filename, &st) == -1)
+    return 0;
+
+  return st.st_ino != E.disk_st.st_ino || st.st_size != E.disk_st.st_size ||
+    st.st_mtim.tv_sec != E.disk_st.st_mtim.tv_sec ||
+    st.st_mtim.tv_nsec != E.disk_st.st_mtim.tv_nsec;
+}
+
+typedef struct diskline {
+  char *s;
+  int len;
+} diskline;
+
+diskline *editorSplitLines(char *buf, size_t size, int *nlines) {
+  int cap = 1024, n = 0;
+  diskline *lines = malloc(sizeof(diskline) * cap);
+  char *p = buf, *end = buf + size;
+
+  while (p < end) {
+    char *nl = memchr(p, '\n', end - p);
+    char *next = nl ? nl + 1 : end;
+    int len = (nl ? nl : end) - p;
+    while (len > 0 && (p[len-1] == '\n' || p[len-1] == '\r'))
+      len--;
+
+    if (n == cap) {
+      cap *= 2;
+      lines = realloc(lines, sizeof(diskline) * cap);
+    }
+    lines[n].s = p;
+    lines[n].len = len;
+    n++;
+    p = next;
+  }
+
+  *nlines = n;
+  return lines;
+}
+
+void editorHashTouch(int op, int at, int n) {
+  rowhashes *H = &E.hashes;
+  int lo = at / HASH_BLOCK_ROWS, hi = H->cap;
+
+  E.gen++;
+  if (op != J_INSERT_ROW && op != J_DEL_ROWS)
+    hi = (at + n - 1) / HASH_BLOCK_ROWS + 1;
+  if (hi > H->cap)
+    hi = H->cap;
+  if (lo < hi)
+    memset(&H->valid[lo], 0, hi - lo);
+}
+
+uint64_t hashRowBlock(int block) {
+  rowhashes *H = &E.hashes;
+
+  if (block >= H->cap) {
+    int cap = H->cap ? H->cap : 64;
+    while (cap <= block)
+      cap *= 2;
+    H->hash = realloc(H->hash, sizeof(uint64_t) * cap);
+    H->valid = realloc(H->valid, cap);
+    memset(&H->valid[H->cap], 0, cap - H->cap);
+    H->cap = cap;
+  }
+  if (!H->valid[block]) {
+    uint64_t h = HASH_INIT;
+    for (int i=block*HASH_BLOCK_ROWS; i<(block+1)*HASH_BLOCK_ROWS; i++)
+      h = hashBytes(h, rowChars(&E.row[i]), E.row[i].size);
+    H->hash[block] = h;
+    H->valid[block] = 1;
+  }
+  return H->hash[block];
+}
+
+diskline diskNextLine(char **p, char *end) {
+  char *s = *p;
+  char *nl = memchr(s, '\n', end - s);
+  int len = (nl ? nl : end) - s;
+
+  *p = nl ? nl + 1 : end;
+  while (len > 0 && s[len-1] == '\r')
+    len--;
+  return (diskline) { s, len };
+}
+
+diskline diskPrevLine(char *start, char **end) {
+  char *e = *end;
+
+  if (e > start && e[-1] == '\n')
+    e--;
+  char *nl = memrchr(start, '\n', e - start);
+  char *s = nl ? nl + 1 : start;
+  int len = e - s;
+
+  *end = s;
+  while (len > 0 && s[len-1] == '\r')
+    len--;
+  return (diskline) { s, len };
+}
+
+int rowEqualsLine(erow *row, diskline *line) {
+  return row->size == line->len && !memcmp(rowChars(row), line->s, line->len);
+}
+
+void editorReloadChanged(void) {
+  int fd = open(E.filename, O_RDONLY);
+  if (fd == -1)
+    return;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return;
+  }
+
+  char *map = NULL;
+  if (st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      editorSetStatusMessage("Can't reload! I/O error: %s", strerror(errno));
+      return;
+    }
+  }
+  close(fd);
+
+  char *p = map, *end = map + st.st_size, *q;
+  int head = 0, tail = 0;
+
+  while (head + HASH_BLOCK_ROWS <= E.numrows && p < end) {
+    uint64_t h = HASH_INIT;
+    int n = 0;
+    for (q = p; n < HASH_BLOCK_ROWS && q < end; n++) {
+      diskline l = diskNextLine(&q, end);
+      h = hashBytes(h, l.s, l.len);
+    }
+    if (n < HASH_BLOCK_ROWS || h != hashRowBlock(head / HASH_BLOCK_ROWS))
+      break;
+    head += HASH_BLOCK_ROWS;
+    p = q;
+  }
+  while (head < E.numrows && p < end) {
+    q = p;
+    diskline l = diskNextLine(&q, end);
+    if (!rowEqualsLine(&E.row[head], &l))
+      break;
+    head++;
+    p = q;
+  }
+
+  while (E.numrows - tail > head && end > p) {
+    int at = E.numrows - tail;
+    if (at % HASH_BLOCK_ROWS == 0 && at - HASH_BLOCK_ROWS >= head) {
+      diskline block[HASH_BLOCK_ROWS];
+      int n = 0;
+      for (q = end; n < HASH_BLOCK_ROWS && q > p; n++)
+        block[HASH_BLOCK_ROWS-1-n] = diskPrevLine(p, &q);
+      if (n == HASH_BLOCK_ROWS) {
+        uint64_t h = HASH_INIT;
+        for (int i=0; i<HASH_BLOCK_ROWS; i++)
+          h = hashBytes(h, block[i].s, block[i].len);
+        if (h == hashRowBlock(at / HASH_BLOCK_ROWS - 1)) {
+          tail += HASH_BLOCK_ROWS;
+          end = q;
+          continue;
+        }
+      }
+    }
+    q = end;
+    diskline l = diskPrevLine(p, &q);
+    if (!rowEqualsLine(&E.row[at-1], &l))
+      break;
+    tail++;
+    end = q;
+  }
+
+  int added;
+  diskline *lines = editorSplitLines(p, end - p, &added);
+  int removed = E.numrows - tail - head;
+  int changed = 0;
+
+  if (removed == added) {
+    int lo = -1, hi = -1;
+    for (int i=0; i<added; i++)
+      if (!rowEqualsLine(&E.row[head+i], &lines[i])) {
+        editorReplaceRow(head+i, lines[i].s, lines[i].len);
+        if (lo == -1)
+          lo = head+i;
+        hi = head+i+1;
+        changed++;
+      }
+    if (changed)
+      editorShiftMatches(lo, hi - lo, hi - lo);
+    removed = added = 0;
+  } else {
+    char **s = malloc(sizeof(char *) * (added+1));
+    int *len = malloc(sizeof(int) * (added+1));
+    for (int i=0; i<added; i++) {
+      s[i] = lines[i].s;
+      len[i] = lines[i].len;
+    }
+    editorDelRows(head, removed);
+    editorInsertRows(head, s, len, added);
+    free(s);
+    free(len);
+    changed = removed > added ? removed : added;
+  }
+
+  free(lines);
+  if (map)
+    munmap(map, st.st_size);
+
+  if (E.cy >= head + removed)
+    E.cy += added - removed;
+  else if (E.cy >= head + added)
+    E.cy = head + added > 0 ? head + added - 1 : 0;
+  if (E.cy >= E.numrows)
+    E.cy = E.numrows > 0 ? E.numrows-1 : 0;
+  if (E.cy < E.numrows && E.cx >= E.row[E.cy].size)
+    E.cx = E.row[E.cy].size > 0 ? E.row[E.cy].size-1 : 0;
+
+  E.disk_st = st;
+  E.dirty = 0;
+  editorJournalReset();
+
+  if (changed)
+    editorSetStatusMessage("\"%s\" reloaded, %d lines changed", E.filename, changed);
+}
+
+int editorFollowRead(void) {
+  followstate *F = &E.follow;
+  int fd = open(E.filename, O_RDONLY);
+  if (fd == -1)
+    return 0;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return 0;
+  }
+  int reset = st.st_dev != F->dev || st.st_ino != F->ino || st.st_size < F->offset;
+  if (!reset && st.st_size == F->offset) {
+    close(fd);
+    return 0;
+  }
+
+  int pinned = E.cy >= E.numrows - 1;
+  int dirty = E.dirty;
+  E.jnl.replaying = 1;
+  if (reset) {
+    editorDelRows(0, E.numrows);
+    F->dev = st.st_dev;
+    F->ino = st.st_ino;
+    F->offset = 0;
+    E.cx = E.cy = 0;
+    E.rowoff = E.coloff = 0;
+    dirty = 0;
+    editorJournalReset();
+    editorSetStatusMessage("\"%s\" truncated, following from the start", E.filename);
+  }
+
+  size_t avail = st.st_size - F->offset, len = 0;
+  size_t want = avail < FOLLOW_CHUNK ? avail : FOLLOW_CHUNK;
+  char *nl = NULL;
+  while (!nl && len < avail) {
+    if (want > F->cap) {
+      F->cap = want;
+      F->buf = realloc(F->buf, F->cap);
+    }
+    ssize_t r = pread(fd, F->buf + len, want - len, F->offset + len);
+    if (r <= 0)
+      break;
+    nl = memrchr(F->buf + len, '\n', r);
+    len += r;
+    want = avail < want * 2 ? avail : want * 2;
+  }
+  close(fd);
+
+  int at = E.numrows, n = 0;
+  if (nl) {
+    size_t used = nl + 1 - F->buf;
+    diskline *lines = editorSplitLines(F->buf, used, &n);
+    char **s = malloc(sizeof(char *) * n);
+    int *lens = malloc(sizeof(int) * n);
+    for (int i=0; i<n; i++) {
+      s[i] = lines[i].s;
+      lens[i] = lines[i].len;
+    }
+    editorInsertRows(at, s, lens, n);
+    free(s);
+    free(lens);
+    free(lines);
+    F->offset += used;
+  }
+  E.jnl.replaying = 0;
+  E.dirty = dirty;
+  E.disk_st = st;
+
+  editorMatchRows(at);
+
+  if (pinned && E.numrows > 0) {
+    E.cy = E.numrows - 1;
+    E.cx = 0;
+  }
+  return reset || n > 0;
+}
+
+int editorPollEvents(void) {
+  static int busy = 0;
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  int touched = 0;
+  ssize_t len;
+
+  editorColdPoll();
+  int updated = editorQuickfixPoll();
+  updated |= editorFinderPoll();
+  updated |= editorSymbolsPoll();
+  updated |= editorStreamPoll();
+  updated |= editorJobsPoll();
+
+  if (busy)
+    return updated;
+  if (E.follow.on) {
+    while (E.watch_fd != -1 && read(E.watch_fd, buf, sizeof(buf)) > 0)
+      ;
+    return editorFollowRead() | updated;
+  }
+  if (E.watch_fd == -1 || E.filename == NULL)
+    return updated;
+
+  char *slash = strrchr(E.filename, '/');
+  char *base = slash ? slash+1 : E.filename;
+
+  while ((len = read(E.watch_fd, buf, sizeof(buf))) > 0) {
+    char *p = buf;
+    while (p < buf + len) {
+      struct inotify_event *ev = (struct inotify_event *) p;
+      if (ev->len && !strcmp(ev->name, base))
+        touched = 1;
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+
+  if (!touched || !editorDiskChanged())
+    return updated;
+
+  busy = 1;
+  if (E.dirty) {
+    int saved_mode = E.mode;
+    char *ans = editorPrompt("File changed on disk and in buffer. Load it? (y/n) %s", NULL);
+    E.mode = saved_mode;
+    if (ans && (ans[0] == 'y' || ans[0] == 'Y'))
+      editorReloadChanged();
+    free(ans);
+  } else
+    editorReloadChanged();
+  busy = 0;
+
+  return 1;
+}
+
+/*** stdin stream ***/
+
+int editorStreamTake(void) {
+  int fd = dup(STDIN_FILENO);
+  int tty = open("/dev/tty", O_RDWR);
+  if (fd == -1 || tty == -1)
+    die("open /dev/tty");
+  dup2(tty, STDIN_FILENO);
+  close(tty);
+  return fd;
+}
+
+void streamPush(streamstate *S, streamchunk *c) {
+  c->next = NULL;
+  pthread_mutex_lock(&S->lock);
+  S->bytes += c->len;
+  if (S->tail)
+    S->tail->next = c;
+  else
+    S->head = c;
+  S->tail = c;
+  pthread_mutex_unlock(&S->lock);
+}
+
+void *streamRead(void *arg) {
+  streamstate *S = arg;
+  size_t cap = STREAM_CHUNK, len = 0;
+  streamchunk *c = malloc(sizeof(streamchunk) + cap);
+  ssize_t r;
+
+  while ((r = read(S->fd, c->data + len, cap - len)) != 0) {
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    len += r;
+    struct pollfd p = { S->fd, POLLIN, 0 };
+    if (len < cap && poll(&p, 1, 0) > 0)
+      continue;
+
+    char *nl = memrchr(c->data, '\n', len);
+    if (!nl) {
+      if (len == cap) {
+        cap *= 2;
+        c = realloc(c, sizeof(streamchunk) + cap);
+      }
+      continue;
+    }
+    size_t used = nl + 1 - c->data;
+    streamchunk *next = malloc(sizeof(streamchunk) + cap);
+    memcpy(next->data, nl + 1, len - used);
+    c->len = used;
+    streamPush(S, c);
+    c = next;
+    len -= used;
+  }
+
+  if (len > 0) {
+    c->len = len;
+    streamPush(S, c);
+  } else
+    free(c);
+  pthread_mutex_lock(&S->lock);
+  S->done = 1;
+  pthread_mutex_unlock(&S->lock);
+  return NULL;
+}
+
+void editorStreamOpen(int fd) {
+  E.stream.fd = fd;
+  if (pthread_create(&E.stream.thread, NULL, streamRead, &E.stream) != 0)
+    die("pthread_create");
+}
+
+streamchunk *streamPop(streamstate *S) {
+  pthread_mutex_lock(&S->lock);
+  streamchunk *c = S->head;
+  if (c && !(S->head = c->next))
+    S->tail = NULL;
+  pthread_mutex_unlock(&S->lock);
+  return c;
+}
+
+int editorInsertText(int at, char *buf, size_t len) {
+  int n;
+  diskline *lines = editorSplitLines(buf, len, &n);
+  char **s = malloc(sizeof(char *) * n);
+  int *lens = malloc(sizeof(int) * n);
+
+  for (int i=0; i<n; i++) {
+    s[i] = lines[i].s;
+    lens[i] = lines[i].len;
+  }
+  editorInsertRows(at, s, lens, n);
+  free(s);
+  free(lens);
+  free(lines);
+  return n;
+}
+
+void editorStreamAppend(char *buf, size_t len) {
+  int at = E.numrows, dirty = E.dirty;
+
+  editorInsertText(at, buf, len);
+  E.dirty = dirty;
+  editorMatchRows(at);
+}
+
+int editorStreamPoll(void) {
+  streamstate *S = &E.stream;
+  int updated = 0;
+
+  while (S->fd != -1) {
+    pthread_mutex_lock(&S->lock);
+    streamchunk *c = S->head;
+    if (c && !(S->head = c->next))
+      S->tail = NULL;
+    int done = S->done;
+    pthread_mutex_unlock(&S->lock);
+
+    if (!c) {
+      if (done) {
+        pthread_join(S->thread, NULL);
+        close(S->fd);
+        S->fd = -1;
+        editorSetStatusMessage("stdin: %d lines, %.1fMB", E.numrows, S->bytes / 1048576.0);
+        updated = 1;
+      }
+      break;
+    }
+    editorStreamAppend(c->data, c->len);
+    free(c);
+    updated = 1;
+
+    struct pollfd p = { STDIN_FILENO, POLLIN, 0 };
+    if (poll(&p, 1, 0) > 0)
+      break;
+  }
+  return updated;
+}
+
+/*** filter ***/
+
+int filterSpawn(filterjob *f, char *cmd) {
+  int in[2], out[2], err[2];
+
+  if (pipe(in) == -1)
+    return -1;
+  if (pipe(out) == -1) {
+    close(in[0]);
+    close(in[1]);
+    return -1;
+  }
+  if (pipe(err) == -1) {
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    return -1;
+  }
+
+  f->pid = fork();
+  if (f->pid == 0) {
+    setpgid(0, 0);
+    signal(SIGPIPE, SIG_DFL);
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(err[1], STDERR_FILENO);
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    close(err[0]);
+    close(err[1]);
+    execl("/bin/sh", "sh", "-c", cmd, (char *) NULL);
+    _exit(127);
+  }
+  close(in[0]);
+  close(out[1]);
+  close(err[1]);
+  if (f->pid == -1) {
+    close(in[1]);
+    close(out[0]);
+    close(err[0]);
+    return -1;
+  }
+  setpgid(f->pid, f->pid);
+
+  f->in = in[1];
+  f->err = err[0];
+  fcntl(f->in, F_SETFL, O_NONBLOCK);
+  fcntl(f->err, F_SETFL, O_NONBLOCK);
+  f->out.fd = out[0];
+  if (pthread_create(&f->out.thread, NULL, streamRead, &f->out) != 0)
+    die("pthread_create");
+  return 0;
+}
+
+void filterBatch(filterjob *f) {
+  static char nl = '\n';
+
+  if (f->next % COLD_TRIM_ROWS < FILTER_ROWS)
+    editorColdTrim();
+  f->niov = f->iovpos = 0;
+  for (; f->next < f->to && f->niov < FILTER_ROWS * 2; f->next++) {
+    erow *row = &E.row[f->next];
+    f->iov[f->niov].iov_base = rowChars(row);
+    f->iov[f->niov++].iov_len = row->size;
+    f->iov[f->niov].iov_base = &nl;
+    f->iov[f->niov++].iov_len = 1;
+  }
+}
+
+int filterFeed(filterjob *f) {
+  if (f->iovpos == f->niov)
+    filterBatch(f);
+  if (f->niov == 0)
+    return 0;
+
+  int n = f->niov - f->iovpos;
+  ssize_t w = writev(f->in, &f->iov[f->iovpos], n < IOV_MAX ? n : IOV_MAX);
+  if (w == -1)
+    return errno == EAGAIN || errno == EINTR ? 1 : 0;
+
+  while (w > 0 && (size_t) w >= f->iov[f->iovpos].iov_len)
+    w -= f->iov[f->iovpos++].iov_len;
+  if (w > 0) {
+    f->iov[f->iovpos].iov_base = (char *) f->iov[f->iovpos].iov_base + w;
+    f->iov[f->iovpos].iov_len -= w;
+  }
+  return 1;
+}
+
+void filterDrainErr(filterjob *f) {
+  char buf[4096];
+  ssize_t n;
+
+  while ((n = read(f->err, buf, sizeof(buf))) > 0)
+    for (ssize_t i=0; i<n; i++) {
+      if (buf[i] == '\n' && f->errlen > 0)
+        f->errdone = 1;
+      else if (!f->errdone && !strchr("\r\n", buf[i]) && f->errlen < FILTER_ERR_MAX)
+        f->errmsg[f->errlen++] = buf[i];
+    }
+  if (n == 0) {
+    close(f->err);
+    f->err = -1;
+  }
+}
+
+void filterInsert(filterjob *f) {
+  streamchunk *c;
+
+  while ((c = streamPop(&f->out)) != NULL) {
+    f->nout += editorInsertText(f->to + f->nout, c->data, c->len);
+    free(c);
+  }
+}
+
+void editorFilter(int from, int to, char *cmd) {
+  filterjob *f = calloc(1, sizeof(filterjob));
+  pthread_mutex_init(&f->out.lock, NULL);
+  f->next = from;
+  f->to = to;
+
+  void (*saved_pipe)(int) = signal(SIGPIPE, SIG_IGN);
+  if (filterSpawn(f, cmd) == -1) {
+    signal(SIGPIPE, saved_pipe);
+    editorSetStatusMessage("Can't run %s: %s", cmd, strerror(errno));
+    free(f);
+    return;
+  }
+
+  int cancelled = 0, done = 0, dirty = E.dirty;
+  long long shown = 0;
+  while (!done) {
+    struct pollfd p[3] = {
+      { STDIN_FILENO, POLLIN, 0 }, { f->in, POLLOUT, 0 }, { f->err, POLLIN, 0 }
+    };
+    poll(p, 3, 50);
+
+    if (p[0].revents & POLLIN) {
+      char buf[64];
+      int n = read(STDIN_FILENO, buf, sizeof(buf));
+      int cancel = n == 1 && buf[0] == '\x1b';
+      for (int i=0; i<n; i++) {
+        if (buf[i] == CTRL_KEY('c'))
+          cancel = 1;
+        else if (!cancel && E.typeahead_len < TYPEAHEAD_MAX)
+          E.typeahead[E.typeahead_len++] = buf[i];
+      }
+      if (cancel && !cancelled) {
+        kill(-f->pid, SIGTERM);
+        cancelled = 1;
+      }
+    }
+    if (f->in != -1 && (cancelled || ((p[1].revents & (POLLOUT | POLLERR | POLLHUP)) &&
+                                      !filterFeed(f)))) {
+      close(f->in);
+      f->in = -1;
+    }
+    if (f->err != -1 && (p[2].revents & (POLLIN | POLLHUP)))
+      filterDrainErr(f);
+
+    pthread_mutex_lock(&f->out.lock);
+    done = f->out.done && f->err == -1;
+    pthread_mutex_unlock(&f->out.lock);
+
+    int frame = monotonicMs() - shown >= FRAME_STALL_MS;
+    if (!cancelled && (done || frame))
+      filterInsert(f);
+    if (!done && frame) {
+      editorSetStatusMessage("!%.30s: %d of %d lines sent, %d back (Esc cancels)",
+          cmd, f->next - from, to - from, f->nout);
+      editorRefreshScreen();
+      shown = monotonicMs();
+    }
+  }
+
+  if (f->in != -1)
+    close(f->in);
+  int status;
+  waitpid(f->pid, &status, 0);
+  pthread_join(f->out.thread, NULL);
+  close(f->out.fd);
+  signal(SIGPIPE, saved_pipe);
+
+  int ok = !cancelled && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  if (!ok && f->nout > 0) {
+    editorDelRows(to, f->nout);
+    E.dirty = dirty;
+  }
+
+  if (cancelled)
+    editorSetStatusMessage("Filter cancelled");
+  else if (!ok)
+    editorSetStatusMessage("shell returned %d: %.*s", WIFEXITED(status) ?
+        WEXITSTATUS(status) : 128 + WTERMSIG(status), f->errlen, f->errmsg);
+  else {
+    editorClearMatches();
+    editorDelRows(from, to - from);
+    E.cy = from < E.numrows ? from : E.numrows > 0 ? E.numrows-1 : 0;
+    editorGoToFirstChar();
+    editorSetStatusMessage("%d lines filtered, %d lines now", to - from, f->nout);
+  }
+
+  while (f->out.head) {
+    streamchunk *c = f->out.head;
+    f->out.head = c->next;
+    free(c);
+  }
+  free(f);
+}
+
+/*** jobs ***/
+
+void editorJobStart(char *cmd) {
+  int fds[2];
+
+  while (*cmd == ' ')
+    cmd++;
+  if (*cmd == '\0') {
+    editorSetStatusMessage("Usage: :job cmd");
+    return;
+  }
+  if (pipe2(fds, O_CLOEXEC) == -1) {
+    editorSetStatusMessage("Can't run %s: %s", cmd, strerror(errno));
+    return;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    setpgid(0, 0);
+    signal(SIGPIPE, SIG_DFL);
+    int null = open("/dev/null", O_RDONLY);
+    dup2(null, STDIN_FILENO);
+    dup2(fds[1], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+    execl("/bin/sh", "sh", "-c", cmd, (char *) NULL);
+    _exit(127);
+  }
+  close(fds[1]);
+  if (pid == -1) {
+    close(fds[0]);
+    editorSetStatusMessage("Can't run %s: %s", cmd, strerror(errno));
+    return;
+  }
+  setpgid(pid, pid);
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+  jobset *J = &E.jobs;
+  if (J->n == J->cap) {
+    J->cap = J->cap ? J->cap * 2 : 8;
+    J->jobs = realloc(J->jobs, sizeof(job) * J->cap);
+  }
+  job *j = &J->jobs[J->n++];
+  memset(j, 0, sizeof(job));
+  j->cmd = strdup(cmd);
+  j->pid = pid;
+  j->fd = fds[0];
+  j->status = -1;
+  editorSetStatusMessage("job %d: %s", J->n, cmd);
+}
+
+void jobDirectory(job *j, char *s, int len) {
+  char *q = memmem(s, len, "Entering directory '", 20);
+  if (q) {
+    q += 20;
+    char *end = memchr(q, '\'', s + len - q);
+    if (end) {
+      free(j->dir);
+      j->dir = strndup(q, end - q);
+    }
+  } else if (memmem(s, len, "Leaving directory '", 19)) {
+    free(j->dir);
+    j->dir = NULL;
+  }
+}
+
+void jobParseLine(job *j, char *s, int len) {
+  int i = 0;
+
+  jobDirectory(j, s, len);
+  while (i < len && s[i] != ':' && s[i] != ' ')
+    i++;
+  if (i == 0 || i + 1 >= len || s[i] != ':' || !isdigit((unsigned char)s[i+1]))
+    return;
+
+  int plen = i, line = 0, col = 0;
+  for (i++; i < len && isdigit((unsigned char)s[i]); i++)
+    line = line * 10 + (s[i] - '0');
+  if (i >= len || s[i] != ':')
+    return;
+  if (i + 1 < len && isdigit((unsigned char)s[i+1])) {
+    for (i++; i < len && isdigit((unsigned char)s[i]); i++)
+      col = col * 10 + (s[i] - '0');
+    if (i >= len || s[i] != ':')
+      return;
+  }
+  for (i++; i < len && s[i] == ' '; i++)
+    ;
+
+  char *name = strndup(s, plen);
+  char *path = j->dir && name[0] != '/' ? grepJoin(j->dir, name) : strdup(name);
+  free(name);
+  if (access(path, R_OK) == -1) {
+    free(path);
+    return;
+  }
+
+  int tlen = len - i;
+  if (tlen > 0 && s[i+tlen-1] == '\r')
+    tlen--;
+  if (tlen > GREP_TEXT_MAX)
+    tlen = GREP_TEXT_MAX;
+  qfitem it = { path, line, col > 0 ? col-1 : 0, strndup(s+i, tlen) };
+  editorQuickfixAdd(&it, 1);
+  j->errors++;
+}
+
+int jobRead(job *j) {
+  ssize_t n;
+
+  for (;;) {
+    if (j->cap - j->len < JOB_READ) {
+      j->cap = j->cap ? j->cap * 2 : JOB_READ * 2;
+      j->out = realloc(j->out, j->cap);
+    }
+    n = read(j->fd, j->out + j->len, j->cap - j->len);
+    if (n <= 0)
+      break;
+    j->len += n;
+  }
+  if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+    close(j->fd);
+    j->fd = -1;
+  }
+  return j->fd == -1;
+}
+
+int editorJobsPoll(void) {
+  jobset *J = &E.jobs;
+  int updated = 0;
+
+  for (int k=0; k<J->n; k++) {
+    job *j = &J->jobs[k];
+    if (j->status != -1)
+      continue;
+
+    size_t from = j->scan;
+    if (j->fd != -1) {
+      int eof = jobRead(j);
+      char *nl = memrchr(j->out + j->scan, '\n', j->len - j->scan);
+      j->scan = nl ? (size_t) (nl + 1 - j->out) : eof ? j->len : j->scan;
+    }
+    if (j->scan > from) {
+      int n;
+      diskline *lines = editorSplitLines(j->out + from, j->scan - from, &n);
+      for (int i=0; i<n; i++)
+        jobParseLine(j, lines[i].s, lines[i].len);
+
+      if (J->shown == k) {
+        char **s = malloc(sizeof(char *) * n);
+        int *lens = malloc(sizeof(int) * n);
+        for (int i=0; i<n; i++) {
+          s[i] = lines[i].s;
+          lens[i] = lines[i].len;
+        }
+        int pinned = E.cy >= E.numrows - 1, dirty = E.dirty;
+        editorInsertRows(E.numrows, s, lens, n);
+        E.dirty = dirty;
+        if (pinned)
+          E.cy = E.numrows - 1;
+        free(s);
+        free(lens);
+      }
+      free(lines);
+      updated = 1;
+    }
+
+    int status;
+    if (j->fd == -1 && waitpid(j->pid, &status, WNOHANG) == j->pid) {
+      j->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+      if (j->errors)
+        editorSetStatusMessage("job %d (%.30s) exited %d, %d errors, ]q to jump",
+            k+1, j->cmd, j->status, j->errors);
+      else
+        editorSetStatusMessage("job %d (%.30s) exited %d", k+1, j->cmd, j->status);
+      updated = 1;
+    }
+  }
+  return updated;
+}
+
+int editorJobsRunning(void) {
+  int n = 0;
+  for (int k=0; k<E.jobs.n; k++)
+    n += E.jobs.jobs[k].status == -1;
+  return n;
+}
+
+job *jobLookup(char *arg) {
+  while (*arg == ' ')
+    arg++;
+  int k = *arg ? atoi(arg) - 1 : E.jobs.n - 1;
+  if (k < 0 || k >= E.jobs.n) {
+    editorSetStatusMessage(E.jobs.n ? "No such job: %s" : "No jobs", arg);
+    return NULL;
+  }
+  return &E.jobs.jobs[k];
+}
+
+void editorJobsList(void) {
+  char msg[sizeof(E.statusmsg)];
+  int len = 0;
+
+  if (E.jobs.n == 0) {
+    editorSetStatusMessage("No jobs");
+    return;
+  }
+  for (int k=0; k<E.jobs.n && len < (int)sizeof(msg); k++) {
+    job *j = &E.jobs.jobs[k];
+    char state[16];
+    if (j->status == -1)
+      snprintf(state, sizeof(state), "running");
+    else
+      snprintf(state, sizeof(state), "exit %d", j->status);
+    len += snprintf(msg + len, sizeof(msg) - len, "%s%d:%.16s [%s]",
+                    k ? "  " : "", k+1, j->cmd, state);
+  }
+  editorSetStatusMessage("%s", msg);
+}
+
+void editorJobLog(char *arg) {
+  job *j = jobLookup(arg);
+  if (j == NULL)
+    return;
+  if (E.dirty) {
+    editorSetStatusMessage("No write since last change");
+    return;
+  }
+
+  editorCloseFile();
+  free(E.filename);
+  E.filename = NULL;
+  E.syntax = NULL;
+  E.follow.on = 0;
+
+  int n;
+  diskline *lines = editorSplitLines(j->out, j->scan, &n);
+  char **s = malloc(sizeof(char *) * (n+1));
+  int *lens = malloc(sizeof(int) * (n+1));
+  for (int i=0; i<n; i++) {
+    s[i] = lines[i].s;
+    lens[i] = lines[i].len;
+  }
+  editorInsertRows(0, s, lens, n);
+  free(s);
+  free(lens);
+  free(lines);
+  E.dirty = 0;
+  E.cy = E.numrows > 0 ? E.numrows-1 : 0;
+  E.jobs.shown = j - E.jobs.jobs;
+}
+
+void editorJobStop(char *arg) {
+  job *j = jobLookup(arg);
+  if (j == NULL)
+    return;
+  if (j->status != -1)
+    editorSetStatusMessage("job %d already exited", (int)(j - E.jobs.jobs) + 1);
+  else
+    kill(-j->pid, SIGTERM);
+}
+
+/*** diff ***/
 
-  if (E.cy == E.numrows)
-    return 0;
+uint64_t diffKey(erow *row) {
+  char *chars = rowChars(row);
+  uint64_t h = HASH_INIT ^ row->size, w;
+  int i = 0;
 
-  while (i < row->size) {
-    if (row->chars[i] != ' ')
-      return i;
-    i++;
+  for (; i + 8 <= row->size; i += 8) {
+    memcpy(&w, &chars[i], 8);
+    h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
   }
-
-  return 0;
+  w = 0;
+  memcpy(&w, &chars[i], row->size - i);
+  h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+  h ^= h >> 32;
+  return h ? h : 1;
 }
 
-void editorFreeRow(erow *row) {
-  free(row->chars);
-  free(row->hl);
+void *diffHashSlice(void *arg) {
+  diffjob *j = arg;
+
+  for (int i=j->from; i<j->to; i++)
+    j->out[i] = diffKey(&j->rows[i]);
+  return NULL;
 }
 
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows)
-    return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at+1], sizeof(erow) * (E.numrows-at-1));
-  for (int j = at; j < E.numrows-1; j++)
-    E.row[j].idx--;
-  E.numrows--;
-  E.dirty++;
+void diffHashRows(erow *rows, int n, uint64_t *out) {
+  int nthreads = n / DIFF_MIN_SLICE + 1;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > ncpu)
+    nthreads = ncpu > 0 ? ncpu : 1;
+  if (nthreads > DIFF_MAX_THREADS)
+    nthreads = DIFF_MAX_THREADS;
+
+  diffjob jobs[DIFF_MAX_THREADS];
+  for (int t=0; t<nthreads; t++) {
+    jobs[t].rows = rows;
+    jobs[t].out = out;
+    jobs[t].from = (long)n * t / nthreads;
+    jobs[t].to = (long)n * (t+1) / nthreads;
+  }
+  if (nthreads == 1)
+    diffHashSlice(&jobs[0]);
+  else {
+    for (int t=0; t<nthreads; t++)
+      if (pthread_create(&jobs[t].thread, NULL, diffHashSlice, &jobs[t]) != 0)
+        die("pthread_create");
+    for (int t=0; t<nthreads; t++)
+      pthread_join(jobs[t].thread, NULL);
+  }
 }
 
-int editorRowInsertChar(erow *row, int at, int c) {
-  if (at < 0 || at > row->size)
-    at = row->size;
-  row->chars = realloc(row->chars, row->size+2);
-  memmove(&row->chars[at+1], &row->chars[at], row->size-at+1);
-  row->size++;
-  row->chars[at] = c;
-  int inc = editorUpdateRow(row);
-  E.dirty++;
+uint64_t *diffFilter(uint64_t *h, int n, uint64_t *mask) {
+  uint64_t bits = 1024;
+  while (bits < (uint64_t)n * 16)
+    bits *= 2;
+  uint64_t *set = calloc(bits / 64, sizeof(uint64_t));
 
-  return inc;
+  *mask = bits - 1;
+  for (int i=0; i<n; i++)
+    set[(h[i] & *mask) >> 6] |= 1ULL << (h[i] & 63);
+  return set;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size+len+1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+int diffFilterHas(uint64_t *set, uint64_t mask, uint64_t h) {
+  return set[(h & mask) >> 6] >> (h & 63) & 1;
 }
 
-int editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at >= row->size)
-    return 0;
-  
-  int tabCheck(char *ptr, int len);
+void diffSplit(diffctx *c, int xoff, int xlim, int yoff, int ylim, int *px, int *py) {
+  int *fd = c->fd, *bd = c->bd;
+  int dmin = xoff - ylim, dmax = xlim - yoff;
+  int fmid = xoff - yoff, bmid = xlim - ylim;
+  int fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+  int odd = (fmid - bmid) & 1;
 
-  if ((at+1) % TAB_STOP == 0) {
-    int len;
-    if ((len = tabCheck(&row->chars[at], TAB_STOP)) > 1) {
-      memmove(&row->chars[at+1-len], &row->chars[at+1], row->size-at);
-      row->size -= len;
-      editorUpdateRow(row);
-      E.dirty++;
-      return len;
+  fd[fmid] = xoff;
+  bd[bmid] = xlim;
+
+  for (int cost=1;; cost++) {
+    if (fmin > dmin)
+      fd[--fmin - 1] = -1;
+    else
+      ++fmin;
+    if (fmax < dmax)
+      fd[++fmax + 1] = -1;
+    else
+      --fmax;
+    for (int d=fmax; d>=fmin; d-=2) {
+      int x = fd[d-1] >= fd[d+1] ? fd[d-1] + 1 : fd[d+1];
+      int y = x - d;
+      while (x < xlim && y < ylim && c->a[x] == c->b[y])
+        x++, y++;
+      fd[d] = x;
+      if (odd && bmin <= d && d <= bmax && bd[d] <= x) {
+        *px = x;
+        *py = y;
+        return;
+      }
+    }
+
+    if (bmin > dmin)
+      bd[--bmin - 1] = INT_MAX;
+    else
+      ++bmin;
+    if (bmax < dmax)
+      bd[++bmax + 1] = INT_MAX;
+    else
+      --bmax;
+    for (int d=bmax; d>=bmin; d-=2) {
+      int x = bd[d-1] < bd[d+1] ? bd[d-1] : bd[d+1] - 1;
+      int y = x - d;
+      while (x > xoff && y > yoff && c->a[x-1] == c->b[y-1])
+        x--, y--;
+      bd[d] = x;
+      if (!odd && fmin <= d && d <= fmax && x <= fd[d]) {
+        *px = x;
+        *py = y;
+        return;
+      }
     }
+
+    if (cost < c->cap)
+      continue;
+
+    int fbest = -1, fx = xoff, bbest = INT_MAX, bx = xlim;
+    for (int d=fmax; d>=fmin; d-=2) {
+      int x = fd[d] < xlim ? fd[d] : xlim;
+      int y = x - d;
+      if (y > ylim)
+        x = ylim + d, y = ylim;
+      if (x + y > fbest)
+        fbest = x + y, fx = x;
+    }
+    for (int d=bmax; d>=bmin; d-=2) {
+      int x = bd[d] > xoff ? bd[d] : xoff;
+      int y = x - d;
+      if (y < yoff)
+        x = yoff + d, y = yoff;
+      if (x + y < bbest)
+        bbest = x + y, bx = x;
+    }
+    if ((xlim + ylim) - bbest < fbest - (xoff + yoff)) {
+      *px = fx;
+      *py = fbest - fx;
+    } else {
+      *px = bx;
+      *py = bbest - bx;
+    }
+    return;
   }
-  memmove(&row->chars[at], &row->chars[at+1], row->size-at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
-  
-  return 1;
 }
 
-/*** helpers ***/
+void diffCompare(diffctx *c, int xoff, int xlim, int yoff, int ylim) {
+  while (xoff < xlim && yoff < ylim && c->a[xoff] == c->b[yoff])
+    xoff++, yoff++;
+  while (xlim > xoff && ylim > yoff && c->a[xlim-1] == c->b[ylim-1])
+    xlim--, ylim--;
 
-int tabCheck(char *ptr, int len) {
-  int i = 0, count = 0;
+  if (xoff == xlim)
+    memset(&c->cb[yoff], 1, ylim - yoff);
+  else if (yoff == ylim)
+    memset(&c->ca[xoff], 1, xlim - xoff);
+  else {
+    int x, y;
+    diffSplit(c, xoff, xlim, yoff, ylim, &x, &y);
+    diffCompare(c, xoff, x, yoff, y);
+    diffCompare(c, x, xlim, y, ylim);
+  }
+}
 
-  while (len-- > 0) {
-    if (ptr[i--] != ' ')
-      return count;
-    else
-      count++;
+void diffRun(uint64_t *a, int n, uint64_t *b, int m, char *ca, char *cb) {
+  uint64_t amask, bmask;
+  uint64_t *aset = diffFilter(a, n, &amask);
+  uint64_t *bset = diffFilter(b, m, &bmask);
+
+  diffctx c;
+  int *ia = malloc(sizeof(int) * (n + 1)), *ib = malloc(sizeof(int) * (m + 1));
+  int kn = 0, km = 0;
+  c.a = malloc(sizeof(uint64_t) * (n + 1));
+  c.b = malloc(sizeof(uint64_t) * (m + 1));
+  for (int i=0; i<n; i++) {
+    ca[i] = !diffFilterHas(bset, bmask, a[i]);
+    if (!ca[i]) {
+      ia[kn] = i;
+      c.a[kn++] = a[i];
+    }
   }
+  for (int j=0; j<m; j++) {
+    cb[j] = !diffFilterHas(aset, amask, b[j]);
+    if (!cb[j]) {
+      ib[km] = j;
+      c.b[km++] = b[j];
+    }
+  }
+  free(aset);
+  free(bset);
+
+  c.ca = calloc(kn + 1, 1);
+  c.cb = calloc(km + 1, 1);
+  int *v = malloc(sizeof(int) * 2 * (kn + km + 3));
+  c.fd = v + km + 1;
+  c.bd = v + (kn + km + 3) + km + 1;
+  c.cap = DIFF_MIN_COST;
+  while ((long)c.cap * c.cap < (long)kn + km)
+    c.cap *= 2;
+  diffCompare(&c, 0, kn, 0, km);
+
+  for (int i=0; i<kn; i++)
+    ca[ia[i]] = c.ca[i];
+  for (int j=0; j<km; j++)
+    cb[ib[j]] = c.cb[j];
+  free(v);
+  free(c.a);
+  free(c.b);
+  free(c.ca);
+  free(c.cb);
+  free(ia);
+  free(ib);
+}
 
-  return count;
+void diffPad(void) {
+  diffview *D = &E.diff;
+
+  D->pad = realloc(D->pad, sizeof(int) * (D->nhunks + 1));
+  D->pad[0] = 0;
+  for (int i=0; i<D->nhunks; i++) {
+    diffhunk *h = &D->hunks[i];
+    D->pad[i+1] = D->pad[i] + (h->nb > h->na ? h->nb - h->na : 0);
+  }
 }
 
-/*** editor operations***/
+void diffWindow(int i, int j, int a0, int a1, int b0, int b1) {
+  diffview *D = &E.diff;
+  int n = a1 - a0, m = b1 - b0;
+
+  uint64_t *a = malloc(sizeof(uint64_t) * (n + 1));
+  diffHashRows(&E.row[a0], n, a);
+  char *ca = malloc(n + 1), *cb = malloc(m + 1);
+  diffRun(a, n, &D->hash[b0], m, ca, cb);
+  free(a);
+
+  int cap = 16, nh = 0;
+  diffhunk *hunks = malloc(sizeof(diffhunk) * cap);
+  int x = 0, y = 0;
+  while (x < n || y < m) {
+    if (x < n && y < m && !ca[x] && !cb[y]) {
+      x++, y++;
+      continue;
+    }
+    diffhunk h = { a0 + x, 0, b0 + y, 0 };
+    while (x < n && ca[x])
+      x++, h.na++;
+    while (y < m && cb[y])
+      y++, h.nb++;
+    if (nh == cap) {
+      cap *= 2;
+      hunks = realloc(hunks, sizeof(diffhunk) * cap);
+    }
+    hunks[nh++] = h;
+  }
+  free(ca);
+  free(cb);
 
-void editorInsertChar(int c) {
-  if (E.cy == E.numrows)
-    editorInsertRow(E.numrows, "", 0);
-  int inc = editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx += inc;
+  int total = D->nhunks - (j - i) + nh;
+  if (total > D->cap) {
+    D->cap = total;
+    D->hunks = realloc(D->hunks, sizeof(diffhunk) * D->cap);
+  }
+  memmove(&D->hunks[i + nh], &D->hunks[j], sizeof(diffhunk) * (D->nhunks - j));
+  memcpy(&D->hunks[i], hunks, sizeof(diffhunk) * nh);
+  D->nhunks = total;
+  free(hunks);
+  diffPad();
 }
 
-void editorInsertNewline(void) {
-  if (E.cx == 0)
-    editorInsertRow(E.cy, "", 0);
-  else {
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy+1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+void editorDiffUpdate(void) {
+  diffview *D = &E.diff;
+  diffhunk *h = D->hunks;
+  int lo = D->lo, hi = D->hi < E.numrows ? D->hi : E.numrows;
+
+  D->dirty = 0;
+  int i = 0, j;
+  while (i < D->nhunks && h[i].a + h[i].na < lo)
+    i++;
+  for (j=i; j<D->nhunks && h[j].a <= hi; j++)
+    ;
+
+  int a0 = lo, a1 = hi;
+  if (i < j) {
+    if (h[i].a < a0)
+      a0 = h[i].a;
+    if (h[j-1].a + h[j-1].na > a1)
+      a1 = h[j-1].a + h[j-1].na;
   }
-  E.cy++;
-  E.cx = 0;
+  int b0 = i > 0 ? a0 - (h[i-1].a + h[i-1].na) + h[i-1].b + h[i-1].nb : a0;
+  int b1 = j < D->nhunks ? h[j].b - (h[j].a - a1) : D->nrows - (E.numrows - a1);
+  if (b0 < 0)
+    b0 = 0;
+  if (b1 > D->nrows)
+    b1 = D->nrows;
+  if (b1 < b0)
+    b1 = b0;
+  diffWindow(i, j, a0, a1, b0, b1);
 }
 
-void editorDelChar(void) {
-  if (E.cy == E.numrows)
-    return;
-  if (E.cx == 0 && E.cy == 0)
+void editorDiffTouch(int op, int at, int n) {
+  diffview *D = &E.diff;
+
+  if (!D->on)
     return;
 
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    int dec = editorRowDelChar(row, E.cx-1);
-    E.cx -= dec;
-  } else {
-    E.cx = E.row[E.cy-1].size;
-    editorRowAppendString(&E.row[E.cy-1], row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
+  if (op == J_INSERT_ROW || op == J_DEL_ROWS) {
+    for (int i=0; i<D->nhunks; i++) {
+      diffhunk *h = &D->hunks[i];
+      int s = h->a, e = h->a + h->na;
+      if (op == J_INSERT_ROW) {
+        if (e > at || s >= at)
+          e += n;
+        if (s >= at)
+          s += n;
+      } else {
+        s = s < at ? s : s < at+n ? at : s-n;
+        e = e < at ? e : e < at+n ? at : e-n;
+      }
+      h->a = s;
+      h->na = e - s;
+    }
+  }
+
+  int lo = at, hi = op == J_DEL_ROWS ? at : at + n;
+  if (D->dirty) {
+    if (op == J_INSERT_ROW && D->hi > at)
+      D->hi += n;
+    else if (op == J_DEL_ROWS && D->hi > at)
+      D->hi = D->hi < at+n ? at : D->hi - n;
+    if (op == J_DEL_ROWS && D->lo > at)
+      D->lo = D->lo < at+n ? at : D->lo - n;
+    if (D->lo < lo)
+      lo = D->lo;
+    if (D->hi > hi)
+      hi = D->hi;
   }
+  D->lo = lo;
+  D->hi = hi;
+  D->dirty = 1;
 }
 
-/*** file i/o ***/
+int editorDiffLine(int row) {
+  diffview *D = &E.diff;
+  int lo = 0, hi = D->nhunks;
 
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  
-  for (int j=0; j<E.numrows; j++)
-    totlen += E.row[j].size + 1;
-  *buflen = totlen;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (D->hunks[mid].a + D->hunks[mid].na <= row)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return row + D->pad[lo];
+}
 
-  char *buf = malloc(totlen);
-  char *p = buf;
-  
-  for (int j=0; j<E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+int editorDiffLocate(int line, int *a, int *b) {
+  diffview *D = &E.diff;
+  int lo = 0, hi = D->nhunks;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (D->hunks[mid].a + D->pad[mid] <= line)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
-  
-  return buf;
+
+  int cls = HL_NORMAL;
+  if (lo == 0) {
+    *a = *b = line;
+  } else {
+    diffhunk *h = &D->hunks[lo-1];
+    int off = line - (h->a + D->pad[lo-1]);
+    int span = h->na > h->nb ? h->na : h->nb;
+    if (off < span) {
+      *a = off < h->na ? h->a + off : -1;
+      *b = off < h->nb ? h->b + off : -1;
+      cls = *a == -1 ? HL_DIFF_ADD : *b == -1 ? HL_DIFF_DEL : HL_DIFF_CHG;
+    } else {
+      *a = h->a + h->na + off - span;
+      *b = h->b + h->nb + off - span;
+    }
+  }
+  if (*a >= E.numrows)
+    *a = -1;
+  if (*b >= D->nrows)
+    *b = -1;
+  return cls;
 }
 
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
+void editorDiffClose(void) {
+  diffview *D = &E.diff;
+
+  for (int i=0; i<D->nrows; i++)
+    textRelease(D->rows[i].chars);
+  free(D->rows);
+  free(D->hash);
+  free(D->hunks);
+  free(D->pad);
+  free(D->filename);
+  memset(D, 0, sizeof(*D));
+}
 
-  editorSelectSyntaxHighlight();
+void editorDiffOpen(char *filename) {
+  diffview *D = &E.diff;
 
   FILE *fp = fopen(filename, "r");
   if (!fp)
@@ -875,136 +8238,277 @@ void editorOpen(char *filename) {
   char *line = NULL;
   size_t linecap = 0;
   ssize_t linelen;
+  int cap = 0;
 
-  while ((linelen = getline(&line, &linecap , fp)) != -1) {
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
     while (linelen > 0 && (line[linelen-1] == '\n' ||
           line[linelen-1] == '\r'))
       linelen--;
-    editorInsertRow(E.numrows, line, linelen);
+    if (D->nrows == cap) {
+      cap = cap ? cap * 2 : 1024;
+      D->rows = realloc(D->rows, sizeof(erow) * cap);
+    }
+    erow *row = &D->rows[D->nrows++];
+    memset(row, 0, sizeof(*row));
+    row->size = linelen;
+    row->chars = textAlloc(linelen);
+    memcpy(row->chars, line, linelen);
+    row->chars[linelen] = '\0';
+    editorExpandTabs(row);
   }
   free(line);
   fclose(fp);
-  E.dirty = 0;
+
+  D->hash = malloc(sizeof(uint64_t) * (D->nrows + 1));
+  diffHashRows(D->rows, D->nrows, D->hash);
+  D->filename = strdup(filename);
+  D->on = 1;
+  diffWindow(0, 0, 0, E.numrows, 0, D->nrows);
+  editorSetStatusMessage("%d hunk%s", D->nhunks, D->nhunks == 1 ? "" : "s");
 }
 
-void editorSave(void) {
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as: %s", NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
+/*** server ***/
+
+void editorSocketAddr(struct sockaddr_un *addr) {
+  char *dir = getenv("XDG_RUNTIME_DIR");
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (dir && *dir)
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/vin.sock", dir);
+  else
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "/tmp/vin-%d.sock", (int)getuid());
+}
+
+void editorServerDetach(void) {
+  int null = open("/dev/null", O_RDWR);
+  dup2(null, STDIN_FILENO);
+  dup2(null, STDOUT_FILENO);
+  close(null);
+}
+
+int editorServerAccept(void) {
+  int fd = accept4(E.server_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd == -1)
+    return -1;
+
+  char buf[PATH_MAX + 64];
+  size_t len = 0;
+  while (len < sizeof(buf)-1) {
+    struct pollfd p = { fd, POLLIN, 0 };
+    if (poll(&p, 1, 1000) <= 0 || read(fd, &buf[len], 1) != 1) {
+      close(fd);
+      return -1;
     }
-    editorSelectSyntaxHighlight();
+    if (buf[len++] == '\n')
+      break;
   }
+  buf[len-1] = '\0';
 
-  int len;
-  char *buf = editorRowsToString(&len);
+  int rows, cols, off;
+  if (sscanf(buf, "VIN1 %d %d %n", &rows, &cols, &off) != 2 || rows < 3 || cols < 1) {
+    close(fd);
+    return -1;
+  }
 
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("\"%s\" %dL, %dB written", E.filename, E.numrows, len);
-        return;
-      }
+  dup2(fd, STDIN_FILENO);
+  dup2(fd, STDOUT_FILENO);
+  close(fd);
+  E.screenrows = rows - 2;
+  E.screencols = cols;
+  if (buf[off])
+    editorEdit(&buf[off]);
+  editorRefreshScreen();
+  return 0;
+}
+
+void editorServerControl(void) {
+  char buf[32];
+  int len = 0;
+
+  while (len < (int)sizeof(buf)-1) {
+    struct pollfd p = { STDIN_FILENO, POLLIN, 0 };
+    if (poll(&p, 1, 1000) <= 0 || read(STDIN_FILENO, &buf[len], 1) != 1)
+      return;
+    if (len == 0 && buf[0] == '\0') {
+      E.macro.held = 1;
+      E.macro.hold = '\0';
+      return;
     }
-    close(fd);
+    if (buf[len++] == '\n')
+      break;
   }
+  buf[len] = '\0';
 
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  int rows, cols;
+  if (sscanf(buf, "W%d %d", &rows, &cols) == 2 && rows >= 3 && cols >= 1) {
+    E.screenrows = rows - 2;
+    E.screencols = cols;
+    editorRefreshScreen();
+  }
 }
 
-/*** match operations ***/
+void editorServerStop(int force) {
+  if (!E.server) {
+    editorSetStatusMessage("Not running as a server");
+    return;
+  }
+  if (E.dirty && !force) {
+    editorSetStatusMessage("Unsaved changes (use :stopserver! to discard)");
+    return;
+  }
 
-void insertMatch(int cx, int cy, int rowoff) {
-  E.match_cache = realloc(E.match_cache, sizeof(match) * (E.num_matches+1));
+  struct sockaddr_un addr;
+  editorSocketAddr(&addr);
+  unlink(addr.sun_path);
+  close(E.server_fd);
+  editorJournalClose();
+  write(STDOUT_FILENO, "\x1b[2J", 4);
+  write(STDOUT_FILENO, "\x1b[H", 3);
+  exit(0);
+}
 
-  int at = E.num_matches;
-  E.match_cache[at].cx = cx;
-  E.match_cache[at].cy = cy;
-  E.match_cache[at].rowoff = rowoff;
+void editorServerAttach(void) {
+  editorServerDetach();
 
-  E.num_matches++;
+  while (1) {
+    struct pollfd p = { E.server_fd, POLLIN, 0 };
+    if (poll(&p, 1, 100) > 0 && editorServerAccept() == 0)
+      return;
+    editorPollEvents();
+  }
 }
 
-/*** find ***/
+void editorServerStart(char *file) {
+  struct sockaddr_un addr;
+  editorSocketAddr(&addr);
 
-void editorGoToCurrMatch(void) {
-  match curr_match = E.match_cache[E.match_index];
+  if (file && access(file, R_OK) == -1) {
+    perror(file);
+    exit(1);
+  }
 
-  E.cx = curr_match.cx;
-  E.cy = curr_match.cy;
-  E.rowoff = curr_match.rowoff;
-}
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    die("socket");
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "vin: a server is already running on %s\n", addr.sun_path);
+    exit(1);
+  }
+  close(fd);
+
+  unlink(addr.sun_path);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  mode_t mask = umask(077);
+  if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, 4) == -1)
+    die("bind");
+  umask(mask);
+
+  pid_t pid = fork();
+  if (pid == -1)
+    die("fork");
+  if (pid > 0) {
+    printf("vin: serving on %s\n", addr.sun_path);
+    exit(0);
+  }
 
-void editorGoToNextMatch(void) {
-  E.dirsearch ? E.match_index++ : E.match_index--;
-  if (E.match_index == E.num_matches)
-    E.match_index = 0;
-  if (E.match_index == -1)
-    E.match_index = E.num_matches-1;
-  editorGoToCurrMatch();
-}
+  setsid();
+  editorServerDetach();
+  int null = open("/dev/null", O_WRONLY);
+  dup2(null, STDERR_FILENO);
+  close(null);
+  signal(SIGPIPE, SIG_IGN);
 
-void editorGoToPrevMatch(void) {
-  E.dirsearch ? E.match_index-- : E.match_index++;
-  if (E.match_index == E.num_matches)
-    E.match_index = 0;
-  if (E.match_index == -1)
-    E.match_index = E.num_matches-1;
-  editorGoToCurrMatch();
+  E.server = 1;
+  E.server_fd = fd;
 }
 
-void editorFindCallback(char *query, int key) {
-  if (key == RETURN_CLI)
-    return;
+volatile sig_atomic_t remote_resized;
 
-  restoreRowHighlighting();
-  free(E.match_cache);
-  E.match_cache = NULL;
-  E.num_matches = 0;
-  E.match_index = 0;
+void remoteResize(int sig) {
+  (void)sig;
+  remote_resized = 1;
+}
 
-  if (key == CANCEL_CLI)
-    return;
+void editorRemote(char *file) {
+  struct sockaddr_un addr;
+  editorSocketAddr(&addr);
 
-  for (int i=0; i<E.numrows; i++) {
-    erow *row = &E.row[i];
-    char *match = strstr(row->chars, query);
-    if (match) {
-      if (i<=E.cy)
-        E.match_index = E.num_matches;
-      saveRowHighlighting(i, row->hl);
-      memset(&row->hl[match-row->chars], HL_MATCH, strlen(query));
-      insertMatch(match-row->chars, i, E.numrows);
-    }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    fprintf(stderr, "vin: no server on %s: %s\n", addr.sun_path, strerror(errno));
+    exit(1);
   }
 
-  if (E.num_matches > 0)
-    editorGoToCurrMatch();
-}
+  char *path = NULL;
+  if (file && file[0] != '/') {
+    char *cwd = getcwd(NULL, 0);
+    path = malloc(strlen(cwd) + strlen(file) + 2);
+    sprintf(path, "%s/%s", cwd, file);
+    free(cwd);
+  } else if (file)
+    path = strdup(file);
 
-void editorFind(int fwd) {
-  int saved_cx = E.cx;
-  int saved_cy = E.cy;
-  int saved_coloff = E.coloff;
-  int saved_rowoff = E.rowoff;
+  enableRawMode();
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == -1)
+    die("getWindowSize");
+  dprintf(fd, "VIN1 %d %d %s\n", rows, cols, path ? path : "");
+  free(path);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = remoteResize;
+  sigaction(SIGWINCH, &sa, NULL);
+
+  char buf[65536], keys[2 * sizeof(buf)];
+  while (1) {
+    struct pollfd p[2] = { { STDIN_FILENO, POLLIN, 0 }, { fd, POLLIN, 0 } };
+    if (poll(p, 2, -1) == -1) {
+      if (errno != EINTR)
+        die("poll");
+      p[0].revents = p[1].revents = 0;
+    }
 
-  E.dirsearch = fwd;
-  char *query = editorPrompt(E.dirsearch ? "/%s" : "?%s", editorFindCallback);
+    if (remote_resized) {
+      remote_resized = 0;
+      if (getWindowSize(&rows, &cols) == 0) {
+        keys[0] = '\0';
+        int len = 1 + snprintf(&keys[1], sizeof(keys)-1, "W%d %d\n", rows, cols);
+        if (write(fd, keys, len) != len)
+          break;
+      }
+    }
 
-  if (query)
-    free(query);
-  else {
-    E.cx = saved_cx;
-    E.cy = saved_cy;
-    E.coloff = saved_coloff;
-    E.rowoff = saved_rowoff;
+    ssize_t n;
+    if (p[0].revents & POLLIN) {
+      n = read(STDIN_FILENO, buf, sizeof(buf));
+      ssize_t len = 0;
+      for (ssize_t i = 0; i < n; i++) {
+        if (buf[i] == '\0')
+          keys[len++] = '\0';
+        keys[len++] = buf[i];
+      }
+      if (len > 0 && write(fd, keys, len) != len)
+        break;
+    }
+    if (p[1].revents & (POLLIN | POLLHUP)) {
+      n = read(fd, buf, sizeof(buf));
+      if (n <= 0)
+        break;
+      for (ssize_t off = 0; off < n; ) {
+        ssize_t w = write(STDOUT_FILENO, buf + off, n - off);
+        if (w <= 0)
+          die("write");
+        off += w;
+      }
+    }
   }
+
+  write(STDOUT_FILENO, "\x1b[2J", 4);
+  write(STDOUT_FILENO, "\x1b[H", 3);
+  exit(0);
 }
 
 /*** append buffer ***/
@@ -1043,7 +8547,8 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
   while (1) {
     editorSetStatusMessage(prompt, buf);
-    editorRefreshScreen();
+    if (editorFrameDue())
+      editorRefreshScreen();
 
     int c = editorReadKey();
     if (c == BS_CLI) {
@@ -1079,25 +8584,23 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
   }
 }
 
-void editorMoveCursor(int key) {
+void editorMoveCursor(int key, int times) {
   erow *row = CURR_ROW;
 
   switch (key) {
     case LEFT:
-      if (E.cx != 0)
-        E.cx--;
+      E.cx = E.cx > times ? E.cx - times : 0;
       break;
     case RIGHT:
       if (row && E.cx < row->size-1)
-        E.cx++;
+        E.cx = row->size-1 - E.cx > times ? E.cx + times : row->size-1;
       break;
     case UP:
-      if (E.cy != 0)
-        E.cy--;
+      E.cy = E.cy > times ? E.cy - times : 0;
       break;
     case DOWN:
       if (E.cy < E.numrows-1)
-        E.cy++;
+        E.cy = E.numrows-1 - E.cy > times ? E.cy + times : E.numrows-1;
       break;
   }
 
@@ -1114,11 +8617,208 @@ void editorGoToFirstChar(void) {
   E.cx = editorGetFirstCharIdx(row);
 }
 
+void editorGoToLine(int line) {
+  if (E.hex.on) {
+    editorHexMove((long long)(line > 0 ? line-1 : 0) * HEX_COLS - (long long)E.hex.cur);
+    return;
+  }
+  if (E.numrows == 0)
+    return;
+  if (line < 1)
+    line = 1;
+  if (line > E.numrows)
+    line = E.numrows;
+
+  E.cy = line-1;
+  editorGoToFirstChar();
+}
+
+int wordClassAt(int cy, int cx) {
+  erow *row = &E.row[cy];
+  return cx < row->size ? char_class[(unsigned char) rowChars(row)[cx]] : CC_BLANK;
+}
+
+void editorWordForward(void) {
+  erow *row = &E.row[E.cy];
+  int cls = wordClassAt(E.cy, E.cx);
+
+  if (cls != CC_BLANK)
+    E.cx = scanClass(rowChars(row), E.cx, row->size, cls);
+  E.cx = scanClass(rowChars(row), E.cx, row->size, CC_BLANK);
+
+  while (E.cx >= row->size) {
+    if (E.cy == E.numrows-1) {
+      E.cx = row->size > 0 ? row->size-1 : 0;
+      return;
+    }
+    row = &E.row[++E.cy];
+    E.cx = 0;
+    if (row->size == 0)
+      return;
+    E.cx = scanClass(rowChars(row), 0, row->size, CC_BLANK);
+  }
+}
+
+void editorWordEnd(void) {
+  erow *row = &E.row[E.cy];
+
+  E.cx++;
+  E.cx = scanClass(rowChars(row), E.cx, row->size, CC_BLANK);
+  while (E.cx >= row->size) {
+    if (E.cy == E.numrows-1) {
+      E.cx = row->size > 0 ? row->size-1 : 0;
+      return;
+    }
+    row = &E.row[++E.cy];
+    E.cx = scanClass(rowChars(row), 0, row->size, CC_BLANK);
+  }
+
+  E.cx = scanClass(rowChars(row), E.cx, row->size, wordClassAt(E.cy, E.cx)) - 1;
+}
+
+void editorParagraphForward(void) {
+  int y = E.cy;
+
+  while (y < E.numrows && E.row[y].size == 0)
+    y++;
+  while (y < E.numrows && E.row[y].size != 0)
+    y++;
+
+  if (y >= E.numrows) {
+    E.cy = E.numrows-1;
+    E.cx = E.row[E.cy].size > 0 ? E.row[E.cy].size-1 : 0;
+  } else {
+    E.cy = y;
+    E.cx = 0;
+  }
+}
+
+void editorParagraphBackward(void) {
+  int y = E.cy;
+
+  while (y >= 0 && E.row[y].size == 0)
+    y--;
+  while (y >= 0 && E.row[y].size != 0)
+    y--;
+
+  E.cy = y < 0 ? 0 : y;
+  E.cx = 0;
+}
+
+void editorWordBackward(void) {
+  erow *row = &E.row[E.cy];
+
+  E.cx = scanClassBack(rowChars(row), E.cx-1, CC_BLANK);
+  while (E.cx < 0) {
+    if (E.cy == 0) {
+      E.cx = 0;
+      return;
+    }
+    row = &E.row[--E.cy];
+    if (row->size == 0) {
+      E.cx = 0;
+      return;
+    }
+    E.cx = scanClassBack(rowChars(row), row->size-1, CC_BLANK);
+  }
+
+  E.cx = scanClassBack(rowChars(row), E.cx, wordClassAt(E.cy, E.cx)) + 1;
+}
+
+
+void editorApplyOperator(int motion, int times) {
+  int sy = E.cy, sx = E.cx;
+  int linewise = 0, inclusive = 0;
+
+  E.op = 0;
+  if (E.numrows == 0 || E.cy >= E.numrows)
+    return;
+
+  switch (motion) {
+    case DELETE_LINES:
+      {
+        int last = E.cy + times - 1;
+        if (last >= E.numrows)
+          last = E.numrows - 1;
+        editorDeleteRange(1, E.cy, 0, last, 0);
+      }
+      return;
+    case RIGHT:
+      {
+        int ex = sx + times;
+        if (ex > E.row[sy].size)
+          ex = E.row[sy].size;
+        editorDeleteRange(0, sy, sx, sy, ex);
+      }
+      return;
+    case UP: case DOWN: case GOTO_TOP: case GOTO_BOT:
+    case MV_UP: case MV_DOWN: case PARA_FWD: case PARA_BWD:
+      linewise = 1;
+      break;
+    case WORD_END: case END_LINE: case MATCH_PAIR:
+      inclusive = 1;
+      break;
+    case LEFT: case WORD_FWD: case WORD_BWD: case FULL_LEFT: case START_LINE:
+      break;
+    default:
+      return;
+  }
+
+  editorProcessKeypress(motion);
+  int ey = E.cy, ex = E.cx;
+
+  if (motion == WORD_FWD && (ey > sy || ex <= sx)) {
+    ey = sy;
+    ex = E.row[sy].size;
+  }
+
+  if (ey < sy || (ey == sy && ex < sx)) {
+    int ty = sy, tx = sx;
+    sy = ey; sx = ex;
+    ey = ty; ex = tx;
+  }
+  if (inclusive && ex < E.row[ey].size)
+    ex++;
+
+  if (linewise) {
+    if (motion == PARA_FWD && ey > sy && E.row[ey].size == 0)
+      ey--;
+    if (motion == PARA_BWD && ey > sy && E.row[sy].size == 0)
+      sy++;
+    editorDeleteRange(1, sy, 0, ey, 0);
+  } else {
+    editorDeleteRange(0, sy, sx, ey, ex);
+  }
+}
+
+int pageRows(int rows, int times) {
+  long long n = (long long) rows * times;
+  return n > E.numrows ? E.numrows : n;
+}
 
 void editorProcessKeypress(int action) {
   static int quit_times = QUIT_TIMES;
 
   int c = action ? action : editorReadKey();
+  int times = E.count ? E.count : 1;
+
+  if (E.compl.active && c != COMPLETE_NEXT && c != COMPLETE_PREV)
+    editorCompleteReset();
+
+  if (E.hex.on && editorHexKeypress(c, times)) {
+    if (c != BREAK) {
+      E.count = 0;
+      E.regname = 0;
+    }
+    return;
+  }
+
+  if (E.op && c != BREAK && c != OP_DELETE) {
+    editorApplyOperator(c, times);
+    E.count = 0;
+    E.regname = 0;
+    return;
+  }
 
   switch (c) {
     case BREAK:
@@ -1126,10 +8826,17 @@ void editorProcessKeypress(int action) {
       break;
 
     case QUIT:
+      if (E.server) {
+        write(STDOUT_FILENO, "\x1b[2J", 4);
+        write(STDOUT_FILENO, "\x1b[H", 3);
+        editorServerDetach();
+        break;
+      }
       if (E.dirty && quit_times > 0) {
         editorSetStatusMessage("Warning, unsaved changes. Quit %d more times to exit.", quit_times--);
         return;
       }
+      editorJournalClose();
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[H", 3);
       exit(0);
@@ -1144,6 +8851,12 @@ void editorProcessKeypress(int action) {
       break;
 
     case DEL_CHAR:
+      if (E.cy < E.numrows && E.row[E.cy].size - E.cx < times)
+        times = E.row[E.cy].size - E.cx;
+      while (times-- > 1) {
+        E.cx++;
+        editorDelChar();
+      }
       E.cx++;
     case BACKSPACE:
       editorDelChar();
@@ -1152,7 +8865,23 @@ void editorProcessKeypress(int action) {
       break;
 
     case LEFT: case DOWN: case UP: case RIGHT:
-      editorMoveCursor(c);
+      editorMoveCursor(c, times);
+      break;
+
+    case WORD_FWD: case WORD_END: case WORD_BWD:
+      if (E.cy >= E.numrows)
+        break;
+      while (times--) {
+        int cy = E.cy, cx = E.cx;
+        if (c == WORD_FWD)
+          editorWordForward();
+        else if (c == WORD_END)
+          editorWordEnd();
+        else
+          editorWordBackward();
+        if (E.cy == cy && E.cx == cx)
+          break;
+      }
       break;
 
     case START_LINE:
@@ -1171,24 +8900,125 @@ void editorProcessKeypress(int action) {
       break;
 
     case GOTO_TOP:
+      if (E.count) {
+        editorGoToLine(E.count);
+        break;
+      }
       E.cx = 0;
       E.cy = 0;
       E.rowoff = 0;
       break;
     case GOTO_BOT:
+      if (E.count) {
+        editorGoToLine(E.count);
+        break;
+      }
       E.cy = E.numrows-1;
       E.cx = E.row[E.cy].size-1;
       break;
 
-    case MV_UP: case MV_DOWN:
+    case VISUAL_CHARS: case VISUAL_LINES:
+      {
+        int vmode = (c == VISUAL_CHARS) ? 'v' : 'V';
+        if (E.numrows == 0 || (E.mode == VISUAL && E.vmode == vmode)) {
+          E.mode = NORMAL;
+          break;
+        }
+        if (E.mode != VISUAL) {
+          E.vx = E.cx;
+          E.vy = E.cy;
+        }
+        E.mode = VISUAL;
+        E.vmode = vmode;
+      }
+      break;
+
+    case YANK:
+      editorYankSelection();
+      E.mode = NORMAL;
+      break;
+    case DELETE_SEL:
+      editorDeleteSelection();
+      E.mode = NORMAL;
+      break;
+    case YANK_LINES:
+      if (E.cy < E.numrows) {
+        int last = E.cy + times - 1;
+        if (last >= E.numrows)
+          last = E.numrows - 1;
+        editorYank(REG_LINES, E.cy, 0, last, 0);
+        if (last > E.cy)
+          editorSetStatusMessage("%d lines yanked", last - E.cy + 1);
+      }
+      break;
+    case PASTE_AFTER: case PASTE_BEFORE:
+      editorPaste(c == PASTE_AFTER, times);
+      break;
+
+    case OP_DELETE:
+      E.op = 'd';
+      break;
+
+    case FIND_FILE:
+      editorFindFile();
+      break;
+
+    case GOTO_DEF:
+      editorGoToDefinition(NULL);
+      break;
+
+    case RECORD_MACRO:
+      editorMacroToggle(E.regname);
+      break;
+    case PLAY_MACRO:
+      editorMacroPlay(E.regname, times);
+      break;
+
+    case COMPLETE_NEXT: case COMPLETE_PREV:
+      editorComplete(c == COMPLETE_NEXT ? 1 : -1);
+      break;
+
+    case QF_NEXT: case QF_PREV:
+      editorQuickfixStep(c == QF_NEXT ? times : -times);
+      break;
+
+    case PARA_FWD: case PARA_BWD:
+      if (E.cy >= E.numrows)
+        break;
+      while (times--) {
+        int cy = E.cy;
+        c == PARA_FWD ? editorParagraphForward() : editorParagraphBackward();
+        if (E.cy == cy)
+          break;
+      }
+      break;
+
+    case MATCH_PAIR:
+      editorMatchPair();
+      break;
+    case BLOCK_START: case BLOCK_END:
+      editorBlockEdge(c == BLOCK_END, c == BLOCK_END ? '}' : '{', times);
+      break;
+
+    case EX_CMD:
       {
-        int times = E.screenrows/2;
-        while (times--)
-          editorMoveCursor(c == MV_UP ? UP : DOWN);
+        char *cmd = editorPrompt(":%s", NULL);
+        if (cmd) {
+          editorExCommand(cmd);
+          free(cmd);
+        }
       }
       break;
 
+    case MV_UP: case MV_DOWN:
+      editorMoveCursor(c == MV_UP ? UP : DOWN, pageRows(E.screenrows/2, times));
+      break;
+
     case PG_UP: case PG_DOWN:
+      if (E.wrap.on) {
+        editorWrapPage(c == PG_UP ? -1 : 1, times);
+        break;
+      }
       {
         if (c == PG_UP)
           E.cy = E.rowoff;
@@ -1198,9 +9028,7 @@ void editorProcessKeypress(int action) {
             E.cy = E.numrows;
         }
 
-        int times = E.screenrows;
-        while (times--)
-          editorMoveCursor(c == PG_UP ? UP : DOWN);
+        editorMoveCursor(c == PG_UP ? UP : DOWN, pageRows(E.screenrows, times));
       }
       break;
 
@@ -1223,11 +9051,7 @@ void editorProcessKeypress(int action) {
       break;
 
     case CLR_MATCHES:
-      restoreRowHighlighting();
-      free(E.match_cache);
-      E.match_cache = NULL;
-      E.num_matches = 0;
-      E.match_index = 0;
+      editorClearMatches();
       break;
 
     default:
@@ -1236,12 +9060,145 @@ void editorProcessKeypress(int action) {
       break;
   }
 
+  if (c != BREAK && c != OP_DELETE) {
+    E.count = 0;
+    E.regname = 0;
+  }
   quit_times = action ? quit_times : QUIT_TIMES;
 }
 
 /*** output***/
 
+void editorDrawFinderRow(struct abuf *ab, int fy) {
+  char buf[256];
+  int len;
+
+  pthread_mutex_lock(&E.finder.lock);
+  if (fy == E.finder.ntop) {
+    len = snprintf(buf, sizeof(buf), "  %d/%d%s", E.finder.nhits, E.finder.nfiles,
+                   E.finder.walk ? " (indexing)" : "");
+  } else {
+    len = snprintf(buf, sizeof(buf), "%s %s", fy == E.finder.sel ? ">" : " ",
+                   E.finder.files[E.finder.top[fy]].path);
+  }
+  pthread_mutex_unlock(&E.finder.lock);
+
+  if (len > E.screencols)
+    len = E.screencols;
+  if (fy == E.finder.sel && fy < E.finder.ntop)
+    abAppend(ab, "\x1b[7m", 4);
+  abAppend(ab, buf, len);
+  abAppend(ab, "\x1b[m", 3);
+}
+
+void editorDrawHexRow(struct abuf *ab, size_t line) {
+  hexview *H = &E.hex;
+  size_t off = line * HEX_COLS;
+  char buf[16], ascii[HEX_COLS];
+
+  if (off >= H->size && off > 0) {
+    abAppend(ab, "~", 1);
+    return;
+  }
+
+  abAppend(ab, buf, snprintf(buf, sizeof(buf), "%08zx  ", off));
+  for (int i=0; i<HEX_COLS; i++) {
+    if (i == HEX_COLS/2)
+      abAppend(ab, " ", 1);
+    if (off + i >= H->size) {
+      abAppend(ab, "   ", 3);
+      ascii[i] = ' ';
+      continue;
+    }
+
+    int patched;
+    unsigned char b = hexByte(off + i, &patched);
+    if (patched)
+      abAppend(ab, "\x1b[31m", 5);
+    abAppend(ab, buf, snprintf(buf, sizeof(buf), "%02x", b));
+    if (patched)
+      abAppend(ab, "\x1b[39m", 5);
+    abAppend(ab, " ", 1);
+    ascii[i] = isprint(b) ? b : '.';
+  }
+  abAppend(ab, " |", 2);
+  abAppend(ab, ascii, HEX_COLS);
+  abAppend(ab, "|", 1);
+}
+
+void editorDrawDiffSide(struct abuf *ab, erow *row, int width, int cls) {
+  colors color = editorSyntaxToColor(cls);
+  char buf[16];
+  int curr_fg = -1, len = 0;
+
+  abAppend(ab, buf, snprintf(buf, sizeof(buf), "\x1b[%dm", color.bg));
+  if (row == NULL) {
+    for (; len < width; len++)
+      abAppend(ab, "-", 1);
+  } else {
+    unsigned char *hl = hlDecode(row);
+    char *chars = rowChars(row);
+    for (int j=E.coloff; j<row->size && len<width; j++, len++) {
+      int fg = editorSyntaxToColor(hl[j]).fg;
+      if (fg != curr_fg) {
+        curr_fg = fg;
+        abAppend(ab, buf, snprintf(buf, sizeof(buf), "\x1b[%dm", fg));
+      }
+      abAppend(ab, iscntrl(chars[j]) ? "?" : &chars[j], 1);
+    }
+  }
+  for (; len < width; len++)
+    abAppend(ab, " ", 1);
+  abAppend(ab, "\x1b[39;49m", 8);
+}
+
+void editorDrawDiffRow(struct abuf *ab, int line) {
+  int a, b;
+  int cls = editorDiffLocate(line, &a, &b);
+  int width = (E.screencols - 1) / 2;
+
+  if (a == -1 && b == -1) {
+    abAppend(ab, "~", 1);
+    return;
+  }
+  editorDrawDiffSide(ab, a == -1 ? NULL : &E.row[a], width, cls);
+  abAppend(ab, "|", 1);
+  editorDrawDiffSide(ab, b == -1 ? NULL : &E.diff.rows[b], width, cls);
+}
+
 void editorScroll(void) {
+  if (E.hex.on) {
+    editorHexScroll();
+    return;
+  }
+  if (E.diff.on) {
+    if (E.diff.dirty)
+      editorDiffUpdate();
+    int line = editorDiffLine(E.cy);
+    int width = (E.screencols - 1) / 2;
+    if (line < E.diff.top)
+      E.diff.top = line;
+    if (line >= E.diff.top + E.screenrows)
+      E.diff.top = line - E.screenrows + 1;
+    if (E.cx < E.coloff)
+      E.coloff = E.cx;
+    if (E.cx >= E.coloff + width)
+      E.coloff = E.cx - width + 1;
+    return;
+  }
+  if (E.wrap.on) {
+    int vline, x;
+    editorWrapSync();
+    editorWrapCursor(&vline, &x);
+    if (vline < E.wrap.top)
+      E.wrap.top = vline;
+    if (vline >= E.wrap.top + E.screenrows)
+      E.wrap.top = vline - E.screenrows + 1;
+    E.rowoff = wrapFind(E.wrap.top);
+    E.coloff = 0;
+    return;
+  }
+
   if (E.cy < E.rowoff)
     E.rowoff = E.cy;
   if (E.cy >= E.rowoff + E.screenrows)
@@ -1252,12 +9209,80 @@ void editorScroll(void) {
     E.coloff = E.cx - E.screencols + 1;
 }
 
+void editorDrawRowSpan(struct abuf *ab, int filerow, int from) {
+  erow *row = &E.row[filerow];
+  char *chars = rowChars(row);
+  int to = row->size;
+  if (to > from + E.screencols)
+    to = from + E.screencols;
+
+  const unsigned char *p = hlSpans(row);
+  int sel_from = 0, sel_to = 0, in_sel = 0;
+  editorSelectionCols(filerow, &sel_from, &sel_to);
+
+  for (int at = 0, n, cls; at < to; at += n) {
+    if ((n = hlNext(&p, &cls)) == 0) {
+      cls = HL_NORMAL;
+      n = to - at;
+    }
+    if (at + n <= from)
+      continue;
+
+    colors color = editorSyntaxToColor(cls);
+    char buf[16];
+    int clen = snprintf(buf, sizeof(buf), "\x1b[%d;%dm", color.fg, color.bg);
+    abAppend(ab, buf, clen);
+
+    int j = at < from ? from : at;
+    int end = at + n < to ? at + n : to;
+    while (j < end) {
+      int sel = (j >= sel_from && j < sel_to);
+      if (sel != in_sel) {
+        abAppend(ab, sel ? "\x1b[7m" : "\x1b[27m", sel ? 4 : 5);
+        in_sel = sel;
+      }
+
+      char *c = &chars[j];
+      if (iscntrl(*c)) {
+        char sym = (*c <= 26) ? '@' + *c : '?';
+        abAppend(ab, "\x1b[7m", 4);
+        abAppend(ab, &sym, 1);
+        abAppend(ab, in_sel ? "\x1b[m\x1b[7m" : "\x1b[m", in_sel ? 7 : 3);
+        abAppend(ab, buf, clen);
+        j++;
+        continue;
+      }
+
+      int k = j + 1;
+      while (k < end && !iscntrl(chars[k]) && (k >= sel_from && k < sel_to) == sel)
+        k++;
+      abAppend(ab, c, k - j);
+      j = k;
+    }
+  }
+  if (in_sel)
+    abAppend(ab, "\x1b[27m", 5);
+  abAppend(ab, "\x1b[39;49m", 8);
+}
+
 void editorDrawRows(struct abuf *ab) {
   int y;
-  for (y = 0; y < E.screenrows; y++) {
-    int filerow = y + E.rowoff;
+  int filerow = E.rowoff, sub = 0;
+  if (E.wrap.on && filerow < E.numrows)
+    sub = E.wrap.top - wrapPrefix(filerow);
 
-    if (filerow >= E.numrows) {
+  for (y = 0; y < E.screenrows; y++) {
+    int fy = E.screenrows-1 - y;
+    if (!E.wrap.on)
+      filerow = y + E.rowoff;
+
+    if (E.finder.active && fy <= E.finder.ntop) {
+      editorDrawFinderRow(ab, fy);
+    } else if (E.hex.on) {
+      editorDrawHexRow(ab, E.hex.top + y);
+    } else if (E.diff.on) {
+      editorDrawDiffRow(ab, E.diff.top + y);
+    } else if (filerow >= E.numrows) {
       if (E.numrows == 0 && y == E.screenrows / 3) {
         char welcome[80];
 
@@ -1279,50 +9304,11 @@ void editorDrawRows(struct abuf *ab) {
         abAppend(ab, "~", 1);
       }
     } else {
-      int len = E.row[filerow].size - E.coloff;
-      if (len < 0)
-        len = 0;
-      if (len > E.screencols)
-        len = E.screencols;
-
-      char *c = &E.row[filerow].chars[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
-      int curr_fg = -1;
-      int curr_bg = -1;
-
-      for (int j=0; j<len; j++) {
-        if (iscntrl(c[j])) {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (curr_fg != -1 && curr_bg != -1) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%d;%dm", curr_fg, curr_bg);
-            abAppend(ab, buf, clen);
-          }
-        } else if (hl[j] == HL_NORMAL) {
-          if (curr_fg != -1 && curr_bg != -1) {
-            abAppend(ab, "\x1b[39;49m", 8);
-            curr_fg = -1;
-            curr_bg = -1;
-          }
-          abAppend(ab, &c[j], 1);
-        } else {
-          colors color = editorSyntaxToColor(hl[j]);
-          int fg = color.fg;
-          int bg = color.bg;
-          if (fg != curr_fg && bg != curr_bg) {
-            curr_fg = fg;
-            curr_bg = bg;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%d;%dm", curr_fg, curr_bg);
-            abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
-        }
-      }
-      abAppend(ab, "\x1b[39;49m", 8);
+      editorDrawRowSpan(ab, filerow, E.wrap.on ? sub * E.wrap.cols : E.coloff);
+    }
+    if (E.wrap.on && filerow < E.numrows && ++sub >= E.row[filerow].vlines) {
+      filerow++;
+      sub = 0;
     }
 
     abAppend(ab, "\x1b[K", 3);
@@ -1331,12 +9317,34 @@ void editorDrawRows(struct abuf *ab) {
 }
 
 void editorDrawStatusBar(struct abuf *ab) {
-  char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s %s",
-      E.filename ? E.filename : "[No Name]",
-      E.dirty ? "[+]" : "");
+  char status[80], rstatus[80], rec[40] = "", name[24];
+  int running = editorJobsRunning();
+  if (E.filename)
+    snprintf(name, sizeof(name), "%.20s", E.filename);
+  else if (E.jobs.shown != -1)
+    snprintf(name, sizeof(name), "[job %d]", E.jobs.shown + 1);
+  else
+    snprintf(name, sizeof(name), E.stream.fd != -1 || E.stream.bytes ? "[stdin]" : "[No Name]");
+  if (E.macro.rec)
+    snprintf(rec, sizeof(rec), " recording @%c", E.macro.rec);
+  else if (E.follow.on && E.cy >= E.numrows - 1)
+    snprintf(rec, sizeof(rec), " following");
+  else if (E.stream.fd != -1) {
+    pthread_mutex_lock(&E.stream.lock);
+    size_t bytes = E.stream.bytes;
+    pthread_mutex_unlock(&E.stream.lock);
+    snprintf(rec, sizeof(rec), " reading %.1fMB, %d lines", bytes / 1048576.0, E.numrows);
+  } else if (running)
+    snprintf(rec, sizeof(rec), " %d job%s running", running, running == 1 ? "" : "s");
+  int len = snprintf(status, sizeof(status), "%s %s%s%s", name,
+      E.dirty ? "[+] " : "",
+      E.mode != VISUAL ? "" : E.vmode == 'V' ? "-- VISUAL LINE --" : "-- VISUAL --",
+      rec);
   int rlen = snprintf(rstatus, sizeof(rstatus), "%d,%d %10.0f%%",
       E.cy+1, E.cx+1, 100 * (E.cy+1)/(float)E.numrows);
+  if (E.hex.on)
+    rlen = snprintf(rstatus, sizeof(rstatus), "0x%zx %10.0f%%",
+        E.hex.cur, E.hex.size ? 100 * (E.hex.cur+1)/(double)E.hex.size : 100.0);
 
   if (len > E.screencols)
     len = E.screencols;
@@ -1364,6 +9372,29 @@ void editorDrawMessageBar(struct abuf *ab) {
     abAppend(ab, E.statusmsg, msglen);
 }
 
+long long monotonicMs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+int editorFrameDue(void) {
+  if (E.macro.depth)
+    return 0;
+  if (E.macro.batch) {
+    editorMacroFinish();
+    return 1;
+  }
+
+  int elapsed = monotonicMs() - E.last_frame;
+  int remaining = E.frame_ms - elapsed;
+  struct pollfd p = { STDIN_FILENO, POLLIN, 0 };
+
+  if (poll(&p, 1, remaining > 0 ? remaining : 0) <= 0)
+    return 1;
+  return elapsed >= FRAME_STALL_MS;
+}
+
 void editorRefreshScreen(void) {
   editorScroll();
 
@@ -1376,14 +9407,26 @@ void editorRefreshScreen(void) {
   editorDrawStatusBar(&ab);
   editorDrawMessageBar(&ab);
 
+  int y = E.cy - E.rowoff, x = E.cx - E.coloff;
+  if (E.hex.on) {
+    int col = E.hex.cur % HEX_COLS;
+    y = E.hex.cur / HEX_COLS - E.hex.top;
+    x = 10 + col*3 + (col >= HEX_COLS/2) + (E.hex.nibble != -1);
+  } else if (E.diff.on) {
+    y = editorDiffLine(E.cy) - E.diff.top;
+  } else if (E.wrap.on) {
+    editorWrapCursor(&y, &x);
+    y -= E.wrap.top;
+  }
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy-E.rowoff)+1, (E.cx-E.coloff)+1);
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y+1, x+1);
   abAppend(&ab, buf, strlen(buf));
 
   abAppend(&ab, "\x1b[?25h", 6);
 
   write(STDOUT_FILENO, ab.b, ab.len);
   abFree(&ab);
+  E.last_frame = monotonicMs();
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -1402,34 +9445,104 @@ void initEditor(void) {
   E.rowoff = 0;
   E.coloff = 0;
   E.numrows = 0;
+  E.rowcap = 0;
   E.row = NULL;
   E.dirty = 0;
   E.filename = NULL;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
   E.mode = NORMAL;
+  E.count = 0;
+  E.op = 0;
+  E.regname = 0;
   E.dirsearch = 0;
   E.match_cache = NULL;
   E.num_matches = 0;
   E.match_index = 0;
   E.hl_cache = NULL;
+  E.search = NULL;
+  char *fps = getenv("VIN_FPS");
+  E.frame_ms = 1000 / (fps && atoi(fps) > 0 ? atoi(fps) : FRAME_RATE);
+  char *mem = getenv("VIN_MEM");
+  editorSetMemTarget(mem ? atoi(mem) : 0);
+  E.last_frame = 0;
   E.syntax = NULL;
-
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1)
+  E.syntaxdb = NULL;
+  E.num_syntaxes = 0;
+  editorLoadSyntaxFiles();
+  initCharClasses();
+  E.watch_fd = -1;
+  E.watch_wd = -1;
+  E.jnl.fd = -1;
+  E.jnl.path = NULL;
+  E.jnl.pending = NULL;
+  E.jnl.len = 0;
+  E.jnl.cap = 0;
+  E.jnl.replaying = 0;
+  char *sync_ms = getenv("VIN_FSYNC"), *sync_bytes = getenv("VIN_FSYNC_BYTES");
+  editorJournalSetSync(sync_ms ? atoi(sync_ms) : JOURNAL_SYNC_MS,
+                       sync_bytes ? atoi(sync_bytes) : JOURNAL_SYNC_BYTES);
+  memset(&E.qf, 0, sizeof(E.qf));
+  E.qf.index = -1;
+  pthread_mutex_init(&E.qf.lock, NULL);
+  E.grep = NULL;
+  memset(&E.finder, 0, sizeof(E.finder));
+  E.finder.watch.fd = -1;
+  E.syms.watch.fd = -1;
+  pthread_mutex_init(&E.syms.watch.lock, NULL);
+  pthread_mutex_init(&E.syms.lock, NULL);
+  pthread_mutex_init(&E.finder.watch.lock, NULL);
+  memset(&E.words, 0, sizeof(E.words));
+  memset(&E.compl, 0, sizeof(E.compl));
+  memset(&E.follow, 0, sizeof(E.follow));
+  memset(&E.stream, 0, sizeof(E.stream));
+  memset(&E.jobs, 0, sizeof(E.jobs));
+  E.jobs.shown = -1;
+  E.stream.fd = -1;
+  pthread_mutex_init(&E.stream.lock, NULL);
+  pthread_mutex_init(&E.finder.lock, NULL);
+
+  if (E.server) {
+    E.screenrows = 24;
+    E.screencols = 80;
+  } else if (getWindowSize(&E.screenrows, &E.screencols) == -1)
     die ("getWindowSize");
   E.screenrows -= 2;
 }
 
 int main(int argc, char *argv[]) {
-  enableRawMode();
+  int arg = 1, in = -1;
+
+  if (argc >= 2 && !strcmp(argv[1], "--remote"))
+    editorRemote(argv[2]);
+  if (argc == 2 && !strcmp(argv[1], "-"))
+    in = editorStreamTake();
+  if (argc >= 2 && !strcmp(argv[1], "--server")) {
+    editorServerStart(argv[2]);
+    arg = 2;
+  } else
+    enableRawMode();
   initEditor();
-  if (argc >= 2)
-    editorOpen(argv[1]);
-
-  editorSetStatusMessage("HELP: Leader(Space)-Q = quit");
+  if (E.statusmsg[0] == '\0')
+    editorSetStatusMessage("HELP: Leader(Space)-Q = quit");
+
+  if (argc > arg + 1 && !strcmp(argv[arg], "-b"))
+    editorHexOpen(argv[arg+1]);
+  else if (argc > arg + 2 && !strcmp(argv[arg], "-d")) {
+    editorOpen(argv[arg+1]);
+    editorDiffOpen(argv[arg+2]);
+  } else if (argc > arg + 1 && !strcmp(argv[arg], "+F")) {
+    E.follow.on = 1;
+    editorOpen(argv[arg+1]);
+    E.cy = E.numrows > 0 ? E.numrows-1 : 0;
+  } else if (in != -1)
+    editorStreamOpen(in);
+  else if (argc > arg)
+    editorOpen(argv[arg]);
 
   while (1) {
-    editorRefreshScreen();
+    if (editorFrameDue())
+      editorRefreshScreen();
     editorProcessKeypress(0);
   }
 